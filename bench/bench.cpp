@@ -0,0 +1,866 @@
+// Microbenchmarks for the bitmap and block store hot paths.
+//
+//   hw3_bench [--filter SUBSTRING] [--min-time MS] [--out FILE]
+//             [--baseline FILE] [--threshold PERCENT]
+//
+// Results are printed as JSON (to stdout, or FILE with --out). With --baseline,
+// each result is compared against the matching entry of an earlier run and the
+// exit status is 1 if anything got slower by more than the threshold.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "block_store.h"
+#include "block_store.hpp"
+#include "block_volume.h"
+#include "block_parity.h"
+#include "block_async.h"
+#include "block_server.h"
+#include "block_client.h"
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct bench_result {
+    std::string name;
+    unsigned threads;
+    uint64_t ops;
+    double ns_per_op;
+    double bytes_per_sec;
+};
+
+struct bench_options {
+    std::string filter;
+    double min_time_ms = 200;
+    std::string out;
+    std::string baseline;
+    double threshold = 10;
+};
+
+bench_options options;
+std::vector<bench_result> results;
+
+// Keeps the optimizer from throwing away benchmarked work.
+std::atomic<size_t> sink(0);
+
+// Files and the shared memory segment the benchmarks create, named after the pid so
+// concurrent runs don't collide. Removed at exit and on SIGINT/SIGTERM, so even a
+// cut-short run leaves none behind.
+char image_path[64];
+char image_temp_path[64];  // what block_store_serialize_parallel writes before renaming
+char socket_path[64];
+char segment_name[64];
+
+void remove_scratch_files() {
+    unlink(image_path);
+    unlink(image_temp_path);
+    unlink(socket_path);
+    block_store_unlink_shared(segment_name);
+}
+
+extern "C" void handle_interrupt(int signal_number) {
+    remove_scratch_files();
+    // then die of the signal as if it had not been caught
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+bool selected(const std::string &name) {
+    return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+// A benchmark body runs its operation the given number of times.
+typedef std::function<void(uint64_t)> bench_body;
+
+double elapsed_ns(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+// Runs one body per thread, each for the same number of iterations, and
+// grows the count until the whole run takes at least --min-time.
+// Throughput counts the operations of all threads against wall time.
+void run_threads(const std::string &name, size_t bytes_per_op, const std::vector<bench_body> &bodies) {
+    if (!selected(name)) {
+        return;
+    }
+    const double min_ns = options.min_time_ms * 1e6;
+    uint64_t iterations = 1;
+    double ns = 0;
+    for (;;) {
+        bench_clock::time_point start = bench_clock::now();
+        if (bodies.size() == 1) {
+            bodies[0](iterations);
+        } else {
+            std::vector<std::thread> threads;
+            for (const bench_body &body : bodies) {
+                threads.emplace_back(body, iterations);
+            }
+            for (std::thread &thread : threads) {
+                thread.join();
+            }
+        }
+        ns = elapsed_ns(start);
+        if (ns >= min_ns || iterations >= (1ULL << 40)) {
+            break;
+        }
+        // aim a little past the target so the final run usually sticks
+        double scale = ns > 0 ? 1.2 * min_ns / ns : 100;
+        iterations = std::max<uint64_t>(iterations * 2, std::min<double>(iterations * scale, iterations * 100.0));
+    }
+
+    bench_result result;
+    result.name = name;
+    result.threads = bodies.size();
+    result.ops = iterations * bodies.size();
+    result.ns_per_op = ns / result.ops;
+    result.bytes_per_sec = bytes_per_op ? bytes_per_op * 1e9 / result.ns_per_op : 0;
+    results.push_back(result);
+    std::cerr << name << ": " << result.ns_per_op << " ns/op" << std::endl;
+}
+
+void run(const std::string &name, size_t bytes_per_op, const bench_body &body) {
+    run_threads(name, bytes_per_op, std::vector<bench_body>(1, body));
+}
+
+//
+// Bitmap
+//
+
+// Bitmap with the given fraction of bits set at random positions.
+bitmap_t *random_bitmap(size_t bits, double fill, unsigned seed) {
+    bitmap_t *bitmap = bitmap_create(bits);
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> coin(0, 1);
+    for (size_t bit = 0; bit < bits; ++bit) {
+        if (coin(rng) < fill) {
+            bitmap_set(bitmap, bit);
+        }
+    }
+    return bitmap;
+}
+
+// Bitmap with the first fraction of bits set, so ffz has to scan past them.
+bitmap_t *prefix_bitmap(size_t bits, double fill) {
+    bitmap_t *bitmap = bitmap_create(bits);
+    for (size_t bit = 0; bit < bits * fill; ++bit) {
+        bitmap_set(bitmap, bit);
+    }
+    return bitmap;
+}
+
+void count_bit(size_t bit, void *arg) {
+    *static_cast<size_t *>(arg) += bit;
+}
+
+void bench_bitmap() {
+    const size_t sizes[] = {256, 4096, 65536, 1 << 20};
+    const double fills[] = {0.0, 0.5, 0.99};
+    for (size_t bits : sizes) {
+        for (double fill : fills) {
+            std::ostringstream suffix;
+            suffix << "/" << bits << "/" << static_cast<int>(fill * 100);
+            const size_t bytes = bits / 8;
+
+            bitmap_t *prefix = prefix_bitmap(bits, fill);
+            run("bitmap_ffz" + suffix.str(), bytes, [prefix](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) sink += bitmap_ffz(prefix);
+            });
+            bitmap_invert(prefix);
+            run("bitmap_ffs" + suffix.str(), bytes, [prefix](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) sink += bitmap_ffs(prefix);
+            });
+            bitmap_destroy(prefix);
+
+            bitmap_t *random = random_bitmap(bits, fill, bits);
+            run("bitmap_total_set" + suffix.str(), bytes, [random](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) sink += bitmap_total_set(random);
+            });
+            run("bitmap_for_each" + suffix.str(), bytes, [random](uint64_t n) {
+                size_t total = 0;
+                for (uint64_t i = 0; i < n; ++i) bitmap_for_each(random, count_bit, &total);
+                sink += total;
+            });
+            bitmap_destroy(random);
+        }
+    }
+}
+
+//
+// Block store
+//
+
+// Store with roughly half of its blocks allocated at random, and the list of them.
+block_store_t *half_full_store(std::vector<size_t> &allocated, unsigned seed) {
+    block_store_t *bs = block_store_create();
+    std::mt19937 rng(seed);
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        if (rng() % 2 && block_store_request(bs, id)) {
+            allocated.push_back(id);
+        }
+    }
+    return bs;
+}
+
+// Concurrent-mode store with every block allocated except block 0, which can't be read.
+// With a name, the store is a shared one on that segment (concurrent too).
+block_store_t *concurrent_store(std::vector<size_t> &allocated, const char *shm_name = nullptr) {
+    block_store_config_t config = {BLOCK_STORE_CONCURRENT};
+    block_store_t *bs = shm_name ? block_store_create_shared(shm_name, nullptr) : block_store_create_ex(&config);
+    for (size_t id = 1; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        if (block_store_request(bs, id)) {
+            allocated.push_back(id);
+        }
+    }
+    return bs;
+}
+
+// Steady-state churn: free a random allocated block, allocate a new one.
+bench_body churn_body(unsigned seed, block_store_policy_t policy = BLOCK_STORE_POLICY_FIRST_FIT) {
+    std::shared_ptr<std::vector<size_t>> allocated = std::make_shared<std::vector<size_t>>();
+    std::shared_ptr<block_store_t> bs(half_full_store(*allocated, seed), block_store_destroy);
+    block_store_set_policy(bs.get(), policy);
+    std::shared_ptr<std::mt19937> rng = std::make_shared<std::mt19937>(seed);
+    return [=](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t &slot = (*allocated)[(*rng)() % allocated->size()];
+            block_store_release(bs.get(), slot);
+            slot = block_store_allocate(bs.get());
+        }
+    };
+}
+
+// Churn that asks for a block next to the one it just freed.
+bench_body near_body(unsigned seed) {
+    std::shared_ptr<std::vector<size_t>> allocated = std::make_shared<std::vector<size_t>>();
+    std::shared_ptr<block_store_t> bs(half_full_store(*allocated, seed), block_store_destroy);
+    std::shared_ptr<std::mt19937> rng = std::make_shared<std::mt19937>(seed);
+    return [=](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t &slot = (*allocated)[(*rng)() % allocated->size()];
+            block_store_release(bs.get(), slot);
+            slot = block_store_allocate_near(bs.get(), slot + 1);
+        }
+    };
+}
+
+// Allocate a batch of blocks in an empty store and free them again.
+bench_body batch_body(size_t count, bool bulk) {
+    std::shared_ptr<block_store_t> bs(block_store_create(), block_store_destroy);
+    return [=](uint64_t n) {
+        std::vector<size_t> ids(count);
+        for (uint64_t i = 0; i < n; ++i) {
+            if (bulk) {
+                sink += block_store_allocate_n(bs.get(), count, ids.data(), true);
+            } else {
+                for (size_t &id : ids) id = block_store_allocate(bs.get());
+            }
+            for (size_t id : ids) block_store_release(bs.get(), id);
+        }
+    };
+}
+
+// Fill the first count blocks and free them again, one by one or as a range.
+bench_body release_body(size_t count, bool range, unsigned flags) {
+    std::shared_ptr<block_store_t> bs(block_store_create(), block_store_destroy);
+    return [=](uint64_t n) {
+        std::vector<size_t> ids(count);
+        for (uint64_t i = 0; i < n; ++i) {
+            sink += block_store_allocate_n(bs.get(), count, ids.data(), true);
+            if (range) {
+                sink += block_store_release_range(bs.get(), 0, count, flags);
+            } else {
+                for (size_t id : ids) block_store_release(bs.get(), id);
+            }
+        }
+    };
+}
+
+// Allocate and free a 2^order extent in a half full store with the first half of it kept full.
+bench_body extent_body(unsigned order, block_store_policy_t policy) {
+    std::shared_ptr<block_store_t> bs(block_store_create(), block_store_destroy);
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS / 2; ++id) {
+        block_store_request(bs.get(), id);
+    }
+    block_store_set_policy(bs.get(), policy);
+    return [=](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t id = block_store_allocate_extent(bs.get(), order);
+            sink += id;
+            block_store_release_extent(bs.get(), id, order);
+        }
+    };
+}
+
+bench_body read_body(unsigned seed) {
+    std::shared_ptr<std::vector<size_t>> allocated = std::make_shared<std::vector<size_t>>();
+    std::shared_ptr<block_store_t> bs(half_full_store(*allocated, seed), block_store_destroy);
+    allocated->erase(std::remove(allocated->begin(), allocated->end(), 0), allocated->end());
+    return [=](uint64_t n) {
+        char buffer[BLOCK_SIZE_BYTES];
+        for (uint64_t i = 0; i < n; ++i) {
+            sink += block_store_read(bs.get(), (*allocated)[i % allocated->size()], buffer);
+        }
+    };
+}
+
+// Read every block in order, with the whole store advised as given.
+bench_body scan_body(block_store_advice_t advice) {
+    std::shared_ptr<block_store_t> bs(block_store_create(), block_store_destroy);
+    block_store_advise(bs.get(), 0, BLOCK_STORE_NUM_BLOCKS, advice);
+    return [=](uint64_t n) {
+        char buffer[BLOCK_SIZE_BYTES];
+        for (uint64_t i = 0; i < n; ++i) {
+            sink += block_store_read(bs.get(), 1 + i % (BLOCK_STORE_NUM_BLOCKS - 1), buffer);
+        }
+    };
+}
+
+bench_body write_body(unsigned seed) {
+    std::shared_ptr<std::vector<size_t>> allocated = std::make_shared<std::vector<size_t>>();
+    std::shared_ptr<block_store_t> bs(half_full_store(*allocated, seed), block_store_destroy);
+    return [=](uint64_t n) {
+        char buffer[BLOCK_SIZE_BYTES];
+        memset(buffer, static_cast<int>(n), sizeof(buffer));
+        for (uint64_t i = 0; i < n; ++i) {
+            sink += block_store_write(bs.get(), (*allocated)[i % allocated->size()], buffer);
+        }
+    };
+}
+
+// The header-only template, same geometry and fill as half_full_store.
+typedef BlockStore<BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES> cpp_store;
+
+std::shared_ptr<cpp_store> half_full_cpp_store(std::vector<size_t> &allocated, unsigned seed) {
+    std::shared_ptr<cpp_store> bs = std::make_shared<cpp_store>();
+    std::mt19937 rng(seed);
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        if (rng() % 2 && bs->request(id)) {
+            allocated.push_back(id);
+        }
+    }
+    return bs;
+}
+
+void bench_cpp_store() {
+    std::vector<size_t> allocated;
+    std::shared_ptr<cpp_store> bs = half_full_cpp_store(allocated, 1);
+    std::mt19937 rng(1);
+    run("block_store_cpp_allocate_release/churn", 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            size_t &slot = allocated[rng() % allocated.size()];
+            bs->release(slot);
+            slot = bs->allocate();
+        }
+    });
+    run("block_store_cpp_read", BLOCK_SIZE_BYTES, [&](uint64_t n) {
+        char buffer[BLOCK_SIZE_BYTES];
+        for (uint64_t i = 0; i < n; ++i) {
+            sink += bs->read(allocated[i % allocated.size()], buffer);
+        }
+    });
+    run("block_store_cpp_write", BLOCK_SIZE_BYTES, [&](uint64_t n) {
+        char buffer[BLOCK_SIZE_BYTES];
+        memset(buffer, static_cast<int>(n), sizeof(buffer));
+        for (uint64_t i = 0; i < n; ++i) {
+            sink += bs->write(allocated[i % allocated.size()], buffer);
+        }
+    });
+}
+
+// Create a store, touch every block once, destroy it.
+bench_body lifecycle_body(unsigned flags) {
+    return [flags](uint64_t n) {
+        block_store_config_t config = {flags};
+        char buffer[BLOCK_SIZE_BYTES] = {1};
+        for (uint64_t i = 0; i < n; ++i) {
+            block_store_t *bs = block_store_create_ex(&config);
+            for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+                if (id != BITMAP_START_BLOCK) {
+                    sink += block_store_write(bs, id, buffer);
+                }
+            }
+            block_store_destroy(bs);
+        }
+    };
+}
+
+// Fully compact a clone of a half-full store, in slices of max_moves blocks.
+bench_body compact_body(size_t max_moves) {
+    std::shared_ptr<std::vector<size_t>> allocated = std::make_shared<std::vector<size_t>>();
+    std::shared_ptr<block_store_t> bs(half_full_store(*allocated, 9), block_store_destroy);
+    return [=](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            block_store_t *clone = block_store_clone(bs.get());
+            size_t moved;
+            do {
+                moved = block_store_compact(clone, max_moves, nullptr, nullptr, nullptr);
+            } while (moved != 0 && moved != SIZE_MAX);
+            block_store_destroy(clone);
+        }
+    };
+}
+
+// Duplicate 64 blocks from one store into another, through a buffer or with
+// block_store_copy_range. dst_first 128 + 16 keeps chunks aligned, so whole
+// chunks get shared; + 8 makes every block move.
+bench_body copy_body(bool copy_range, size_t dst_first) {
+    std::shared_ptr<block_store_t> src(block_store_create(), block_store_destroy);
+    std::shared_ptr<block_store_t> dst(block_store_create(), block_store_destroy);
+    char buffer[BLOCK_SIZE_BYTES] = {1};
+    for (size_t id = 16; id < 80; ++id) {
+        block_store_write(src.get(), id, buffer);
+    }
+    return [=](uint64_t n) {
+        char block[BLOCK_SIZE_BYTES];
+        for (uint64_t i = 0; i < n; ++i) {
+            if (copy_range) {
+                sink += block_store_copy_range(dst.get(), dst_first, src.get(), 16, 64);
+            } else {
+                for (size_t id = 0; id < 64; ++id) {
+                    block_store_read(src.get(), 16 + id, block);
+                    sink += block_store_write(dst.get(), dst_first + id, block);
+                }
+            }
+            // writing the source unshares any chunk just cloned, as in a live store
+            sink += block_store_write(src.get(), 16 + i % 64, buffer);
+        }
+    };
+}
+
+// Allocate, write and release one block of an otherwise empty chunk, so a
+// sparse store allocates and frees the chunk every time.
+bench_body chunk_cycle_body(unsigned flags) {
+    block_store_config_t config = {flags};
+    std::shared_ptr<block_store_t> bs(block_store_create_ex(&config), block_store_destroy);
+    return [=](uint64_t n) {
+        char buffer[BLOCK_SIZE_BYTES] = {1};
+        for (uint64_t i = 0; i < n; ++i) {
+            block_store_request(bs.get(), 200);
+            sink += block_store_write(bs.get(), 200, buffer);
+            block_store_release(bs.get(), 200);
+        }
+    };
+}
+
+void bench_block_store() {
+    run("block_store_create_touch_destroy", BLOCK_STORE_NUM_BYTES, lifecycle_body(0));
+    run("block_store_create_touch_destroy/prefault", BLOCK_STORE_NUM_BYTES, lifecycle_body(BLOCK_STORE_ARENA_PREFAULT));
+    run("block_store_create_touch_destroy/hugepages", BLOCK_STORE_NUM_BYTES,
+        lifecycle_body(BLOCK_STORE_ARENA_HUGEPAGES | BLOCK_STORE_ARENA_PREFAULT));
+    run("block_store_create_touch_destroy/sparse", BLOCK_STORE_NUM_BYTES, lifecycle_body(BLOCK_STORE_SPARSE));
+    run("block_store_write_release", BLOCK_SIZE_BYTES, chunk_cycle_body(0));
+    run("block_store_write_release/sparse", BLOCK_SIZE_BYTES, chunk_cycle_body(BLOCK_STORE_SPARSE));
+    run("block_store_allocate_release/churn", 0, churn_body(1));
+    run("block_store_allocate_release/churn/buddy", 0, churn_body(1, BLOCK_STORE_POLICY_BUDDY));
+    run("block_store_allocate_release/churn/next_fit", 0, churn_body(1, BLOCK_STORE_POLICY_NEXT_FIT));
+    run("block_store_allocate_release/churn/best_fit", 0, churn_body(1, BLOCK_STORE_POLICY_BEST_FIT));
+    {
+        std::vector<size_t> allocated;
+        std::shared_ptr<block_store_t> bs(half_full_store(allocated, 9), block_store_destroy);
+        run("block_store_fragmentation_report", 0, [&](uint64_t n) {
+            block_store_fragmentation_t report;
+            for (uint64_t i = 0; i < n; ++i) {
+                sink += block_store_fragmentation_report(bs.get(), &report);
+            }
+        });
+    }
+    {
+        // admission control asks for capacity on every decision
+        std::vector<size_t> allocated;
+        std::shared_ptr<block_store_t> bs(half_full_store(allocated, 2), block_store_destroy);
+        run("block_store_get_free_blocks", 0, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                sink += block_store_get_free_blocks(bs.get());
+            }
+        });
+    }
+    run("block_store_compact/slice:8", 0, compact_body(8));
+    run("block_store_compact/slice:all", 0, compact_body(BLOCK_STORE_NUM_BLOCKS));
+    run("block_store_read_write/copy:64", 64 * BLOCK_SIZE_BYTES, copy_body(false, 144));
+    run("block_store_copy_range/copy:64", 64 * BLOCK_SIZE_BYTES, copy_body(true, 136));
+    run("block_store_copy_range/copy:64/aligned", 64 * BLOCK_SIZE_BYTES, copy_body(true, 144));
+    run("block_store_allocate_release/churn/near", 0, churn_body(1, BLOCK_STORE_POLICY_NEAR));
+    run("block_store_allocate_near/churn", 0, near_body(1));
+    run("block_store_allocate/batch:64", 0, batch_body(64, false));
+    run("block_store_allocate_n/batch:64", 0, batch_body(64, true));
+    run("block_store_release/range:128", 0, release_body(128, false, 0));
+    run("block_store_release_range/range:128", 0, release_body(128, true, 0));
+    run("block_store_release_range/range:128/zero", 128 * BLOCK_SIZE_BYTES, release_body(128, true, BLOCK_STORE_RELEASE_ZERO));
+    run("block_store_release_range/range:128/discard", 128 * BLOCK_SIZE_BYTES,
+        release_body(128, true, BLOCK_STORE_RELEASE_DISCARD));
+    const unsigned orders[] = {0, 3, 6};
+    for (unsigned order : orders) {
+        const std::string suffix = "/order:" + std::to_string(order);
+        run("block_store_allocate_extent" + suffix, 0, extent_body(order, BLOCK_STORE_POLICY_FIRST_FIT));
+        run("block_store_allocate_extent/buddy" + suffix, 0, extent_body(order, BLOCK_STORE_POLICY_BUDDY));
+    }
+    run("block_store_read", BLOCK_SIZE_BYTES, read_body(1));
+    run("block_store_read/scan", BLOCK_SIZE_BYTES, scan_body(BLOCK_STORE_ADVICE_NORMAL));
+    run("block_store_read/scan/sequential", BLOCK_SIZE_BYTES, scan_body(BLOCK_STORE_ADVICE_SEQUENTIAL));
+    run("block_store_write", BLOCK_SIZE_BYTES, write_body(1));
+
+    // each thread works on its own store, the API does no locking
+    const unsigned thread_counts[] = {2, 4, 8};
+    for (unsigned threads : thread_counts) {
+        std::vector<bench_body> churn, reads, writes;
+        for (unsigned t = 0; t < threads; ++t) {
+            churn.push_back(churn_body(t + 1));
+            reads.push_back(read_body(t + 1));
+            writes.push_back(write_body(t + 1));
+        }
+        const std::string suffix = "/threads:" + std::to_string(threads);
+        run_threads("block_store_allocate_release/churn" + suffix, 0, churn);
+        run_threads("block_store_read" + suffix, BLOCK_SIZE_BYTES, reads);
+        run_threads("block_store_write" + suffix, BLOCK_SIZE_BYTES, writes);
+
+        // one concurrent store shared by all threads, the first of them writing; then
+        // the same on a shared memory segment, where writers also take its lock
+        for (const char *name : {static_cast<const char *>(nullptr), static_cast<const char *>(segment_name)}) {
+            const std::string bench_name =
+                std::string("block_store_read_write_95_5/") + (name ? "shared" : "concurrent") + suffix;
+            if (!selected(bench_name)) {
+                continue;
+            }
+            std::vector<size_t> allocated;
+            std::shared_ptr<block_store_t> shared(concurrent_store(allocated, name), block_store_destroy);
+            std::vector<bench_body> mixed;
+            for (unsigned t = 0; t < threads; ++t) {
+                mixed.push_back([shared, allocated, t](uint64_t n) {
+                    char buffer[BLOCK_SIZE_BYTES] = {0};
+                    for (uint64_t i = 0; i < n; ++i) {
+                        const size_t id = allocated[(i * 7 + t) % allocated.size()];
+                        if (t == 0 && i % 20 == 0) {
+                            sink += block_store_write(shared.get(), id, buffer);
+                        } else {
+                            sink += block_store_read(shared.get(), id, buffer);
+                        }
+                    }
+                });
+            }
+            run_threads(bench_name, BLOCK_SIZE_BYTES, mixed);
+            if (name) {
+                block_store_unlink_shared(name);
+            }
+        }
+    }
+}
+
+// Vectored reads and writes of 64 blocks spread over every store of a volume.
+void bench_volume() {
+    const size_t store_counts[] = {1, 2, 4, 8};
+    for (size_t stores : store_counts) {
+        std::shared_ptr<block_volume_t> volume(block_volume_create(stores, BLOCK_VOLUME_ROUND_ROBIN), block_volume_destroy);
+        std::vector<size_t> ids;
+        while (ids.size() < 64) {
+            ids.push_back(block_volume_allocate(volume.get()));
+        }
+        std::vector<char> data(ids.size() * BLOCK_SIZE_BYTES, 'v');
+        std::vector<void *> buffers;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            buffers.push_back(&data[i * BLOCK_SIZE_BYTES]);
+        }
+        const std::string suffix = "/stores:" + std::to_string(stores);
+        run("block_volume_writev" + suffix, ids.size() * BLOCK_SIZE_BYTES, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+                sink += block_volume_writev(volume.get(), ids.data(), ids.size(), (const void *const *) buffers.data());
+        });
+        run("block_volume_readv" + suffix, ids.size() * BLOCK_SIZE_BYTES, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+                sink += block_volume_readv(volume.get(), ids.data(), ids.size(), buffers.data());
+        });
+    }
+
+    // the same writes with every one folded into the parity
+    for (size_t n_parity = 1; n_parity <= BLOCK_PARITY_MAX; ++n_parity) {
+        std::shared_ptr<block_volume_t> volume(block_volume_create_parity(4, n_parity, BLOCK_VOLUME_ROUND_ROBIN),
+                                               block_volume_destroy);
+        std::vector<size_t> ids;
+        while (ids.size() < 64) {
+            ids.push_back(block_volume_allocate(volume.get()));
+        }
+        std::vector<char> data(ids.size() * BLOCK_SIZE_BYTES, 'v');
+        std::vector<const void *> buffers;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            buffers.push_back(&data[i * BLOCK_SIZE_BYTES]);
+        }
+        run("block_volume_writev/stores:4/parity:" + std::to_string(n_parity), ids.size() * BLOCK_SIZE_BYTES, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+                sink += block_volume_writev(volume.get(), ids.data(), ids.size(), buffers.data());
+        });
+    }
+}
+
+// Encode and rebuild whole store images, 8 data + P (+ Q); bytes are data bytes.
+void bench_parity() {
+    const size_t n_data = 8;
+    const std::string kernel = block_parity_kernel();
+    std::vector<std::vector<uint8_t>> images(n_data + BLOCK_PARITY_MAX, std::vector<uint8_t>(BLOCK_STORE_NUM_BYTES));
+    std::vector<void *> buffers;
+    for (size_t i = 0; i < images.size(); ++i) {
+        for (size_t j = 0; j < BLOCK_STORE_NUM_BYTES; ++j) {
+            images[i][j] = static_cast<uint8_t>(i * 131 + j * 7);
+        }
+        buffers.push_back(images[i].data());
+    }
+    const std::vector<const void *> data(buffers.begin(), buffers.begin() + n_data);
+    for (size_t n_parity = 1; n_parity <= BLOCK_PARITY_MAX; ++n_parity) {
+        const std::string suffix = "/parity:" + std::to_string(n_parity) + "/" + kernel;
+        run("block_parity_encode" + suffix, n_data * BLOCK_STORE_NUM_BYTES, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+                sink += block_parity_encode(data.data(), n_data, &buffers[n_data], n_parity, BLOCK_STORE_NUM_BYTES);
+        });
+    }
+    block_parity_encode(data.data(), n_data, &buffers[n_data], BLOCK_PARITY_MAX, BLOCK_STORE_NUM_BYTES);
+
+    // one data image from P, one from Q alone, two from both
+    const size_t from_p[] = {3}, from_q[] = {3, n_data}, two[] = {2, 5};
+    run("block_parity_recover/lost:1/" + kernel, n_data * BLOCK_STORE_NUM_BYTES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i)
+            sink += block_parity_recover(buffers.data(), n_data, BLOCK_PARITY_MAX, from_p, 1, BLOCK_STORE_NUM_BYTES);
+    });
+    run("block_parity_recover/lost:1+p/" + kernel, n_data * BLOCK_STORE_NUM_BYTES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i)
+            sink += block_parity_recover(buffers.data(), n_data, BLOCK_PARITY_MAX, from_q, 2, BLOCK_STORE_NUM_BYTES);
+    });
+    run("block_parity_recover/lost:2/" + kernel, n_data * BLOCK_STORE_NUM_BYTES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i)
+            sink += block_parity_recover(buffers.data(), n_data, BLOCK_PARITY_MAX, two, 2, BLOCK_STORE_NUM_BYTES);
+    });
+}
+
+// Keep a window of reads in flight and reap them as they complete.
+void bench_async() {
+    const size_t worker_counts[] = {1, 2, 4};
+    for (size_t workers : worker_counts) {
+        std::vector<size_t> allocated;
+        std::shared_ptr<block_store_t> bs(half_full_store(allocated, 3), block_store_destroy);
+        allocated.erase(std::remove(allocated.begin(), allocated.end(), 0), allocated.end());
+        std::shared_ptr<block_async_t> async(block_async_create(bs.get(), workers, 32), block_async_destroy);
+        run("block_async_read/depth:32/workers:" + std::to_string(workers), BLOCK_SIZE_BYTES, [&](uint64_t n) {
+            std::vector<block_async_request_t> requests(32);
+            std::vector<block_async_request_t *> free_requests, done(32);
+            std::vector<std::vector<char>> buffers(32, std::vector<char>(BLOCK_SIZE_BYTES));
+            for (size_t i = 0; i < requests.size(); ++i) {
+                requests[i] = block_async_request_t();
+                requests[i].op = BLOCK_ASYNC_READ;
+                requests[i].buffer = buffers[i].data();
+                free_requests.push_back(&requests[i]);
+            }
+            uint64_t submitted = 0, completed = 0;
+            while (completed < n) {
+                while (submitted < n && !free_requests.empty()) {
+                    block_async_request_t *request = free_requests.back();
+                    free_requests.pop_back();
+                    request->block_id = allocated[submitted % allocated.size()];
+                    block_async_submit(async.get(), request, true);
+                    ++submitted;
+                }
+                size_t reaped = block_async_reap(async.get(), done.data(), done.size());
+                if (reaped == 0) {
+                    struct pollfd pfd = {block_async_fd(async.get()), POLLIN, 0};
+                    poll(&pfd, 1, -1);
+                }
+                for (size_t i = 0; i < reaped; ++i) {
+                    sink += done[i]->result;
+                    free_requests.push_back(done[i]);
+                }
+                completed += reaped;
+            }
+        });
+    }
+}
+
+// Reads through a block server on another thread, one block per round trip
+// and then a whole ring's worth of blocks per round trip.
+void bench_server() {
+    std::vector<size_t> allocated;
+    std::shared_ptr<block_store_t> bs(half_full_store(allocated, 5), block_store_destroy);
+    allocated.erase(std::remove(allocated.begin(), allocated.end(), 0), allocated.end());
+    std::shared_ptr<block_server_t> server(block_server_create(bs.get(), socket_path, nullptr, BLOCK_SERVER_DEFAULT_SLOTS),
+                                           block_server_destroy);
+    std::thread serving([&]() { block_server_run(server.get()); });
+    std::shared_ptr<block_client_t> client(block_client_connect(socket_path), block_client_disconnect);
+
+    run("block_client_read", BLOCK_SIZE_BYTES, [&](uint64_t n) {
+        char buffer[BLOCK_SIZE_BYTES];
+        for (uint64_t i = 0; i < n; ++i) {
+            sink += block_client_read(client.get(), allocated[i % allocated.size()], buffer);
+        }
+    });
+    std::vector<size_t> ids(allocated.begin(), allocated.begin() + BLOCK_SERVER_DEFAULT_SLOTS);
+    std::vector<char> data(ids.size() * BLOCK_SIZE_BYTES);
+    std::vector<void *> buffers;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        buffers.push_back(&data[i * BLOCK_SIZE_BYTES]);
+    }
+    run("block_client_readv/batch:" + std::to_string(ids.size()), ids.size() * BLOCK_SIZE_BYTES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            sink += block_client_readv(client.get(), ids.data(), ids.size(), buffers.data());
+        }
+    });
+
+    client.reset();
+    block_server_stop(server.get());
+    serving.join();
+}
+
+void bench_serialize() {
+    std::vector<size_t> allocated;
+    std::shared_ptr<block_store_t> bs(half_full_store(allocated, 7), block_store_destroy);
+    const std::string path = image_path;
+
+    run("block_store_serialize", BLOCK_STORE_NUM_BYTES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) sink += block_store_serialize(bs.get(), path.c_str());
+    });
+    run("block_store_deserialize", BLOCK_STORE_NUM_BYTES, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) block_store_destroy(block_store_deserialize(path.c_str()));
+    });
+    run("block_store_read_superblock", 0, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) sink += block_store_read_superblock(path.c_str(), NULL);
+    });
+
+    // bytes_per_sec of these shows how far more threads push the device
+    const size_t thread_counts[] = {1, 2, 4, 8};
+    for (size_t threads : thread_counts) {
+        const std::string suffix = "/threads:" + std::to_string(threads);
+        run("block_store_serialize_parallel" + suffix, BLOCK_STORE_NUM_BYTES, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) sink += block_store_serialize_parallel(bs.get(), path.c_str(), threads);
+        });
+        run("block_store_deserialize_parallel" + suffix, BLOCK_STORE_NUM_BYTES, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) block_store_destroy(block_store_deserialize_parallel(path.c_str(), threads));
+        });
+    }
+    unlink(path.c_str());
+}
+
+//
+// Output and baseline comparison
+//
+
+// Reads name -> ns_per_op back out of a file this program wrote.
+std::map<std::string, double> load_baseline(const std::string &path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path.c_str());
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t name = line.find("\"name\": \"");
+        size_t ns = line.find("\"ns_per_op\": ");
+        if (name == std::string::npos || ns == std::string::npos) {
+            continue;
+        }
+        name += 9;
+        baseline[line.substr(name, line.find('"', name) - name)] = strtod(line.c_str() + ns + 13, NULL);
+    }
+    return baseline;
+}
+
+bool write_results(std::ostream &out) {
+    std::map<std::string, double> baseline;
+    if (!options.baseline.empty()) {
+        baseline = load_baseline(options.baseline);
+        if (baseline.empty()) {
+            std::cerr << "no results found in baseline " << options.baseline << std::endl;
+        }
+    }
+
+    bool regressed = false;
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const bench_result &result = results[i];
+        out << "    {\"name\": \"" << result.name << "\", \"threads\": " << result.threads
+            << ", \"ops\": " << result.ops << ", \"ns_per_op\": " << result.ns_per_op
+            << ", \"bytes_per_sec\": " << result.bytes_per_sec;
+        std::map<std::string, double>::const_iterator old = baseline.find(result.name);
+        if (old != baseline.end() && old->second > 0) {
+            const double change = 100.0 * (result.ns_per_op - old->second) / old->second;
+            const bool slower = change > options.threshold;
+            regressed = regressed || slower;
+            out << ", \"baseline_ns_per_op\": " << old->second << ", \"change_pct\": " << change
+                << ", \"regression\": " << (slower ? "true" : "false");
+            if (slower) {
+                std::cerr << "REGRESSION " << result.name << ": " << old->second << " -> " << result.ns_per_op
+                          << " ns/op (+" << change << "%)" << std::endl;
+            }
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return !regressed;
+}
+
+void usage(const char *program) {
+    std::cerr << "usage: " << program
+              << " [--filter SUBSTRING] [--min-time MS] [--out FILE] [--baseline FILE] [--threshold PERCENT]"
+              << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        if (arg == "--filter") {
+            options.filter = argv[++i];
+        } else if (arg == "--min-time") {
+            options.min_time_ms = strtod(argv[++i], NULL);
+        } else if (arg == "--out") {
+            options.out = argv[++i];
+        } else if (arg == "--baseline") {
+            options.baseline = argv[++i];
+        } else if (arg == "--threshold") {
+            options.threshold = strtod(argv[++i], NULL);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    snprintf(image_path, sizeof(image_path), "hw3_bench_%d.bs", static_cast<int>(getpid()));
+    snprintf(image_temp_path, sizeof(image_temp_path), "hw3_bench_%d.bs.tmp", static_cast<int>(getpid()));
+    snprintf(socket_path, sizeof(socket_path), "hw3_bench_%d.sock", static_cast<int>(getpid()));
+    snprintf(segment_name, sizeof(segment_name), "/hw3_bench_%d", static_cast<int>(getpid()));
+    atexit(remove_scratch_files);
+    struct sigaction action = {};
+    action.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    bench_bitmap();
+    bench_block_store();
+    bench_cpp_store();
+    bench_volume();
+    bench_parity();
+    bench_async();
+    bench_server();
+    bench_serialize();
+
+    bool ok;
+    if (options.out.empty()) {
+        ok = write_results(std::cout);
+    } else {
+        std::ofstream out(options.out.c_str());
+        ok = write_results(out);
+    }
+    return ok ? 0 : 1;
+}
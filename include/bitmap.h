@@ -32,6 +32,14 @@ void bitmap_set(bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Clears a range of bits, whole bytes at a time
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count Number of bits to clear (clamped to the end of the bitmap)
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
 ///
 /// Returns bit in bitmap
 /// \param bitmap The bitmap
@@ -67,6 +75,38 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first set at or after a bit
+/// \param bitmap The bitmap
+/// \param start The first bit to look at
+/// \return The first one bit address >= start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffs_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first zero at or after a bit
+/// \param bitmap The bitmap
+/// \param start The first bit to look at
+/// \return The first zero bit address >= start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find last zero at or before a bit
+/// \param bitmap The bitmap
+/// \param start The last bit to look at (clamped to the end of the bitmap)
+/// \return The last zero bit address <= start, SIZE_MAX on error/not found
+///
+size_t bitmap_flz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find last set at or before a bit
+/// \param bitmap The bitmap
+/// \param start The last bit to look at (clamped to the end of the bitmap)
+/// \return The last one bit address <= start, SIZE_MAX on error/not found
+///
+size_t bitmap_fls_from(const bitmap_t *const bitmap, const size_t start);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
@@ -0,0 +1,89 @@
+#ifndef BLOCK_ASYNC_H__
+#define BLOCK_ASYNC_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+	// Asynchronous access to one block store. Requests are queued to a small
+	//  worker pool and completed either through the request's callback (run on
+	//  a worker) or on a completion queue, reaped by the caller when the
+	//  context's eventfd polls readable. The submission queue is bounded, so a
+	//  caller that outruns the workers is pushed back rather than buffered.
+	typedef struct block_async block_async_t;
+
+	typedef enum
+	{
+		BLOCK_ASYNC_READ,      // block_store_read(block_id, buffer)
+		BLOCK_ASYNC_WRITE,     // block_store_write(block_id, buffer)
+		BLOCK_ASYNC_ALLOCATE,  // block_store_allocate
+		BLOCK_ASYNC_SYNC       // block_store_serialize(filename), after every request submitted before it
+	} block_async_op_t;
+
+	// A request, owned by the caller and left alone until it completes.
+	//  Fill in the fields for the operation and submit it; its address is the handle.
+	typedef struct block_async_request
+	{
+		block_async_op_t op;
+		size_t block_id;
+		void *buffer;              // BLOCK_SIZE_BYTES, read into or written from
+		const char *filename;      // for BLOCK_ASYNC_SYNC
+		void (*callback)(struct block_async_request *request, void *arg);  // NULL to use the completion queue
+		void *arg;                 // passed to callback
+		size_t result;             // on completion: what the synchronous call returned
+
+		struct block_async_request *next;  // internal
+	} block_async_request_t;
+
+	///
+	/// Starts a worker pool for a block store
+	///  Until the context is destroyed, the store must only be used through it.
+	/// \param bs The block store, not owned by the context
+	/// \param n_workers Number of worker threads
+	/// \param queue_depth Most requests waiting to be picked up by a worker
+	/// \return Pointer to the new context, NULL on error
+	///
+	block_async_t *block_async_create(block_store_t *const bs, const size_t n_workers, const size_t queue_depth);
+
+	///
+	/// Finishes every submitted request, stops the workers and frees the context
+	///  Completions not yet reaped are dropped.
+	/// \param async The context, may be NULL
+	///
+	void block_async_destroy(block_async_t *const async);
+
+	///
+	/// Queues a request
+	/// \param async The context
+	/// \param request The request
+	/// \param wait Whether to block while the submission queue is full
+	/// \return false on error, or if the queue is full and wait is not set
+	///
+	bool block_async_submit(block_async_t *const async, block_async_request_t *const request, const bool wait);
+
+	///
+	/// Returns the eventfd that polls readable while completions are waiting to be reaped
+	/// \param async The context
+	/// \return The descriptor, -1 on error
+	///
+	int block_async_fd(const block_async_t *const async);
+
+	///
+	/// Takes completed requests off the completion queue, without blocking
+	/// \param async The context
+	/// \param requests Receives up to max completed requests, oldest first
+	/// \param max Room in requests
+	/// \return Number of requests reaped
+	///
+	size_t block_async_reap(block_async_t *const async, block_async_request_t **const requests, const size_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
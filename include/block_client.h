@@ -0,0 +1,77 @@
+#ifndef BLOCK_CLIENT_H__
+#define BLOCK_CLIENT_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+	// A block store in another process, reached through a block server's socket.
+	//  Every call has the signature of its block_store_* counterpart with the
+	//  client in place of the store, and returns the same values, so code can
+	//  switch between the two by name (block_client_serialize is the one
+	//  exception, see below). A connection that fails mid-call makes
+	//  that call (and every later one) return its error value.
+	//
+	//  A client is not thread-safe; give each thread its own connection.
+	typedef struct block_client block_client_t;
+
+	///
+	/// Connects to a block server
+	/// \param socket_path The server's socket
+	/// \return Pointer to the new client, NULL on error
+	///
+	block_client_t *block_client_connect(const char *const socket_path);
+
+	///
+	/// Closes the connection and frees the client
+	/// \param client The client, may be NULL
+	///
+	void block_client_disconnect(block_client_t *const client);
+
+	size_t block_client_allocate(block_client_t *const client);
+	bool block_client_request(block_client_t *const client, const size_t block_id);
+	void block_client_release(block_client_t *const client, const size_t block_id);
+	size_t block_client_get_used_blocks(block_client_t *const client);
+	size_t block_client_get_free_blocks(block_client_t *const client);
+	size_t block_client_read(block_client_t *const client, const size_t block_id, void *buffer);
+	size_t block_client_write(block_client_t *const client, const size_t block_id, const void *buffer);
+
+	///
+	/// Has the server serialize the store to the image it was created with
+	///  Unlike block_store_serialize there is no filename: the server never
+	///  writes to a path a client chose.
+	/// \param client The client
+	/// \return Number of bytes written, 0 on error or if the server has no image
+	///
+	size_t block_client_serialize(block_client_t *const client);
+
+	///
+	/// Reads several blocks, sending as many requests as the ring holds before waiting for any
+	/// \param client The client
+	/// \param block_ids Block ids to read
+	/// \param n Number of blocks
+	/// \param buffers One BLOCK_SIZE_BYTES buffer per block
+	/// \return Total bytes read, less than n * BLOCK_SIZE_BYTES if any block failed
+	///
+	size_t block_client_readv(block_client_t *const client, const size_t *const block_ids, const size_t n, void *const *buffers);
+
+	///
+	/// Writes several blocks, sending as many requests as the ring holds before waiting for any
+	/// \param client The client
+	/// \param block_ids Block ids to write
+	/// \param n Number of blocks
+	/// \param buffers One BLOCK_SIZE_BYTES buffer per block
+	/// \return Total bytes written, less than n * BLOCK_SIZE_BYTES if any block failed
+	///
+	size_t block_client_writev(block_client_t *const client, const size_t *const block_ids, const size_t n, const void *const *buffers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef BLOCK_PARITY_H__
+#define BLOCK_PARITY_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+	// Erasure coding over equal-length buffers, one per device. The first parity
+	//  buffer P is the XOR of the data (RAID-5); the optional second one Q is the
+	//  Reed-Solomon syndrome sum of g^i * data[i] over GF(2^8), polynomial 0x11D,
+	//  g = 2 (RAID-6). With both, any two buffers can be lost and rebuilt.
+	//
+	//  Multiplication by a constant goes through two 16-entry tables, one per
+	//  nibble, so it vectorizes as byte shuffles: AVX2 or SSSE3, picked on first
+	//  use from what the CPU supports, a scalar loop otherwise.
+#define BLOCK_PARITY_MAX 2
+#define BLOCK_PARITY_MAX_DATA 255  // distinct powers of g
+
+	///
+	/// Computes the parity of data buffers
+	/// \param data n_data buffers of length bytes
+	/// \param n_data Number of data buffers, at most BLOCK_PARITY_MAX_DATA
+	/// \param parity n_parity buffers of length bytes to fill, P then Q
+	/// \param n_parity 1 for P only, 2 for P and Q
+	/// \param length Bytes per buffer
+	/// \return false if the request was invalid
+	///
+	bool block_parity_encode(const void *const *data, const size_t n_data, void *const *parity, const size_t n_parity,
+							 const size_t length);
+
+	///
+	/// Folds a change to one data buffer into the parity, without touching the others
+	/// \param index Which data buffer changed
+	/// \param delta Old contents XOR new contents, length bytes
+	/// \param parity n_parity buffers to update, P then Q (an entry may be NULL to skip it)
+	/// \param n_parity 1 or 2
+	/// \param length Bytes per buffer
+	/// \return false if the request was invalid
+	///
+	bool block_parity_update(const size_t index, const void *const delta, void *const *parity, const size_t n_parity,
+							 const size_t length);
+
+	///
+	/// Rebuilds lost buffers from the others
+	/// \param buffers n_data data buffers followed by n_parity parity buffers; lost ones are overwritten
+	/// \param n_data Number of data buffers
+	/// \param n_parity Number of parity buffers
+	/// \param lost Indexes into buffers of the lost ones, at most n_parity of them
+	/// \param n_lost Number of lost buffers
+	/// \param length Bytes per buffer
+	/// \return false if too many buffers are lost or the request was invalid
+	///
+	bool block_parity_recover(void *const *buffers, const size_t n_data, const size_t n_parity, const size_t *const lost,
+							  const size_t n_lost, const size_t length);
+
+	///
+	/// Names the multiplication kernel picked for this CPU
+	/// \return "avx2", "ssse3" or "scalar"
+	///
+	const char *block_parity_kernel();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef BLOCK_SERVER_H__
+#define BLOCK_SERVER_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+	// Serves one block store to other processes over a Unix domain socket
+	//  (see block_client.h for the other end). Each connection gets a ring of
+	//  BLOCK_SIZE_BYTES slots in a memfd the client maps too, so block data
+	//  never crosses the socket: the socket only carries fixed-size requests,
+	//  each naming a slot, and their results. A client may send a whole batch
+	//  of requests before reading any results; they run in order, and the
+	//  results come back in one write. A client that stops reading its results
+	//  only holds up its own connection.
+
+	// Wire format, in host byte order since both ends share the machine
+#define BLOCK_SERVER_MAGIC 0x42535356
+#define BLOCK_SERVER_VERSION 2
+#define BLOCK_SERVER_DEFAULT_SLOTS 64
+
+	// Sent by the server on accept, along with the ring's memfd (SCM_RIGHTS)
+	typedef struct
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t slots;  // ring size, also the most requests a client may have in flight
+	} block_server_hello_t;
+
+	typedef enum
+	{
+		BLOCK_SERVER_OP_ALLOCATE,
+		BLOCK_SERVER_OP_REQUEST,
+		BLOCK_SERVER_OP_RELEASE,
+		BLOCK_SERVER_OP_READ,       // block into the slot
+		BLOCK_SERVER_OP_WRITE,      // slot into the block
+		BLOCK_SERVER_OP_USED,
+		BLOCK_SERVER_OP_FREE,
+		BLOCK_SERVER_OP_SERIALIZE,  // to the server's image, 0 if it has none
+	} block_server_op_t;
+
+	typedef struct
+	{
+		uint32_t op;
+		uint32_t slot;
+		uint64_t block_id;
+	} block_server_request_t;
+
+	typedef struct
+	{
+		uint64_t result;  // what the block_store_* call returned (true/false as 1/0)
+	} block_server_response_t;
+
+	typedef struct block_server block_server_t;
+
+	///
+	/// Listens on a socket for clients of a block store
+	///  Any file already at socket_path is replaced.
+	/// \param bs The block store, not owned by the server and not to be used elsewhere while it runs
+	/// \param socket_path Where to bind the socket
+	/// \param image_path The only file clients may serialize the store to (relative to the
+	///  server's working directory), NULL to refuse serialization
+	/// \param slots Ring slots per connection, 0 for BLOCK_SERVER_DEFAULT_SLOTS
+	/// \return Pointer to the new server, NULL on error
+	///
+	block_server_t *block_server_create(block_store_t *const bs, const char *const socket_path, const char *const image_path,
+										const size_t slots);
+
+	///
+	/// Serves clients on the calling thread until block_server_stop is called
+	/// \param server The server
+	/// \return false on error
+	///
+	bool block_server_run(block_server_t *const server);
+
+	///
+	/// Makes block_server_run return, from any thread or a signal handler
+	/// \param server The server
+	///
+	void block_server_stop(block_server_t *const server);
+
+	///
+	/// Closes every connection, removes the socket and frees the server
+	/// \param server The server, may be NULL
+	///
+	void block_server_destroy(block_server_t *const server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
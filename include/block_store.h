@@ -7,7 +7,9 @@ extern "C"
 #endif
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 	// Constants
 #define BITMAP_SIZE_BYTES 32         //  
@@ -20,6 +22,94 @@ extern "C"
 #define BITMAP_START_BLOCK 127   
 
 
+	// Operations tracked by block_store_get_stats
+	typedef enum
+	{
+		BLOCK_STORE_OP_ALLOCATE,
+		BLOCK_STORE_OP_REQUEST,
+		BLOCK_STORE_OP_RELEASE,
+		BLOCK_STORE_OP_READ,
+		BLOCK_STORE_OP_WRITE,
+		BLOCK_STORE_OP_SERIALIZE,
+		BLOCK_STORE_OP_DESERIALIZE,  // counted by block_store_get_process_stats, as a failed load has no store
+		BLOCK_STORE_OP_FFZ,  // the free-block scan inside allocate
+		BLOCK_STORE_OP_COUNT
+	} block_store_op_t;
+
+	// How block_store_allocate picks a free block
+	typedef enum
+	{
+		BLOCK_STORE_POLICY_FIRST_FIT,  // lowest free block id, by scanning the bitmap
+		BLOCK_STORE_POLICY_BUDDY,      // binary buddy free lists, O(log n) per extent
+		BLOCK_STORE_POLICY_NEXT_FIT,   // first free block after the last one allocated, wrapping around
+		BLOCK_STORE_POLICY_BEST_FIT,   // a block from the smallest run of free blocks
+		BLOCK_STORE_POLICY_NEAR        // free block nearest the last one allocated (see block_store_allocate_near)
+	} block_store_policy_t;
+
+#define BLOCK_STORE_LATENCY_BUCKETS 32  // bucket i counts calls that took [2^i, 2^(i+1)) ns
+
+	typedef struct block_store_op_stats
+	{
+		uint64_t calls;
+		uint64_t failures;
+		uint64_t bytes;
+		uint64_t latency_ns[BLOCK_STORE_LATENCY_BUCKETS];
+	} block_store_op_stats_t;
+
+	typedef struct block_store_stats
+	{
+		block_store_op_stats_t ops[BLOCK_STORE_OP_COUNT];
+	} block_store_stats_t;
+
+	// Trace files are a header followed by fixed-size records, in host byte order
+#define BLOCK_STORE_TRACE_MAGIC 0x52545342  // "BSTR"
+#define BLOCK_STORE_TRACE_VERSION 1
+
+	typedef struct block_store_trace_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t record_bytes;
+		uint32_t reserved;
+	} block_store_trace_header_t;
+
+	typedef struct block_store_trace_record
+	{
+		uint64_t timestamp_ns;  // since the trace started
+		uint64_t block_id;      // block named by the call, or the one allocate returned
+		uint32_t thread_id;     // kernel thread id of the caller
+		uint8_t op;             // block_store_op_t
+		uint8_t success;
+		uint16_t reserved;
+	} block_store_trace_record_t;
+
+	// Images written by block_store_serialize carry a superblock in the bitmap block,
+	//  right after the bitmap, so they keep the raw block layout. Host byte order.
+#define BLOCK_STORE_SUPER_MAGIC 0x42535348  // "HSSB"
+#define BLOCK_STORE_SUPER_VERSION 1
+#define BLOCK_STORE_SUPER_OFFSET (BITMAP_START_BLOCK * BLOCK_SIZE_BYTES + BITMAP_SIZE_BYTES)
+
+	// Feature flags. None are implemented yet, images using one are refused.
+#define BLOCK_STORE_FEATURE_COMPRESSION 0x1
+#define BLOCK_STORE_FEATURE_CHECKSUMS 0x2
+#define BLOCK_STORE_FEATURE_JOURNAL 0x4
+#define BLOCK_STORE_FEATURES_SUPPORTED 0x0
+
+	typedef struct block_store_superblock
+	{
+		uint32_t magic;
+		uint16_t version;
+		uint16_t superblock_bytes;  // sizeof(block_store_superblock_t)
+		uint32_t block_size;
+		uint32_t block_count;
+		uint32_t bitmap_block;      // first block holding the bitmap
+		uint32_t bitmap_bytes;
+		uint32_t used_blocks;       // as block_store_get_used_blocks
+		uint32_t features;          // BLOCK_STORE_FEATURE_* flags
+		uint32_t checksum;          // FNV-1a of the fields above
+		uint32_t reserved;
+	} block_store_superblock_t;
+
 	// Declaring the struct but not implementing in the header allows us to prevent users
 	//  from using the object directly and monkeying with the contents
 	// They can only create pointers to the struct, which must be given out by us
@@ -32,6 +122,67 @@ extern "C"
 	///
 	block_store_t *block_store_create();
 
+	// Flags for block_store_config_t
+#define BLOCK_STORE_ARENA_HUGEPAGES 0x1  // back the blocks with huge pages (MAP_HUGETLB if reserved, else a THP hint)
+#define BLOCK_STORE_ARENA_PREFAULT 0x2   // fault every page in at creation instead of on first touch
+#define BLOCK_STORE_CONCURRENT 0x4       // block_store_read and block_store_write may race (see below)
+#define BLOCK_STORE_SPARSE 0x8           // allocate chunks on first write, free them once all their blocks are released
+
+	// In a concurrent store every block has a sequence counter. A write makes it
+	//  odd, copies, and makes it even again; a read copies without any lock and
+	//  retries if the counter moved, so readers never see a torn block and never
+	//  write to memory shared with other threads. Writers of the same block wait
+	//  on each other. Only read and write are covered: allocation, snapshots,
+	//  serialization and the rest still need the caller's locking, and writes must
+	//  not race while a snapshot or clone shares the store's blocks.
+
+	// A sparse store starts with only the chunk holding the bitmap. Other chunks
+	//  are allocated the first time one of their blocks is written and freed when
+	//  the last block allocated in them is released; blocks of a missing chunk read
+	//  as zeroes. Sparse stores cannot also be concurrent.
+
+	// A shared store (block_store_create_shared) keeps its blocks, bitmap
+	//  included, in a shm_open segment that every process creating a shared
+	//  store with the same name maps; the first one creates and zeroes it. Shared stores are concurrent, across
+	//  processes as well as threads: allocate, request and release are atomic
+	//  on the shared bitmap, readers use the sequence counters (which live in
+	//  the segment too), and writers take a robust process-shared lock, so a
+	//  process dying mid-write leaves at worst that one block torn and never
+	//  wedges the others. Everything else that changes the bitmap (bulk and
+	//  extent allocation, range releases, policies other than first fit) and
+	//  snapshots or clones fail on a shared store. Destroying the store only
+	//  unmaps it; block_store_unlink_shared removes the segment.
+
+	// Options for block_store_create_ex
+	typedef struct
+	{
+		unsigned flags;  // BLOCK_STORE_ARENA_*, BLOCK_STORE_CONCURRENT and BLOCK_STORE_SPARSE, or'd together
+	} block_store_config_t;
+
+	///
+	/// Creates a new BS device with its block data laid out as configured
+	///  Blocks always live in one page-aligned mapping, separate from the store's
+	///  metadata; block_store_create is this with the default (zero) options.
+	/// \param config Creation options, NULL for the defaults
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_ex(const block_store_config_t *const config);
+
+	///
+	/// Creates a BS device on a shared memory segment, or attaches to the one already there
+	/// \param shm_name The segment's shm_open name ("/name")
+	/// \param config Creation options, NULL for the defaults (only PREFAULT applies, SPARSE fails)
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_shared(const char *const shm_name, const block_store_config_t *const config);
+
+	///
+	/// Removes a shared store's segment; processes that have it mapped keep using it
+	/// \param shm_name The name given to block_store_create_shared
+	/// \return false if there was no such segment
+	///
+	bool block_store_unlink_shared(const char *const shm_name);
+
 	///
 	/// Destroys the provided block storage device
 	/// This is an idempotent operation, so there is no return value
@@ -46,6 +197,18 @@ extern "C"
 	///
 	size_t block_store_allocate(block_store_t *const bs);
 
+	///
+	/// Allocates up to n blocks in one pass over the bitmap, lowest ids first
+	///  The pass picks up where the last free block was found, so this is
+	///  O(n + blocks) rather than n separate allocate calls.
+	/// \param bs BS device
+	/// \param n Number of blocks wanted
+	/// \param ids Receives the allocated ids, room for n
+	/// \param all_or_nothing If set, allocate nothing unless all n blocks are free
+	/// \return Number of blocks allocated, 0 on error
+	///
+	size_t block_store_allocate_n(block_store_t *const bs, const size_t n, size_t *const ids, const bool all_or_nothing);
+
 	///
 	/// Attempts to allocate the requested block id
 	/// \param bs the block store object
@@ -61,6 +224,32 @@ extern "C"
 	///
 	void block_store_release(block_store_t *const bs, const size_t block_id);
 
+	// Flags for block_store_release_range and block_store_release_list
+#define BLOCK_STORE_RELEASE_ZERO 0x1     // zero the freed blocks
+#define BLOCK_STORE_RELEASE_DISCARD 0x2  // also hand whole freed pages back to the OS (reads as zeroes)
+
+	///
+	/// Frees count blocks starting at first, clearing the bitmap a byte at a time
+	///  The bitmap block is never freed or zeroed. Freed blocks always become holes
+	///  the next time the store is serialized over an existing image.
+	/// \param bs BS device
+	/// \param first First block to free
+	/// \param count Number of blocks
+	/// \param flags BLOCK_STORE_RELEASE_* flags
+	/// \return false if the request was invalid
+	///
+	bool block_store_release_range(block_store_t *const bs, const size_t first, const size_t count, const unsigned flags);
+
+	///
+	/// Frees a list of blocks, as block_store_release_range does
+	/// \param bs BS device
+	/// \param ids The blocks to free, nothing is freed if any is out of range
+	/// \param n Number of ids
+	/// \param flags BLOCK_STORE_RELEASE_* flags
+	/// \return false if the request was invalid
+	///
+	bool block_store_release_list(block_store_t *const bs, const size_t *const ids, const size_t n, const unsigned flags);
+
 	///
 	/// Counts the number of blocks marked as in use
 	/// \param bs BS device
@@ -75,6 +264,16 @@ extern "C"
 	///
 	size_t block_store_get_free_blocks(const block_store_t *const bs);
 
+	///
+	/// Recounts the bitmap and compares it with the used count kept by the store,
+	///  correcting the count if they differ. The count makes block_store_get_used_blocks
+	///  and block_store_get_free_blocks O(1); it only drifts if the bitmap is changed
+	///  behind the store's back, or a process dies between the two updates of a shared store.
+	/// \param bs BS device
+	/// \return true if the count was right, false if it was corrected or on error
+	///
+	bool block_store_check_used(block_store_t *const bs);
+
 	///
 	/// Returns the total number of user-addressable blocks
 	///  (since this is constant, you don't even need the bs object)
@@ -82,6 +281,14 @@ extern "C"
 	///
 	size_t block_store_get_total_blocks();
 
+	///
+	/// Returns how much memory the store's blocks occupy
+	///  (all of NUM_BYTES unless the store is sparse, chunks shared with snapshots included)
+	/// \param bs BS device
+	/// \return Bytes of block data held, SIZE_MAX on error
+	///
+	size_t block_store_get_resident_bytes(const block_store_t *const bs);
+
 	///
 	/// Reads data from the specified block and writes it to the designated buffer
 	/// \param bs BS device
@@ -91,6 +298,38 @@ extern "C"
 	///
 	size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer);
 
+	// Access pattern hints for block_store_advise
+	typedef enum
+	{
+		BLOCK_STORE_ADVICE_NORMAL,      // no particular pattern, the default
+		BLOCK_STORE_ADVICE_SEQUENTIAL,  // read in increasing order; reads prefetch the blocks ahead
+		BLOCK_STORE_ADVICE_RANDOM,      // read in no order; the kernel is told not to read around
+		BLOCK_STORE_ADVICE_WILLNEED,    // read soon; the pages are faulted in now
+		BLOCK_STORE_ADVICE_DONTNEED     // not read for a while; the pages are first to be reclaimed
+	} block_store_advice_t;
+
+	///
+	/// Starts pulling blocks into the cache ahead of reading them
+	///  Invalid ids are skipped; this is only ever a hint.
+	/// \param bs BS device
+	/// \param ids The blocks about to be read
+	/// \param n Number of ids
+	///
+	void block_store_prefetch(const block_store_t *const bs, const size_t *const ids, const size_t n);
+
+	///
+	/// Tells the store how a range of blocks is going to be accessed
+	///  Advice applies per chunk of 16 blocks, to every chunk the range touches,
+	///  and is passed on to the kernel with madvise for the pages holding them.
+	///  It never changes the blocks' contents.
+	/// \param bs BS device
+	/// \param first First block of the range
+	/// \param count Number of blocks
+	/// \param advice The expected access pattern
+	/// \return false if the request was invalid
+	///
+	bool block_store_advise(block_store_t *const bs, const size_t first, const size_t count, const block_store_advice_t advice);
+
 	///
 	/// Reads data from the specified buffer and writes it to the designated block
 	/// \param bs BS device
@@ -100,21 +339,293 @@ extern "C"
 	///
 	size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+	///
+	/// Copies a range of blocks within a store or from one store to another, like memmove
+	///  The ranges may overlap. Contents move straight from block to block without a
+	///  bounce buffer, and whole aligned chunks of private stores are shared copy-on-write
+	///  instead of copied. Allocation state is untouched on both sides, as with
+	///  block_store_write. On a concurrent store, each block is copied atomically.
+	/// \param dst Destination BS device
+	/// \param dst_id First destination block, the range must not cover the bitmap's blocks
+	/// \param src Source BS device (or snapshot), may be dst
+	/// \param src_id First source block
+	/// \param n Number of blocks
+	/// \return Number of bytes copied, short if memory ran out part way, 0 on error
+	///
+	size_t block_store_copy_range(block_store_t *const dst, const size_t dst_id, const block_store_t *const src,
+								  const size_t src_id, const size_t n);
+
 	///
 	/// Imports BS device from the given file - for grads/bonus
+	///  Only the data regions of a sparse image are read, holes read as zeroes.
+	///  The superblock is checked first, so a wrong or truncated file is refused
+	///  after one small read. Images from before the superblock are still loaded.
 	/// \param filename The file to load
 	/// \return Pointer to new BS device, NULL on error
 	///
 	block_store_t *block_store_deserialize(const char *const filename);
 
 	///
-	/// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+	/// Reads and validates the superblock of an image file without loading it
+	/// \param filename The image
+	/// \param superblock Filled in with the superblock (may be NULL)
+	/// \return false if the file can't be read, is truncated, or has no valid superblock
+	///
+	bool block_store_read_superblock(const char *const filename, block_store_superblock_t *const superblock);
+
+	///
+	/// Copies an image file without loading it, replacing dst_filename
+	///  The copy is a reflink (FICLONE) where the file system supports one, so no
+	///  data moves until either file is written; otherwise the data regions go
+	///  through copy_file_range and holes stay holes.
+	/// \param src_filename The image, checked as block_store_deserialize would
+	/// \param dst_filename The copy, must not be the same file
+	/// \return Size of the image copied, 0 on error
+	///
+	size_t block_store_copy_image(const char *const src_filename, const char *const dst_filename);
+
+	///
+	/// Writes the BS device to file, overwriting it if it exists - for grads/bonus
+	///  Only allocated blocks are written; free blocks become holes in a sparse file,
+	///  and free ranges an older image left behind are punched out. The superblock
+	///  (see block_store_superblock_t) goes in the bitmap block.
 	/// \param bs BS device
 	/// \param filename The file to write to
-	/// \return Number of bytes written, 0 on error
+	/// \return Size of the image written (BLOCK_STORE_NUM_BYTES), 0 on error
 	///
 	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+	///
+	/// Writes the BS device to file like block_store_serialize, but with n_threads
+	///  threads each pwriting a disjoint range of the image. The image is built in
+	///  filename.tmp, fsynced once and renamed over filename, so the old image stays
+	///  intact until the new one is complete.
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \param n_threads Number of threads, 0 for one per online CPU
+	/// \return Size of the image written (BLOCK_STORE_NUM_BYTES), 0 on error
+	///
+	size_t block_store_serialize_parallel(const block_store_t *const bs, const char *const filename, const size_t n_threads);
+
+	///
+	/// Imports BS device from the given file like block_store_deserialize, but with
+	///  n_threads threads each preading a disjoint range of the image
+	/// \param filename The file to load
+	/// \param n_threads Number of threads, 0 for one per online CPU
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_parallel(const char *const filename, const size_t n_threads);
+
+	///
+	/// Stream callbacks: move up to length bytes, returning how many were moved,
+	///  0 at end of stream or -1 on error (like write(2) and read(2))
+	///
+	typedef ssize_t (*block_store_write_fn)(void *arg, const void *buffer, size_t length);
+	typedef ssize_t (*block_store_read_fn)(void *arg, void *buffer, size_t length);
+
+	///
+	/// Progress callback: bytes of bitmap and block data moved so far out of the total
+	///
+	typedef void (*block_store_progress_fn)(size_t bytes_done, size_t bytes_total, void *arg);
+
+	///
+	/// Streams the BS device through a write callback in framed chunks of at most 4KiB
+	///  of data: the bitmap first, then runs of allocated blocks, then an end marker
+	/// \param bs BS device
+	/// \param write_fn Receives the stream
+	/// \param write_arg Passed through to write_fn
+	/// \param progress Called after each frame (may be NULL)
+	/// \param progress_arg Passed through to progress
+	/// \return Number of bytes streamed, 0 on error
+	///
+	size_t block_store_serialize_stream(const block_store_t *const bs, block_store_write_fn write_fn, void *write_arg,
+	                                    block_store_progress_fn progress, void *progress_arg);
+
+	///
+	/// Rebuilds a BS device from a stream written by block_store_serialize_stream
+	/// \param read_fn Supplies the stream
+	/// \param read_arg Passed through to read_fn
+	/// \param progress Called after each frame (may be NULL)
+	/// \param progress_arg Passed through to progress
+	/// \return Pointer to new BS device, NULL on error or a malformed/truncated stream
+	///
+	block_store_t *block_store_deserialize_stream(block_store_read_fn read_fn, void *read_arg,
+	                                              block_store_progress_fn progress, void *progress_arg);
+
+	///
+	/// Streams the BS device to a file descriptor, which may be a pipe or socket
+	/// \param bs BS device
+	/// \param fd The descriptor to write to
+	/// \return Number of bytes streamed, 0 on error
+	///
+	size_t block_store_serialize_fd(const block_store_t *const bs, int fd);
+
+	///
+	/// Rebuilds a BS device from a stream read from a file descriptor
+	/// \param fd The descriptor to read from
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_fd(int fd);
+
+	///
+	/// Takes a read-only, point-in-time snapshot of the BS device
+	///  Blocks are shared copy-on-write, so this costs one reference per chunk and
+	///  the first later write to a shared chunk copies it. Read from the snapshot with
+	///  the usual calls; modifying calls fail on it. Drop it with block_store_destroy.
+	///  Must not race with modification of bs itself.
+	/// \param bs BS device
+	/// \return Pointer to the snapshot, NULL on error
+	///
+	block_store_t *block_store_snapshot(const block_store_t *const bs);
+
+	///
+	/// Creates a writable copy of the BS device (or of a snapshot), sharing blocks copy-on-write
+	/// \param bs BS device
+	/// \return Pointer to the new BS device, NULL on error
+	///
+	block_store_t *block_store_clone(const block_store_t *const bs);
+
+	///
+	/// Compares two BS devices or snapshots through their bitmaps
+	///  A block differs if it is allocated in only one of them, or allocated in both
+	///  with different contents. Chunks still shared between the two are skipped.
+	/// \param a First BS device
+	/// \param b Second BS device
+	/// \param func Called with each differing block id (may be NULL)
+	/// \param arg Passed through to func
+	/// \return Number of differing blocks, SIZE_MAX on error
+	///
+	size_t block_store_diff(const block_store_t *const a, const block_store_t *const b, void (*func)(size_t, void *), void *arg);
+
+	///
+	/// Collects per-operation call, failure and byte counts and latency histograms
+	///  Counters are kept per thread stripe and merged here. Statistics are built
+	///  in with the BLOCK_STORE_STATS define (CMake option HW3_STATS) and cost
+	///  nothing when left out.
+	/// \param bs BS device
+	/// \param stats Filled in with the totals
+	/// \return false on error or if statistics were compiled out
+	///
+	bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats);
+
+	///
+	/// Zeroes the statistics of the BS device
+	/// \param bs BS device
+	///
+	void block_store_reset_stats(block_store_t *const bs);
+
+	///
+	/// Collects the counters of calls that are not tied to one BS device, which
+	///  are the deserializes, failed or not. Built in like block_store_get_stats.
+	/// \param stats Filled in with the totals for the process
+	/// \return false on error or if statistics were compiled out
+	///
+	bool block_store_get_process_stats(block_store_stats_t *const stats);
+
+	///
+	/// Zeroes the counters read by block_store_get_process_stats
+	///
+	void block_store_reset_process_stats();
+
+	///
+	/// Starts recording allocate, request, release, read, write and serialize calls on
+	///  the BS device to a binary trace file (see block_store_trace_record_t), for
+	///  replay with hw3_replay. Block contents are not recorded.
+	///  Must not race with other calls on bs.
+	/// \param bs BS device
+	/// \param filename The trace file, replaced if it exists
+	/// \return false on error or if a trace is already running
+	///
+	bool block_store_trace_start(block_store_t *const bs, const char *const filename);
+
+	///
+	/// Stops recording and closes the trace file (block_store_destroy does this too)
+	/// \param bs BS device
+	/// \return false if no trace was running or the trace could not be written completely
+	///
+	bool block_store_trace_stop(block_store_t *const bs);
+
+	///
+	/// Selects the allocator behind block_store_allocate and block_store_allocate_extent
+	///  The bitmap stays the source of truth: the buddy free lists are rebuilt from it
+	///  here, so this also works on a freshly deserialized store. Extents are placed
+	///  first fit under every policy but buddy. New and deserialized
+	///  stores use BLOCK_STORE_POLICY_FIRST_FIT; clones keep the policy of their source.
+	/// \param bs BS device
+	/// \param policy The allocator to use
+	/// \return false on error
+	///
+	bool block_store_set_policy(block_store_t *const bs, const block_store_policy_t policy);
+
+	///
+	/// Allocates the free block nearest to a hint, preferring the one after it on a tie
+	///  Useful to keep the blocks of a growing object together; pass the object's last block.
+	/// \param bs BS device
+	/// \param hint Block id to allocate near (need not be free, or in range)
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_allocate_near(block_store_t *const bs, const size_t hint);
+
+	///
+	/// Allocates an aligned extent of 2^order contiguous blocks
+	///  O(log n) under BLOCK_STORE_POLICY_BUDDY, a linear scan under first fit
+	/// \param bs BS device
+	/// \param order Log2 of the number of blocks
+	/// \return First block id of the extent, SIZE_MAX on error
+	///
+	size_t block_store_allocate_extent(block_store_t *const bs, const unsigned order);
+
+	///
+	/// Frees an extent from block_store_allocate_extent, merging it with free neighbours
+	///  The bitmap's own block stays allocated if the extent covers it
+	/// \param bs BS device
+	/// \param block_id First block id of the extent
+	/// \param order Log2 of the number of blocks, as allocated
+	/// \return false if the request was invalid
+	///
+	bool block_store_release_extent(block_store_t *const bs, const size_t block_id, const unsigned order);
+
+#define BLOCK_STORE_EXTENT_BUCKETS 9  // bucket i counts free extents of [2^i, 2^(i+1)) blocks
+
+	// Free and allocated extents are maximal runs of free or in-use blocks; the
+	//  bitmap's own block counts as in use, so nothing spans it.
+	typedef struct block_store_fragmentation
+	{
+		size_t free_blocks;
+		size_t free_extents;
+		size_t largest_free_extent;           // in blocks, the biggest allocate_extent could hope for
+		double average_free_extent;           // free_blocks / free_extents, 0 if full
+		size_t used_extents;
+		double average_used_extent;           // how many blocks an object gets in a row, on average
+		size_t free_extent_histogram[BLOCK_STORE_EXTENT_BUCKETS];
+	} block_store_fragmentation_t;
+
+	///
+	/// Measures how scattered the free and allocated blocks are
+	/// \param bs BS device
+	/// \param report Receives the measurements
+	/// \return false on error
+	///
+	bool block_store_fragmentation_report(const block_store_t *const bs, block_store_fragmentation_t *const report);
+
+	///
+	/// Moves allocated blocks toward the front of the store, a bounded number per call
+	///  Each move takes the highest allocated block to the lowest free one (never block 0,
+	///  which can't be read back) and frees the old id. Owners of moved blocks learn
+	///  the new ids through map and/or func. Calling this until it returns 0 leaves
+	///  the allocated blocks contiguous after block 1; every block moves at most once.
+	///  Like allocation, must not race with other calls on bs. A trace records each
+	///  move as a request and a write of the new id and a release of the old one.
+	/// \param bs BS device
+	/// \param max_moves Most blocks to move in this call
+	/// \param map If not NULL, BLOCK_STORE_NUM_BLOCKS entries; map[from] = to is stored for every move
+	/// \param func If not NULL, called as func(from, to, arg) after every move
+	/// \param arg Passed through to func
+	/// \return Number of blocks moved, 0 once compact, SIZE_MAX on error
+	///
+	size_t block_store_compact(block_store_t *const bs, const size_t max_moves, size_t *const map,
+							   void (*func)(size_t, size_t, void *), void *arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,263 @@
+// Header-only C++ block store with its geometry fixed at compile time.
+//
+// BlockStore<NumBlocks, BlockSize> keeps the same allocate/request/release/
+// read/write model as the C API in block_store.h, but everything is inline:
+// block offsets and copy sizes are constants, and the allocation bitmap is an
+// array of 64-bit words searched a word at a time. Blocks and bitmap live in a
+// single allocation owned by the store, so moving a store is a pointer swap.
+//
+// Unlike the C store, the bitmap is kept beside the blocks rather than inside
+// one of them, so all NumBlocks blocks can be allocated. Errors are reported
+// like the C API does: SIZE_MAX, 0 or false.
+
+#ifndef BLOCK_STORE_HPP__
+#define BLOCK_STORE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+
+///
+/// A view of one block's bytes, which stays valid as long as the store it came from
+///
+template <typename Byte, size_t Size>
+class BlockView {
+public:
+    BlockView() : data_(nullptr) {}
+    explicit BlockView(Byte *data) : data_(data) {}
+
+    static constexpr size_t size() { return Size; }
+    Byte *data() const { return data_; }
+    Byte *begin() const { return data_; }
+    Byte *end() const { return data_ + Size; }
+    Byte &operator[](size_t offset) const { return data_[offset]; }
+    explicit operator bool() const { return data_ != nullptr; }
+
+private:
+    Byte *data_;
+};
+
+template <size_t NumBlocks, size_t BlockSize>
+class BlockStore {
+    static_assert(NumBlocks > 0, "a block store needs at least one block");
+    static_assert(BlockSize > 0, "blocks need at least one byte");
+
+public:
+    static constexpr size_t num_blocks = NumBlocks;
+    static constexpr size_t block_size = BlockSize;
+    static constexpr size_t num_bytes = NumBlocks * BlockSize;
+
+    typedef BlockView<uint8_t, BlockSize> view;
+    typedef BlockView<const uint8_t, BlockSize> const_view;
+
+    ///
+    /// Iterates over the ids of allocated blocks, in increasing order
+    ///
+    class iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef size_t value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const size_t *pointer;
+        typedef const size_t &reference;
+
+        iterator(const BlockStore *store, size_t block_id) : store_(store), block_id_(block_id) {}
+        reference operator*() const { return block_id_; }
+        iterator &operator++() {
+            block_id_ = store_->find_set(block_id_ + 1);
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator old = *this;
+            ++*this;
+            return old;
+        }
+        bool operator==(const iterator &other) const { return block_id_ == other.block_id_; }
+        bool operator!=(const iterator &other) const { return block_id_ != other.block_id_; }
+
+    private:
+        const BlockStore *store_;
+        size_t block_id_;
+    };
+
+    ///
+    /// Creates an empty store, check valid() for allocation failure
+    ///
+    BlockStore() : storage_(new (std::nothrow) storage()) {
+        if (storage_) {
+            std::memset(storage_.get(), 0, sizeof(storage));
+        }
+    }
+
+    BlockStore(BlockStore &&other) noexcept : storage_(std::move(other.storage_)) {}
+    BlockStore &operator=(BlockStore &&other) noexcept {
+        storage_ = std::move(other.storage_);
+        return *this;
+    }
+    BlockStore(const BlockStore &) = delete;
+    BlockStore &operator=(const BlockStore &) = delete;
+
+    ///
+    /// \return false if the store could not be allocated or was moved from
+    ///
+    bool valid() const { return storage_ != nullptr; }
+
+    ///
+    /// Marks the lowest free block as in use
+    /// \return Allocated block's id, SIZE_MAX if full
+    ///
+    size_t allocate() {
+        if (!storage_) {
+            return SIZE_MAX;
+        }
+        for (size_t word = 0; word < bitmap_words; ++word) {
+            uint64_t bits = storage_->bitmap[word] | tail_mask(word);
+            if (bits != UINT64_MAX) {
+                size_t bit = static_cast<size_t>(__builtin_ctzll(~bits));
+                storage_->bitmap[word] |= uint64_t(1) << bit;
+                return word * 64 + bit;
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    ///
+    /// Marks a specific free block as in use
+    /// \param block_id The block
+    /// \return false if the block is out of range or already in use
+    ///
+    bool request(size_t block_id) {
+        if (!storage_ || block_id >= NumBlocks || test(block_id)) {
+            return false;
+        }
+        storage_->bitmap[block_id / 64] |= uint64_t(1) << (block_id % 64);
+        return true;
+    }
+
+    ///
+    /// Frees a block
+    /// \param block_id The block
+    /// \return false if the block is out of range
+    ///
+    bool release(size_t block_id) {
+        if (!storage_ || block_id >= NumBlocks) {
+            return false;
+        }
+        storage_->bitmap[block_id / 64] &= ~(uint64_t(1) << (block_id % 64));
+        return true;
+    }
+
+    ///
+    /// \param block_id The block
+    /// \return Whether the block is in use (false if out of range)
+    ///
+    bool test(size_t block_id) const {
+        return storage_ && block_id < NumBlocks && (storage_->bitmap[block_id / 64] >> (block_id % 64)) & 1;
+    }
+
+    ///
+    /// Copies a block out
+    /// \param block_id The block
+    /// \param buffer At least BlockSize bytes
+    /// \return Bytes read, 0 on error
+    ///
+    size_t read(size_t block_id, void *buffer) const {
+        if (!storage_ || !buffer || block_id >= NumBlocks) {
+            return 0;
+        }
+        std::memcpy(buffer, storage_->blocks[block_id], BlockSize);
+        return BlockSize;
+    }
+
+    ///
+    /// Copies a block in
+    /// \param block_id The block
+    /// \param buffer At least BlockSize bytes
+    /// \return Bytes written, 0 on error
+    ///
+    size_t write(size_t block_id, const void *buffer) {
+        if (!storage_ || !buffer || block_id >= NumBlocks) {
+            return 0;
+        }
+        std::memcpy(storage_->blocks[block_id], buffer, BlockSize);
+        return BlockSize;
+    }
+
+    ///
+    /// Direct access to a block's bytes, without copying
+    /// \param block_id The block
+    /// \return The view, empty if the block is out of range
+    ///
+    view block(size_t block_id) {
+        return storage_ && block_id < NumBlocks ? view(storage_->blocks[block_id]) : view();
+    }
+    const_view block(size_t block_id) const {
+        return storage_ && block_id < NumBlocks ? const_view(storage_->blocks[block_id]) : const_view();
+    }
+
+    ///
+    /// \return Number of blocks in use
+    ///
+    size_t used_blocks() const {
+        size_t used = 0;
+        if (storage_) {
+            for (size_t word = 0; word < bitmap_words; ++word) {
+                used += static_cast<size_t>(__builtin_popcountll(storage_->bitmap[word] & ~tail_mask(word)));
+            }
+        }
+        return used;
+    }
+
+    ///
+    /// \return Number of blocks free
+    ///
+    size_t free_blocks() const { return storage_ ? NumBlocks - used_blocks() : 0; }
+
+    iterator begin() const { return iterator(this, find_set(0)); }
+    iterator end() const { return iterator(this, NumBlocks); }
+
+private:
+    static constexpr size_t bitmap_words = (NumBlocks + 63) / 64;
+
+    struct storage {
+        uint64_t bitmap[bitmap_words];
+        uint8_t blocks[NumBlocks][BlockSize];
+    };
+
+    // Bits of the last word past the end of the store, treated as in use
+    static constexpr uint64_t tail_mask(size_t word) {
+        return word + 1 == bitmap_words && NumBlocks % 64 ? ~uint64_t(0) << (NumBlocks % 64) : 0;
+    }
+
+    // First allocated block at or after start, NumBlocks if none
+    size_t find_set(size_t start) const {
+        if (!storage_) {
+            return NumBlocks;
+        }
+        for (size_t word = start / 64; word < bitmap_words; ++word) {
+            uint64_t bits = storage_->bitmap[word] & ~tail_mask(word);
+            if (word == start / 64) {
+                bits &= ~uint64_t(0) << (start % 64);
+            }
+            if (bits) {
+                return word * 64 + static_cast<size_t>(__builtin_ctzll(bits));
+            }
+        }
+        return NumBlocks;
+    }
+
+    std::unique_ptr<storage> storage_;
+};
+
+template <size_t NumBlocks, size_t BlockSize>
+constexpr size_t BlockStore<NumBlocks, BlockSize>::num_blocks;
+template <size_t NumBlocks, size_t BlockSize>
+constexpr size_t BlockStore<NumBlocks, BlockSize>::block_size;
+template <size_t NumBlocks, size_t BlockSize>
+constexpr size_t BlockStore<NumBlocks, BlockSize>::num_bytes;
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef BLOCK_VOLUME_H__
+#define BLOCK_VOLUME_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "block_store.h"
+#include "block_parity.h"
+
+	// A volume stripes one global block id space across several block stores,
+	//  each with its own bitmap, lock and backing file, so allocation and I/O
+	//  on different stores don't contend. Global id g lives in store g % n as
+	//  local block g / n, so consecutive ids land on different stores.
+	//
+	//  A volume can also keep one or two parity images beside its stores (see
+	//  block_parity.h): P alone survives the loss of any one image, P and Q any
+	//  two. Parity covers what a store's image holds: the contents of allocated
+	//  blocks and the bitmap, with free blocks counting as zeroes (block 0 of
+	//  each store can't be read back and isn't covered either). It is updated
+	//  on every write, allocation and release. A volume missing images is
+	//  degraded: reads of a lost store are rebuilt from the others, calls that
+	//  would change it fail, and block_volume_rebuild brings it back.
+	typedef struct block_volume block_volume_t;
+
+	// How block_volume_allocate picks the store to allocate from
+	typedef enum
+	{
+		BLOCK_VOLUME_ROUND_ROBIN,  // rotate through the stores
+		BLOCK_VOLUME_LEAST_LOADED  // the store with the fewest used blocks
+	} block_volume_policy_t;
+
+	///
+	/// Creates a volume over n_stores new, empty block stores
+	/// \param n_stores Number of stores to stripe across
+	/// \param policy Allocation policy
+	/// \return Pointer to the new volume, NULL on error
+	///
+	block_volume_t *block_volume_create(const size_t n_stores, const block_volume_policy_t policy);
+
+	///
+	/// Creates a volume over n_stores new, empty block stores, kept with parity
+	///  On such a volume writes to the stores' bitmap blocks, local id
+	///  BITMAP_START_BLOCK, fail: the bitmaps belong to the parity.
+	/// \param n_stores Number of stores to stripe across, at most BLOCK_PARITY_MAX_DATA
+	/// \param n_parity Number of parity images, 0 (none) to BLOCK_PARITY_MAX
+	/// \param policy Allocation policy
+	/// \return Pointer to the new volume, NULL on error
+	///
+	block_volume_t *block_volume_create_parity(const size_t n_stores, const size_t n_parity, const block_volume_policy_t policy);
+
+	///
+	/// Destroys the volume and its stores
+	/// \param volume The volume, may be NULL
+	///
+	void block_volume_destroy(block_volume_t *const volume);
+
+	///
+	/// Returns the number of stores in the volume
+	/// \param volume The volume
+	/// \return Number of stores, 0 on error
+	///
+	size_t block_volume_get_stores(const block_volume_t *const volume);
+
+	///
+	/// Returns the number of parity images kept with the stores
+	/// \param volume The volume
+	/// \return Number of parity images, 0 on error or for a volume without parity
+	///
+	size_t block_volume_get_parity(const block_volume_t *const volume);
+
+	///
+	/// Counts the stores and parity images a degraded volume is missing
+	/// \param volume The volume
+	/// \return Number of lost images, 0 for a whole volume, SIZE_MAX on error
+	///
+	size_t block_volume_get_missing(block_volume_t *const volume);
+
+	///
+	/// Returns the size of the global block id space
+	/// \param volume The volume
+	/// \return Number of global block ids, 0 on error
+	///
+	size_t block_volume_get_total_blocks(const block_volume_t *const volume);
+
+	///
+	/// Allocates a free block from a store chosen by the volume's policy
+	/// \param volume The volume
+	/// \return Allocated global block id, SIZE_MAX on error or when every store is full
+	///
+	size_t block_volume_allocate(block_volume_t *const volume);
+
+	///
+	/// Attempts to allocate the requested global block id
+	/// \param volume The volume
+	/// \param block_id The global block id
+	/// \return true if the block was free and is now allocated
+	///
+	bool block_volume_request(block_volume_t *const volume, const size_t block_id);
+
+	///
+	/// Frees the specified global block id
+	/// \param volume The volume
+	/// \param block_id The global block id
+	///
+	void block_volume_release(block_volume_t *const volume, const size_t block_id);
+
+	///
+	/// Counts the blocks in use across all stores
+	/// \param volume The volume
+	/// \return Total blocks in use, SIZE_MAX on error
+	///
+	size_t block_volume_get_used_blocks(block_volume_t *const volume);
+
+	///
+	/// Reads one block into the buffer
+	/// \param volume The volume
+	/// \param block_id Global source block id
+	/// \param buffer Buffer of BLOCK_SIZE_BYTES
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_volume_read(block_volume_t *const volume, const size_t block_id, void *buffer);
+
+	///
+	/// Writes one block from the buffer
+	/// \param volume The volume
+	/// \param block_id Global destination block id
+	/// \param buffer Buffer of BLOCK_SIZE_BYTES
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_volume_write(block_volume_t *const volume, const size_t block_id, const void *buffer);
+
+	///
+	/// Reads several blocks, with each store's share handled in parallel by that store's worker
+	/// \param volume The volume
+	/// \param block_ids Global block ids to read
+	/// \param n Number of blocks
+	/// \param buffers One BLOCK_SIZE_BYTES buffer per block
+	/// \return Total bytes read, less than n * BLOCK_SIZE_BYTES if any block failed
+	///
+	size_t block_volume_readv(block_volume_t *const volume, const size_t *const block_ids, const size_t n, void *const *buffers);
+
+	///
+	/// Writes several blocks, with each store's share handled in parallel by that store's worker
+	/// \param volume The volume
+	/// \param block_ids Global block ids to write
+	/// \param n Number of blocks
+	/// \param buffers One BLOCK_SIZE_BYTES buffer per block
+	/// \return Total bytes written, less than n * BLOCK_SIZE_BYTES if any block failed
+	///
+	size_t block_volume_writev(block_volume_t *const volume, const size_t *const block_ids, const size_t n, const void *const *buffers);
+
+	///
+	/// Serializes each store to its own file, then each parity image to its own file
+	///  A degraded volume has to be rebuilt first.
+	/// \param volume The volume
+	/// \param filenames One file name per store, followed by one per parity image
+	/// \return Total bytes written, 0 on error
+	///
+	size_t block_volume_serialize(block_volume_t *const volume, const char *const *filenames);
+
+	///
+	/// Rebuilds a volume from one serialized store per file
+	/// \param filenames The store files, in stripe order
+	/// \param n_stores Number of files
+	/// \param policy Allocation policy
+	/// \return Pointer to the new volume, NULL on error
+	///
+	block_volume_t *block_volume_deserialize(const char *const *filenames, const size_t n_stores, const block_volume_policy_t policy);
+
+	///
+	/// Rebuilds a volume kept with parity from its files, tolerating lost ones
+	///  A store or parity file that is missing or fails to load counts as lost;
+	///  up to n_parity of them leave the volume degraded rather than failing.
+	/// \param filenames The store files in stripe order, followed by the parity files
+	/// \param n_stores Number of store files
+	/// \param n_parity Number of parity files
+	/// \param policy Allocation policy
+	/// \return Pointer to the new volume, NULL on error or with too many files lost
+	///
+	block_volume_t *block_volume_deserialize_parity(const char *const *filenames, const size_t n_stores, const size_t n_parity,
+													 const block_volume_policy_t policy);
+
+	///
+	/// Recreates the lost stores and parity images of a degraded volume from the rest
+	/// \param volume The volume
+	/// \return Number of images rebuilt, SIZE_MAX on error or if too many are lost
+	///
+	size_t block_volume_rebuild(block_volume_t *const volume);
+
+	///
+	/// Recomputes the parity of a whole volume and compares it with what is kept
+	/// \param volume The volume, not degraded
+	/// \return Number of blocks (rows across the stores) whose parity disagrees, SIZE_MAX on error
+	///
+	size_t block_volume_verify(block_volume_t *const volume);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
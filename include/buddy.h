@@ -0,0 +1,79 @@
+#ifndef BUDDY_H__
+#define BUDDY_H__
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "bitmap.h"
+
+typedef struct buddy buddy_t;
+
+// Binary buddy allocator over block ids [0, n_blocks)
+// Free space is kept as aligned power-of-two extents on one free list per order,
+// so allocating or freeing a 2^k extent takes O(log n) list operations.
+// Like the bitmap, it trusts its caller: it does not track what is allocated,
+// freeing something that is already free WILL corrupt it.
+
+///
+/// Creates a buddy allocator with every block in use
+/// \param n_blocks Number of blocks it manages
+/// \return New allocator pointer, NULL on error
+///
+buddy_t *buddy_create(const size_t n_blocks);
+
+///
+/// Destructs and destroys the allocator
+/// \param buddy The allocator
+///
+void buddy_destroy(buddy_t *buddy);
+
+///
+/// Rebuilds the free lists from a bitmap (zero bits are free)
+///  Free space is carved greedily into the largest aligned extents that fit
+/// \param buddy The allocator
+/// \param bitmap The allocation bitmap, at least n_blocks bits
+///
+void buddy_rebuild(buddy_t *const buddy, const bitmap_t *const bitmap);
+
+///
+/// Takes an aligned extent of 2^order blocks off the free lists, splitting a larger one if needed
+/// \param buddy The allocator
+/// \param order Log2 of the extent size
+/// \return First block of the extent, SIZE_MAX if none is free
+///
+size_t buddy_alloc(buddy_t *const buddy, const unsigned order);
+
+///
+/// Returns an aligned extent of 2^order blocks, merging it with free buddies
+/// \param buddy The allocator
+/// \param block First block of the extent
+/// \param order Log2 of the extent size
+///
+void buddy_free(buddy_t *const buddy, size_t block, unsigned order);
+
+///
+/// Takes one specific free block off the free lists, splitting the extent that holds it
+/// \param buddy The allocator
+/// \param block The block
+/// \return false if the block was not free
+///
+bool buddy_claim(buddy_t *const buddy, const size_t block);
+
+///
+/// Returns the largest order an extent can have
+/// \param buddy The allocator
+/// \return Log2 of the largest extent
+///
+unsigned buddy_max_order(const buddy_t *const buddy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -69,6 +69,30 @@ void bitmap_reset(bitmap_t *const bitmap, const size_t bit)
     bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
 }
 
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) 
+{
+    if (!bitmap || start >= bitmap->bit_count) 
+    {
+        return;
+    }
+    const size_t end = count < bitmap->bit_count - start ? start + count : bitmap->bit_count;
+    size_t bit = start;
+    // bit by bit up to a byte boundary, whole bytes, then the tail bit by bit
+    for (; bit < end && (bit & 0x07); ++bit) 
+    {
+        bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    }
+    if (end - bit >= 8) 
+    {
+        memset(bitmap->data + (bit >> 3), 0x00, (end - bit) >> 3);
+        bit += (end - bit) & ~(size_t) 0x07;
+    }
+    for (; bit < end; ++bit) 
+    {
+        bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    }
+}
+
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) 
 {
     return bitmap->data[bit >> 3] & mask[bit & 0x07];
@@ -87,30 +111,112 @@ void bitmap_invert(bitmap_t *const bitmap)
     }
 }
 
-size_t bitmap_ffs(const bitmap_t *const bitmap) 
+// Word-at-a-time searches. flip is 0xFF to look for zero bits, 0x00 for set bits,
+// so every wanted bit is a one in (byte ^ flip). Whole 8-byte words with nothing
+// wanted in them are skipped with one compare; that test doesn't care about byte
+// order, only the byte holding the answer is picked apart.
+static size_t find_from(const bitmap_t *const bitmap, const size_t start, const uint8_t flip) 
 {
-    if (bitmap) 
+    if (!bitmap || start >= bitmap->bit_count) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
+        return SIZE_MAX;
+    }
+    const uint64_t flip_word = flip ? UINT64_MAX : 0;
+    size_t byte = start >> 3;
+    // ignore the bits below start in the first byte
+    unsigned want = (uint8_t)(bitmap->data[byte] ^ flip) & (uint8_t) ~(mask_down_inclusive[start & 0x07] >> 1);
+    while (!want) 
+    {
+        ++byte;
+        uint64_t word;
+        while (byte + sizeof(word) <= bitmap->byte_count) 
         {
+            memcpy(&word, bitmap->data + byte, sizeof(word));
+            if (word != flip_word) 
+            {
+                break;
+            }
+            byte += sizeof(word);
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        if (byte >= bitmap->byte_count) 
+        {
+            return SIZE_MAX;
+        }
+        want = (uint8_t)(bitmap->data[byte] ^ flip);
     }
-    return SIZE_MAX;
+    // bits past bit_count in the last byte are undetermined
+    const size_t result = (byte << 3) + __builtin_ctz(want);
+    return (result < bitmap->bit_count ? result : SIZE_MAX);
 }
 
-size_t bitmap_ffz(const bitmap_t *const bitmap) 
+static size_t find_before(const bitmap_t *const bitmap, size_t start, const uint8_t flip) 
 {
-    if (bitmap) 
+    if (!bitmap || bitmap->bit_count == 0) 
+    {
+        return SIZE_MAX;
+    }
+    if (start >= bitmap->bit_count) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
+        start = bitmap->bit_count - 1;
+    }
+    const uint64_t flip_word = flip ? UINT64_MAX : 0;
+    size_t byte = start >> 3;
+    // ignore the bits above start in the first byte
+    unsigned want = (uint8_t)(bitmap->data[byte] ^ flip) & mask_down_inclusive[start & 0x07];
+    while (!want) 
+    {
+        if (byte == 0) 
         {
+            return SIZE_MAX;
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        --byte;
+        uint64_t word;
+        while (byte >= sizeof(word) - 1) 
+        {
+            memcpy(&word, bitmap->data + byte - (sizeof(word) - 1), sizeof(word));
+            if (word != flip_word) 
+            {
+                break;
+            }
+            if (byte < sizeof(word)) 
+            {
+                return SIZE_MAX;
+            }
+            byte -= sizeof(word);
+        }
+        want = (uint8_t)(bitmap->data[byte] ^ flip);
     }
-    return SIZE_MAX;
+    return (byte << 3) + (sizeof(unsigned) * 8 - 1 - __builtin_clz(want));
+}
+
+size_t bitmap_ffs(const bitmap_t *const bitmap) 
+{
+    return find_from(bitmap, 0, 0x00);
+}
+
+size_t bitmap_ffz(const bitmap_t *const bitmap) 
+{
+    return find_from(bitmap, 0, 0xFF);
+}
+
+size_t bitmap_ffs_from(const bitmap_t *const bitmap, const size_t start) 
+{
+    return find_from(bitmap, start, 0x00);
+}
+
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start) 
+{
+    return find_from(bitmap, start, 0xFF);
+}
+
+size_t bitmap_flz_from(const bitmap_t *const bitmap, const size_t start) 
+{
+    return find_before(bitmap, start, 0xFF);
+}
+
+size_t bitmap_fls_from(const bitmap_t *const bitmap, const size_t start) 
+{
+    return find_before(bitmap, start, 0);
 }
 
 size_t bitmap_total_set(const bitmap_t *const bitmap) 
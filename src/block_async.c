@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "block_async.h"
+
+struct block_async
+{
+    block_store_t *bs;
+    pthread_mutex_t store_lock;  // the store itself does no locking
+
+    // submission ring, guarded by queue_lock
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_changed;
+    block_async_request_t **queue;
+    size_t queue_depth;
+    size_t head;
+    size_t count;
+    size_t running;  // requests taken by a worker and not yet completed
+    bool barrier;    // a sync is running, nothing else may start
+    bool stop;
+
+    // completion queue, guarded by completion_lock
+    pthread_mutex_t completion_lock;
+    block_async_request_t *completed_head;
+    block_async_request_t *completed_tail;
+    int event_fd;
+
+    pthread_t *workers;
+    size_t n_workers;
+};
+
+/// Runs a request against the store
+/// \param async The context
+/// \param request The request
+static void async_execute(block_async_t *const async, block_async_request_t *const request)
+{
+    pthread_mutex_lock(&async->store_lock);
+    switch (request->op)
+    {
+    case BLOCK_ASYNC_READ:
+        request->result = block_store_read(async->bs, request->block_id, request->buffer);
+        break;
+    case BLOCK_ASYNC_WRITE:
+        request->result = block_store_write(async->bs, request->block_id, request->buffer);
+        break;
+    case BLOCK_ASYNC_ALLOCATE:
+        request->result = block_store_allocate(async->bs);
+        break;
+    case BLOCK_ASYNC_SYNC:
+        request->result = block_store_serialize(async->bs, request->filename);
+        break;
+    default:
+        request->result = 0;
+        break;
+    }
+    pthread_mutex_unlock(&async->store_lock);
+}
+
+/// Hands a finished request back to its submitter
+/// \param async The context
+/// \param request The request
+static void async_complete(block_async_t *const async, block_async_request_t *const request)
+{
+    if (request->callback != NULL)
+    {
+        request->callback(request, request->arg);
+        return;
+    }
+
+    pthread_mutex_lock(&async->completion_lock);
+    request->next = NULL;
+    if (async->completed_tail != NULL)
+        async->completed_tail->next = request;
+    else
+        async->completed_head = request;
+    async->completed_tail = request;
+    const uint64_t one = 1;
+    if (write(async->event_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        // the counter can't overflow with this few completions outstanding
+    }
+    pthread_mutex_unlock(&async->completion_lock);
+}
+
+static void *async_worker(void *arg)
+{
+    block_async_t *async = (block_async_t *)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&async->queue_lock);
+        // a sync waits at the head of the queue until everything before it is done
+        while (!(async->count == 0 && async->stop) &&
+               (async->count == 0 || async->barrier ||
+                (async->queue[async->head]->op == BLOCK_ASYNC_SYNC && async->running > 0)))
+        {
+            pthread_cond_wait(&async->queue_changed, &async->queue_lock);
+        }
+        if (async->count == 0)
+        {
+            pthread_mutex_unlock(&async->queue_lock);
+            return NULL;
+        }
+        block_async_request_t *request = async->queue[async->head];
+        async->head = (async->head + 1) % async->queue_depth;
+        async->count--;
+        async->running++;
+        async->barrier = request->op == BLOCK_ASYNC_SYNC;
+        pthread_cond_broadcast(&async->queue_changed);
+        pthread_mutex_unlock(&async->queue_lock);
+
+        async_execute(async, request);
+        const bool sync = request->op == BLOCK_ASYNC_SYNC;
+
+        pthread_mutex_lock(&async->queue_lock);
+        async->running--;
+        if (sync)
+            async->barrier = false;
+        pthread_cond_broadcast(&async->queue_changed);
+        pthread_mutex_unlock(&async->queue_lock);
+
+        // the request belongs to the submitter again once completed
+        async_complete(async, request);
+    }
+}
+
+block_async_t *block_async_create(block_store_t *const bs, const size_t n_workers, const size_t queue_depth)
+{
+    if (bs == NULL || n_workers == 0 || queue_depth == 0)
+    {
+        return NULL;
+    }
+    block_async_t *async = (block_async_t *)calloc(1, sizeof(block_async_t));
+    if (async == NULL)
+    {
+        return NULL;
+    }
+    async->bs = bs;
+    async->queue_depth = queue_depth;
+    async->queue = (block_async_request_t **)calloc(queue_depth, sizeof(block_async_request_t *));
+    async->workers = (pthread_t *)calloc(n_workers, sizeof(pthread_t));
+    async->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (async->queue == NULL || async->workers == NULL || async->event_fd == -1)
+    {
+        if (async->event_fd != -1)
+            close(async->event_fd);
+        free(async->queue);
+        free(async->workers);
+        free(async);
+        return NULL;
+    }
+    pthread_mutex_init(&async->store_lock, NULL);
+    pthread_mutex_init(&async->queue_lock, NULL);
+    pthread_cond_init(&async->queue_changed, NULL);
+    pthread_mutex_init(&async->completion_lock, NULL);
+
+    for (; async->n_workers < n_workers; async->n_workers++)
+    {
+        if (pthread_create(&async->workers[async->n_workers], NULL, async_worker, async) != 0)
+        {
+            block_async_destroy(async);
+            return NULL;
+        }
+    }
+    return async;
+}
+
+void block_async_destroy(block_async_t *const async)
+{
+    if (async == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&async->queue_lock);
+    async->stop = true;
+    pthread_cond_broadcast(&async->queue_changed);
+    pthread_mutex_unlock(&async->queue_lock);
+    for (size_t i = 0; i < async->n_workers; i++)
+    {
+        pthread_join(async->workers[i], NULL);
+    }
+
+    close(async->event_fd);
+    pthread_mutex_destroy(&async->store_lock);
+    pthread_mutex_destroy(&async->queue_lock);
+    pthread_cond_destroy(&async->queue_changed);
+    pthread_mutex_destroy(&async->completion_lock);
+    free(async->queue);
+    free(async->workers);
+    free(async);
+}
+
+bool block_async_submit(block_async_t *const async, block_async_request_t *const request, const bool wait)
+{
+    if (async == NULL || request == NULL)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&async->queue_lock);
+    while (async->count == async->queue_depth && wait && !async->stop)
+    {
+        pthread_cond_wait(&async->queue_changed, &async->queue_lock);
+    }
+    if (async->count == async->queue_depth || async->stop)
+    {
+        pthread_mutex_unlock(&async->queue_lock);
+        return false;
+    }
+    async->queue[(async->head + async->count) % async->queue_depth] = request;
+    async->count++;
+    pthread_cond_broadcast(&async->queue_changed);
+    pthread_mutex_unlock(&async->queue_lock);
+    return true;
+}
+
+int block_async_fd(const block_async_t *const async)
+{
+    return async != NULL ? async->event_fd : -1;
+}
+
+size_t block_async_reap(block_async_t *const async, block_async_request_t **const requests, const size_t max)
+{
+    if (async == NULL || requests == NULL)
+    {
+        return 0;
+    }
+    size_t reaped = 0;
+    pthread_mutex_lock(&async->completion_lock);
+    while (reaped < max && async->completed_head != NULL)
+    {
+        requests[reaped++] = async->completed_head;
+        async->completed_head = async->completed_head->next;
+    }
+    if (async->completed_head == NULL)
+    {
+        // nothing left, so the eventfd should stop polling readable
+        async->completed_tail = NULL;
+        uint64_t count;
+        if (read(async->event_fd, &count, sizeof(count)) != sizeof(count))
+        {
+            // already zero
+        }
+    }
+    pthread_mutex_unlock(&async->completion_lock);
+    return reaped;
+}
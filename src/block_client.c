@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "block_client.h"
+#include "block_server.h"
+
+struct block_client
+{
+    int fd;
+    uint8_t *ring;  // slots * BLOCK_SIZE_BYTES, shared with the server
+    size_t slots;
+    block_server_request_t *requests;    // one per slot
+    block_server_response_t *responses;  // one per slot
+    bool broken;    // the connection failed, every call now fails without trying
+};
+
+/// Sends all of a buffer, retrying short writes
+/// \param fd The socket
+/// \param data The bytes
+/// \param length Number of bytes
+/// \return false if the socket failed
+static bool send_all(const int fd, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (length > 0)
+    {
+        ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/// Receives exactly length bytes
+/// \param fd The socket
+/// \param data Receives the bytes
+/// \param length Number of bytes
+/// \return false if the socket failed or closed first
+static bool recv_all(const int fd, void *data, size_t length)
+{
+    uint8_t *bytes = (uint8_t *)data;
+    while (length > 0)
+    {
+        ssize_t received = recv(fd, bytes, length, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        bytes += received;
+        length -= received;
+    }
+    return true;
+}
+
+/// Sends a batch of requests, then waits for all their results
+/// \param client The client
+/// \param requests The requests, at most client->slots
+/// \param responses Receives one response per request
+/// \param n Number of requests
+/// \return false if the connection failed, now or before
+static bool client_call(block_client_t *const client, const block_server_request_t *const requests,
+                        block_server_response_t *const responses, const size_t n)
+{
+    if (client == NULL || client->broken)
+    {
+        return false;
+    }
+    if (!send_all(client->fd, requests, n * sizeof(block_server_request_t)) ||
+        !recv_all(client->fd, responses, n * sizeof(block_server_response_t)))
+    {
+        client->broken = true;
+        return false;
+    }
+    return true;
+}
+
+/// Sends one request that needs no slot data
+/// \param client The client
+/// \param op The operation
+/// \param block_id The block, if the operation takes one
+/// \param error What to return if the call fails
+/// \return The result, error on failure
+static uint64_t client_call_one(block_client_t *const client, const block_server_op_t op, const size_t block_id,
+                                const uint64_t error)
+{
+    block_server_request_t request = {op, 0, block_id};
+    block_server_response_t response;
+    return client_call(client, &request, &response, 1) ? response.result : error;
+}
+
+block_client_t *block_client_connect(const char *const socket_path)
+{
+    struct sockaddr_un address = {0};
+    if (socket_path == NULL || strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        return NULL;
+    }
+    block_client_t *client = (block_client_t *)calloc(1, sizeof(block_client_t));
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    client->ring = (uint8_t *)MAP_FAILED;
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd == -1 || connect(client->fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        block_client_disconnect(client);
+        return NULL;
+    }
+
+    // the hello carries the ring's memfd
+    block_server_hello_t hello;
+    struct iovec iov = {&hello, sizeof(hello)};
+    union
+    {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    ssize_t received;
+    do
+    {
+        received = recvmsg(client->fd, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    int ring_fd = -1;
+    struct cmsghdr *cmsg = received == (ssize_t)sizeof(hello) ? CMSG_FIRSTHDR(&message) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&ring_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (ring_fd == -1 || hello.magic != BLOCK_SERVER_MAGIC || hello.version != BLOCK_SERVER_VERSION ||
+        hello.slots == 0)
+    {
+        if (ring_fd != -1)
+            close(ring_fd);
+        block_client_disconnect(client);
+        return NULL;
+    }
+    client->slots = hello.slots;
+    client->ring = (uint8_t *)mmap(NULL, client->slots * BLOCK_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    close(ring_fd);
+    client->requests = (block_server_request_t *)calloc(client->slots, sizeof(block_server_request_t));
+    client->responses = (block_server_response_t *)calloc(client->slots, sizeof(block_server_response_t));
+    if (client->ring == MAP_FAILED || client->requests == NULL || client->responses == NULL)
+    {
+        block_client_disconnect(client);
+        return NULL;
+    }
+    return client;
+}
+
+void block_client_disconnect(block_client_t *const client)
+{
+    if (client == NULL)
+    {
+        return;
+    }
+    if (client->ring != MAP_FAILED)
+    {
+        munmap(client->ring, client->slots * BLOCK_SIZE_BYTES);
+    }
+    if (client->fd != -1)
+    {
+        close(client->fd);
+    }
+    free(client->requests);
+    free(client->responses);
+    free(client);
+}
+
+size_t block_client_allocate(block_client_t *const client)
+{
+    return client_call_one(client, BLOCK_SERVER_OP_ALLOCATE, 0, SIZE_MAX);
+}
+
+bool block_client_request(block_client_t *const client, const size_t block_id)
+{
+    return client_call_one(client, BLOCK_SERVER_OP_REQUEST, block_id, false);
+}
+
+void block_client_release(block_client_t *const client, const size_t block_id)
+{
+    client_call_one(client, BLOCK_SERVER_OP_RELEASE, block_id, false);
+}
+
+size_t block_client_get_used_blocks(block_client_t *const client)
+{
+    return client_call_one(client, BLOCK_SERVER_OP_USED, 0, SIZE_MAX);
+}
+
+size_t block_client_get_free_blocks(block_client_t *const client)
+{
+    return client_call_one(client, BLOCK_SERVER_OP_FREE, 0, SIZE_MAX);
+}
+
+size_t block_client_read(block_client_t *const client, const size_t block_id, void *buffer)
+{
+    return block_client_readv(client, &block_id, 1, &buffer);
+}
+
+size_t block_client_write(block_client_t *const client, const size_t block_id, const void *buffer)
+{
+    return block_client_writev(client, &block_id, 1, &buffer);
+}
+
+size_t block_client_serialize(block_client_t *const client)
+{
+    return client_call_one(client, BLOCK_SERVER_OP_SERIALIZE, 0, 0);
+}
+
+/// Reads or writes several blocks through the ring, a ring's worth of requests per round trip
+/// \param client The client
+/// \param op BLOCK_SERVER_OP_READ or BLOCK_SERVER_OP_WRITE
+/// \param block_ids The blocks
+/// \param n Number of blocks
+/// \param read_buffers Destination of each block, for reads
+/// \param write_buffers Source of each block, for writes
+/// \return Total bytes transferred
+static size_t client_transfer(block_client_t *const client, const block_server_op_t op, const size_t *const block_ids,
+                              const size_t n, void *const *read_buffers, const void *const *write_buffers)
+{
+    if (client == NULL || block_ids == NULL || (read_buffers == NULL && write_buffers == NULL))
+    {
+        return 0;
+    }
+    block_server_request_t *const requests = client->requests;
+    block_server_response_t *const responses = client->responses;
+    const size_t window = client->slots;
+
+    size_t total = 0;
+    for (size_t first = 0; first < n; first += window)
+    {
+        const size_t count = n - first < window ? n - first : window;
+        for (size_t i = 0; i < count; i++)
+        {
+            requests[i] = (block_server_request_t){op, (uint32_t)i, block_ids[first + i]};
+            if (write_buffers != NULL)
+            {
+                // a missing buffer becomes a request the server refuses, as block_store_write would
+                if (write_buffers[first + i] == NULL)
+                    requests[i].slot = UINT32_MAX;
+                else
+                    memcpy(client->ring + i * BLOCK_SIZE_BYTES, write_buffers[first + i], BLOCK_SIZE_BYTES);
+            }
+            else if (read_buffers[first + i] == NULL)
+            {
+                requests[i].slot = UINT32_MAX;
+            }
+        }
+        if (!client_call(client, requests, responses, count))
+        {
+            break;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            if (read_buffers != NULL && responses[i].result == BLOCK_SIZE_BYTES)
+            {
+                memcpy(read_buffers[first + i], client->ring + i * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+            }
+            total += responses[i].result;
+        }
+    }
+    return total;
+}
+
+size_t block_client_readv(block_client_t *const client, const size_t *const block_ids, const size_t n, void *const *buffers)
+{
+    return client_transfer(client, BLOCK_SERVER_OP_READ, block_ids, n, buffers, NULL);
+}
+
+size_t block_client_writev(block_client_t *const client, const size_t *const block_ids, const size_t n, const void *const *buffers)
+{
+    return client_transfer(client, BLOCK_SERVER_OP_WRITE, block_ids, n, NULL, buffers);
+}
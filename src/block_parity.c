@@ -0,0 +1,396 @@
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARITY_X86
+#endif
+#include "block_parity.h"
+
+// Bytes of every buffer handled per pass, so P and Q stay in L1 while the data streams by
+#define PARITY_SLICE_BYTES 4096
+
+// Products of a constant with every low nibble and every high nibble;
+//  c * x is lo[x & 15] ^ hi[x >> 4]
+typedef struct gf_table
+{
+    _Alignas(16) uint8_t lo[16];
+    _Alignas(16) uint8_t hi[16];
+} gf_table_t;
+
+/// Multiplies in GF(2^8) modulo x^8 + x^4 + x^3 + x^2 + 1
+/// \param a First factor
+/// \param b Second factor
+/// \return The product
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    uint8_t product = 0;
+    while (b != 0)
+    {
+        if (b & 1)
+            product ^= a;
+        a = (uint8_t)((a << 1) ^ (a & 0x80 ? 0x1D : 0));
+        b >>= 1;
+    }
+    return product;
+}
+
+/// Raises the generator to a power
+/// \param exponent The power
+/// \return g^exponent
+static uint8_t gf_exp(size_t exponent)
+{
+    uint8_t result = 1;
+    for (exponent %= 255; exponent > 0; exponent--)
+    {
+        result = gf_mul(result, 2);
+    }
+    return result;
+}
+
+/// Finds a multiplicative inverse, a^254 since a^255 = 1
+/// \param a Nonzero element
+/// \return 1 / a
+static uint8_t gf_inv(const uint8_t a)
+{
+    uint8_t result = 1;
+    uint8_t square = a;
+    for (unsigned exponent = 254; exponent > 0; exponent >>= 1)
+    {
+        if (exponent & 1)
+            result = gf_mul(result, square);
+        square = gf_mul(square, square);
+    }
+    return result;
+}
+
+/// Fills in the nibble tables for multiplying by a constant
+/// \param table The tables
+/// \param c The constant
+static void gf_table_init(gf_table_t *const table, const uint8_t c)
+{
+    for (unsigned nibble = 0; nibble < 16; nibble++)
+    {
+        table->lo[nibble] = gf_mul(c, (uint8_t)nibble);
+        table->hi[nibble] = gf_mul(c, (uint8_t)(nibble << 4));
+    }
+}
+
+// Tables for g^i, shared by every call once parity_init has built them
+static gf_table_t exp_tables[BLOCK_PARITY_MAX_DATA];
+
+/// Looks up the tables for multiplying by g^i
+/// \param i The power
+/// \return The tables
+static const gf_table_t *gf_exp_table(const size_t i)
+{
+    return &exp_tables[i % 255];
+}
+
+/// XORs one region into another
+/// \param dst Region to update
+/// \param src Region to add
+/// \param length Bytes
+static void region_xor_scalar(uint8_t *const dst, const uint8_t *const src, const size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+/// Multiplies a region by a constant, storing or XORing the product into another
+/// \param dst Region receiving the product, may be src
+/// \param src Region to multiply
+/// \param table Tables of the constant
+/// \param length Bytes
+/// \param accumulate true to XOR the product into dst, false to overwrite dst
+static void region_mul_scalar(uint8_t *const dst, const uint8_t *const src, const gf_table_t *const table,
+                              const size_t length, const bool accumulate)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        const uint8_t product = table->lo[src[i] & 0x0F] ^ table->hi[src[i] >> 4];
+        dst[i] = accumulate ? dst[i] ^ product : product;
+    }
+}
+
+#ifdef PARITY_X86
+
+// Each vector kernel is compiled for its own instruction set and only called
+//  once the CPU is known to have it, so the library runs on any x86 machine.
+
+__attribute__((target("sse2"))) static void region_xor_sse2(uint8_t *const dst, const uint8_t *const src,
+                                                           const size_t length)
+{
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        const __m128i sum = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), _mm_loadu_si128((const __m128i *)(src + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), sum);
+    }
+    region_xor_scalar(dst + i, src + i, length - i);
+}
+
+__attribute__((target("ssse3"))) static void region_mul_ssse3(uint8_t *const dst, const uint8_t *const src,
+                                                             const gf_table_t *const table, const size_t length,
+                                                             const bool accumulate)
+{
+    size_t i = 0;
+    const __m128i lo = _mm_load_si128((const __m128i *)table->lo);
+    const __m128i hi = _mm_load_si128((const __m128i *)table->hi);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    for (; i + 16 <= length; i += 16)
+    {
+        const __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, nibble)),
+                                        _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), nibble)));
+        if (accumulate)
+            product = _mm_xor_si128(product, _mm_loadu_si128((const __m128i *)(dst + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), product);
+    }
+    region_mul_scalar(dst + i, src + i, table, length - i, accumulate);
+}
+
+__attribute__((target("avx2"))) static void region_xor_avx2(uint8_t *const dst, const uint8_t *const src,
+                                                           const size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        const __m256i sum = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), _mm256_loadu_si256((const __m256i *)(src + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), sum);
+    }
+    region_xor_scalar(dst + i, src + i, length - i);
+}
+
+__attribute__((target("avx2"))) static void region_mul_avx2(uint8_t *const dst, const uint8_t *const src,
+                                                           const gf_table_t *const table, const size_t length,
+                                                           const bool accumulate)
+{
+    size_t i = 0;
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)table->lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)table->hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    for (; i + 32 <= length; i += 32)
+    {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, nibble)),
+                                           _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), nibble)));
+        if (accumulate)
+            product = _mm256_xor_si256(product, _mm256_loadu_si256((const __m256i *)(dst + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), product);
+    }
+    region_mul_scalar(dst + i, src + i, table, length - i, accumulate);
+}
+
+#endif
+
+// The kernels picked for this CPU by parity_init
+static const char *kernel_name = "scalar";
+static void (*region_xor)(uint8_t *const, const uint8_t *const, const size_t) = region_xor_scalar;
+static void (*region_mul)(uint8_t *const, const uint8_t *const, const gf_table_t *const, const size_t,
+                          const bool) = region_mul_scalar;
+static pthread_once_t parity_once = PTHREAD_ONCE_INIT;
+
+/// Builds exp_tables and picks the fastest kernels the CPU runs, once
+static void parity_init()
+{
+    uint8_t power = 1;
+    for (size_t i = 0; i < BLOCK_PARITY_MAX_DATA; i++)
+    {
+        gf_table_init(&exp_tables[i], power);
+        power = gf_mul(power, 2);
+    }
+
+#ifdef PARITY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernel_name = "avx2";
+        region_xor = region_xor_avx2;
+        region_mul = region_mul_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        kernel_name = "ssse3";
+        region_xor = region_xor_sse2;
+        region_mul = region_mul_ssse3;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        region_xor = region_xor_sse2;
+    }
+#endif
+}
+
+const char *block_parity_kernel()
+{
+    pthread_once(&parity_once, parity_init);
+    return kernel_name;
+}
+
+/// Computes P and/or Q over a slice of the data
+/// \param data The data buffers, already offset to the slice
+/// \param n_data Number of data buffers
+/// \param p Where P goes, NULL to skip it
+/// \param q Where Q goes, NULL to skip it
+/// \param length Bytes in the slice
+static void encode_slice(const uint8_t *const *data, const size_t n_data, uint8_t *const p, uint8_t *const q,
+                         const size_t length)
+{
+    if (p != NULL)
+    {
+        memcpy(p, data[0], length);
+        for (size_t i = 1; i < n_data; i++)
+            region_xor(p, data[i], length);
+    }
+    if (q != NULL)
+    {
+        memcpy(q, data[0], length);
+        for (size_t i = 1; i < n_data; i++)
+            region_mul(q, data[i], gf_exp_table(i), length, true);
+    }
+}
+
+/// Computes P and/or Q, a slice of every buffer at a time
+/// \param data The data buffers
+/// \param n_data Number of data buffers
+/// \param p Where P goes, NULL to skip it
+/// \param q Where Q goes, NULL to skip it
+/// \param length Bytes per buffer
+static void encode(const uint8_t *const *data, const size_t n_data, uint8_t *const p, uint8_t *const q, const size_t length)
+{
+    const uint8_t *slice[BLOCK_PARITY_MAX_DATA];
+    for (size_t offset = 0; offset < length; offset += PARITY_SLICE_BYTES)
+    {
+        const size_t piece = length - offset < PARITY_SLICE_BYTES ? length - offset : PARITY_SLICE_BYTES;
+        for (size_t i = 0; i < n_data; i++)
+            slice[i] = data[i] + offset;
+        encode_slice(slice, n_data, p != NULL ? p + offset : NULL, q != NULL ? q + offset : NULL, piece);
+    }
+}
+
+bool block_parity_encode(const void *const *data, const size_t n_data, void *const *parity, const size_t n_parity,
+                         const size_t length)
+{
+    pthread_once(&parity_once, parity_init);
+
+    // check for invalid parameters
+    if (data == NULL || parity == NULL || n_data == 0 || n_data > BLOCK_PARITY_MAX_DATA || n_parity == 0 ||
+        n_parity > BLOCK_PARITY_MAX || parity[0] == NULL || (n_parity == 2 && parity[1] == NULL))
+    {
+        return false;
+    }
+    encode((const uint8_t *const *)data, n_data, (uint8_t *)parity[0], n_parity == 2 ? (uint8_t *)parity[1] : NULL, length);
+    return true;
+}
+
+bool block_parity_update(const size_t index, const void *const delta, void *const *parity, const size_t n_parity,
+                         const size_t length)
+{
+    pthread_once(&parity_once, parity_init);
+
+    // check for invalid parameters
+    if (delta == NULL || parity == NULL || index >= BLOCK_PARITY_MAX_DATA || n_parity == 0 || n_parity > BLOCK_PARITY_MAX)
+    {
+        return false;
+    }
+    if (parity[0] != NULL)
+    {
+        region_xor((uint8_t *)parity[0], (const uint8_t *)delta, length);
+    }
+    if (n_parity == 2 && parity[1] != NULL)
+    {
+        region_mul((uint8_t *)parity[1], (const uint8_t *)delta, gf_exp_table(index), length, true);
+    }
+    return true;
+}
+
+bool block_parity_recover(void *const *buffers, const size_t n_data, const size_t n_parity, const size_t *const lost,
+                          const size_t n_lost, const size_t length)
+{
+    pthread_once(&parity_once, parity_init);
+
+    // check for invalid parameters
+    if (buffers == NULL || (lost == NULL && n_lost > 0) || n_data == 0 || n_data > BLOCK_PARITY_MAX_DATA ||
+        n_parity == 0 || n_parity > BLOCK_PARITY_MAX || n_lost > n_parity)
+    {
+        return false;
+    }
+
+    // sort out which data buffers are gone (at most two) and whether P or Q is
+    size_t lost_data[BLOCK_PARITY_MAX];
+    size_t n_lost_data = 0;
+    bool p_lost = false, q_lost = false;
+    for (size_t i = 0; i < n_lost; i++)
+    {
+        if (lost[i] >= n_data + n_parity)
+            return false;
+        if (lost[i] == n_data)
+            p_lost = true;
+        else if (lost[i] == n_data + 1)
+            q_lost = true;
+        else
+            lost_data[n_lost_data++] = lost[i];
+    }
+    if (n_lost_data == 2 && lost_data[0] == lost_data[1])
+    {
+        return false;
+    }
+
+    uint8_t *const *bytes = (uint8_t *const *)buffers;
+    uint8_t *const p = bytes[n_data];
+    uint8_t *const q = n_parity == 2 ? bytes[n_data + 1] : NULL;
+    if (n_lost_data == 1 && !p_lost)
+    {
+        // Dx = P + the sum of the other data
+        const size_t x = lost_data[0];
+        memcpy(bytes[x], p, length);
+        for (size_t i = 0; i < n_data; i++)
+        {
+            if (i != x)
+                region_xor(bytes[x], bytes[i], length);
+        }
+    }
+    else if (n_lost_data == 1)
+    {
+        // Dx = (Q + the sum of g^i Di over the other data) / g^x
+        const size_t x = lost_data[0];
+        memcpy(bytes[x], q, length);
+        for (size_t i = 0; i < n_data; i++)
+        {
+            if (i != x)
+                region_mul(bytes[x], bytes[i], gf_exp_table(i), length, true);
+        }
+        gf_table_t scale;
+        gf_table_init(&scale, gf_inv(gf_exp(x)));
+        region_mul(bytes[x], bytes[x], &scale, length, false);
+    }
+    else if (n_lost_data == 2)
+    {
+        // with Pxy and Qxy the syndromes of the two missing buffers,
+        //  Dx = (Qxy + g^y Pxy) / (g^x + g^y) and Dy = Pxy + Dx
+        const size_t x = lost_data[0], y = lost_data[1];
+        memcpy(bytes[y], p, length);
+        memcpy(bytes[x], q, length);
+        for (size_t i = 0; i < n_data; i++)
+        {
+            if (i == x || i == y)
+                continue;
+            region_xor(bytes[y], bytes[i], length);
+            region_mul(bytes[x], bytes[i], gf_exp_table(i), length, true);
+        }
+        region_mul(bytes[x], bytes[y], gf_exp_table(y), length, true);
+        gf_table_t table;
+        gf_table_init(&table, gf_inv(gf_exp(x) ^ gf_exp(y)));
+        region_mul(bytes[x], bytes[x], &table, length, false);
+        region_xor(bytes[y], bytes[x], length);
+    }
+
+    // lost parity is recomputed from the (now complete) data
+    if (p_lost || q_lost)
+    {
+        encode((const uint8_t *const *)bytes, n_data, p_lost ? p : NULL, q_lost ? q : NULL, length);
+    }
+    return true;
+}
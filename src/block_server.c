@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "block_server.h"
+
+// Most requests taken off a connection per read
+#define SERVER_BATCH 64
+
+typedef struct
+{
+    int fd;         // non-blocking
+    uint8_t *ring;  // slots * BLOCK_SIZE_BYTES, shared with the client
+    size_t ring_bytes;
+    size_t pending; // bytes of a partial request left at the front of input
+    uint8_t input[SERVER_BATCH * sizeof(block_server_request_t)];
+    // results the socket had no room for; no more requests are read until they are sent
+    size_t output_bytes;
+    size_t output_sent;
+    block_server_response_t output[SERVER_BATCH];
+} block_connection_t;
+
+struct block_server
+{
+    block_store_t *bs;
+    int listen_fd;
+    int stop_fd;  // eventfd, readable once block_server_stop is called
+    char *socket_path;
+    char *image_path;  // where BLOCK_SERVER_OP_SERIALIZE writes, NULL to refuse it
+    size_t slots;
+
+    block_connection_t **connections;
+    size_t n_connections;
+    size_t connection_room;
+};
+
+/// Sends as much of a connection's queued results as the socket takes
+/// \param connection The connection
+/// \return false if the socket failed
+static bool connection_flush(block_connection_t *const connection)
+{
+    const uint8_t *bytes = (const uint8_t *)connection->output;
+    while (connection->output_sent < connection->output_bytes)
+    {
+        ssize_t sent = send(connection->fd, bytes + connection->output_sent,
+                            connection->output_bytes - connection->output_sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (sent <= 0)
+            return false;
+        connection->output_sent += sent;
+    }
+    connection->output_bytes = 0;
+    connection->output_sent = 0;
+    return true;
+}
+
+/// Closes a connection and unmaps its ring
+/// \param connection The connection
+static void connection_close(block_connection_t *const connection)
+{
+    munmap(connection->ring, connection->ring_bytes);
+    close(connection->fd);
+    free(connection);
+}
+
+/// Sets up a newly accepted connection and sends it the hello and ring
+/// \param server The server
+/// \param fd The accepted socket
+/// \return false if the connection was refused (fd is closed either way on failure)
+static bool server_accept(block_server_t *const server, const int fd)
+{
+    const size_t ring_bytes = server->slots * BLOCK_SIZE_BYTES;
+    block_connection_t *connection = NULL;
+    int ring_fd = memfd_create("block_server_ring", MFD_CLOEXEC);
+    if (ring_fd == -1 || ftruncate(ring_fd, ring_bytes) != 0)
+        goto fail;
+    connection = (block_connection_t *)calloc(1, sizeof(block_connection_t));
+    if (connection == NULL)
+        goto fail;
+    connection->fd = fd;
+    connection->ring = (uint8_t *)mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (connection->ring == MAP_FAILED)
+        goto fail;
+    connection->ring_bytes = ring_bytes;
+
+    // the ring travels with the hello, the client maps it and we can drop our descriptor
+    block_server_hello_t hello = {BLOCK_SERVER_MAGIC, BLOCK_SERVER_VERSION, server->slots};
+    struct iovec iov = {&hello, sizeof(hello)};
+    union
+    {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &ring_fd, sizeof(int));
+    if (sendmsg(fd, &message, MSG_NOSIGNAL) != (ssize_t)sizeof(hello))
+    {
+        munmap(connection->ring, ring_bytes);
+        goto fail;
+    }
+    close(ring_fd);
+    ring_fd = -1;
+
+    if (server->n_connections == server->connection_room)
+    {
+        size_t room = server->connection_room ? server->connection_room * 2 : 8;
+        block_connection_t **grown = (block_connection_t **)realloc(server->connections, room * sizeof(block_connection_t *));
+        if (grown == NULL)
+        {
+            munmap(connection->ring, ring_bytes);
+            goto fail;
+        }
+        server->connections = grown;
+        server->connection_room = room;
+    }
+    server->connections[server->n_connections++] = connection;
+    return true;
+
+fail:
+    if (ring_fd != -1)
+        close(ring_fd);
+    free(connection);
+    close(fd);
+    return false;
+}
+
+/// Runs one request against the store
+/// \param server The server
+/// \param connection The connection it came in on, for its ring
+/// \param request The request
+/// \return What the store call returned
+static uint64_t server_execute(block_server_t *const server, block_connection_t *const connection,
+                               const block_server_request_t *const request)
+{
+    uint8_t *slot = request->slot < server->slots ? connection->ring + (size_t)request->slot * BLOCK_SIZE_BYTES : NULL;
+    switch ((block_server_op_t)request->op)
+    {
+    case BLOCK_SERVER_OP_ALLOCATE:
+        return block_store_allocate(server->bs);
+    case BLOCK_SERVER_OP_REQUEST:
+        return block_store_request(server->bs, request->block_id);
+    case BLOCK_SERVER_OP_RELEASE:
+        block_store_release(server->bs, request->block_id);
+        return true;
+    case BLOCK_SERVER_OP_READ:
+        return slot != NULL ? block_store_read(server->bs, request->block_id, slot) : 0;
+    case BLOCK_SERVER_OP_WRITE:
+        return slot != NULL ? block_store_write(server->bs, request->block_id, slot) : 0;
+    case BLOCK_SERVER_OP_USED:
+        return block_store_get_used_blocks(server->bs);
+    case BLOCK_SERVER_OP_FREE:
+        return block_store_get_free_blocks(server->bs);
+    case BLOCK_SERVER_OP_SERIALIZE:
+        // only ever to the image the server was given, never a path from the client
+        return server->image_path != NULL ? block_store_serialize(server->bs, server->image_path) : 0;
+    }
+    return 0;
+}
+
+/// Sends any queued results, then runs every whole request waiting on a connection
+///  and answers them in one send, queueing whatever the socket has no room for
+/// \param server The server
+/// \param connection The connection, readable or writable
+/// \return false once the connection is closed or broken
+static bool server_serve(block_server_t *const server, block_connection_t *const connection)
+{
+    if (!connection_flush(connection))
+        return false;
+    if (connection->output_bytes > 0)
+        return true;
+
+    ssize_t received = recv(connection->fd, connection->input + connection->pending,
+                            sizeof(connection->input) - connection->pending, 0);
+    if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+    if (received <= 0)
+        return false;
+    connection->pending += received;
+
+    const size_t count = connection->pending / sizeof(block_server_request_t);
+    for (size_t i = 0; i < count; i++)
+    {
+        block_server_request_t request;
+        memcpy(&request, connection->input + i * sizeof(request), sizeof(request));
+        connection->output[i].result = server_execute(server, connection, &request);
+    }
+    const size_t used = count * sizeof(block_server_request_t);
+    memmove(connection->input, connection->input + used, connection->pending - used);
+    connection->pending -= used;
+    connection->output_bytes = count * sizeof(block_server_response_t);
+    return connection_flush(connection);
+}
+
+block_server_t *block_server_create(block_store_t *const bs, const char *const socket_path, const char *const image_path,
+                                    const size_t slots)
+{
+    struct sockaddr_un address = {0};
+    if (bs == NULL || socket_path == NULL || strlen(socket_path) >= sizeof(address.sun_path) ||
+        slots > UINT32_MAX)
+    {
+        return NULL;
+    }
+    block_server_t *server = (block_server_t *)calloc(1, sizeof(block_server_t));
+    if (server == NULL)
+    {
+        return NULL;
+    }
+    server->bs = bs;
+    server->slots = slots ? slots : BLOCK_SERVER_DEFAULT_SLOTS;
+    server->socket_path = strdup(socket_path);
+    server->image_path = image_path != NULL ? strdup(image_path) : NULL;
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    unlink(socket_path);
+    if (server->socket_path == NULL || (image_path != NULL && server->image_path == NULL) || server->listen_fd == -1 ||
+        server->stop_fd == -1 || bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(server->listen_fd, SOMAXCONN) != 0)
+    {
+        block_server_destroy(server);
+        return NULL;
+    }
+    return server;
+}
+
+bool block_server_run(block_server_t *const server)
+{
+    if (server == NULL)
+    {
+        return false;
+    }
+    struct pollfd *fds = NULL;
+    bool success = true;
+    for (;;)
+    {
+        // the stop eventfd and the listener go first, then one entry per connection
+        struct pollfd *grown = (struct pollfd *)realloc(fds, (server->n_connections + 2) * sizeof(struct pollfd));
+        if (grown == NULL)
+        {
+            success = false;
+            break;
+        }
+        fds = grown;
+        fds[0] = (struct pollfd){server->stop_fd, POLLIN, 0};
+        fds[1] = (struct pollfd){server->listen_fd, POLLIN, 0};
+        const size_t n_polled = server->n_connections;
+        for (size_t i = 0; i < n_polled; i++)
+        {
+            // a connection with results queued waits for room to send them before reading more
+            const short events = server->connections[i]->output_bytes > 0 ? POLLOUT : POLLIN;
+            fds[i + 2] = (struct pollfd){server->connections[i]->fd, events, 0};
+        }
+
+        if (poll(fds, n_polled + 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            success = false;
+            break;
+        }
+        if (fds[0].revents)
+        {
+            uint64_t value;
+            if (read(server->stop_fd, &value, sizeof(value)) < 0)
+            {
+                // already drained, nothing to do
+            }
+            break;
+        }
+
+        // serve existing connections before accepting, so the polled entries still line up
+        for (size_t i = n_polled; i-- > 0;)
+        {
+            if (fds[i + 2].revents && !server_serve(server, server->connections[i]))
+            {
+                connection_close(server->connections[i]);
+                server->connections[i] = server->connections[--server->n_connections];
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            // never blocking on a connection, so one client that stops reading can't stall the others
+            int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd != -1)
+            {
+                server_accept(server, fd);
+            }
+        }
+    }
+    free(fds);
+    return success;
+}
+
+void block_server_stop(block_server_t *const server)
+{
+    if (server == NULL)
+    {
+        return;
+    }
+    // only async-signal-safe calls here
+    const uint64_t one = 1;
+    if (write(server->stop_fd, &one, sizeof(one)) < 0)
+    {
+        // the counter can't overflow from stops alone
+    }
+}
+
+void block_server_destroy(block_server_t *const server)
+{
+    if (server == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < server->n_connections; i++)
+    {
+        connection_close(server->connections[i]);
+    }
+    free(server->connections);
+    if (server->listen_fd != -1)
+    {
+        close(server->listen_fd);
+        if (server->socket_path != NULL)
+            unlink(server->socket_path);
+    }
+    if (server->stop_fd != -1)
+    {
+        close(server->stop_fd);
+    }
+    free(server->socket_path);
+    free(server->image_path);
+    free(server);
+}
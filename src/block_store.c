@@ -1,10 +1,24 @@
+#define _GNU_SOURCE  // fallocate, copy_file_range, SEEK_DATA/SEEK_HOLE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "bitmap.h"
+#include "buddy.h"
 #include "block_store.h"
 
 // include more if you need
@@ -14,206 +28,3173 @@
 
 #define UNUSED(x) (void)(x)
 
+// From linux/fs.h, which can't be included alongside block_store.h (both define BLOCK_SIZE_BITS)
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 typedef struct block
 {
-    unsigned char block[BLOCK_SIZE_BYTES];
-} block_t;
+    unsigned char block[BLOCK_SIZE_BYTES];
+} block_t;
+
+// Blocks are grouped into chunks so snapshots can share them copy-on-write.
+// 16 blocks of 256 bytes keeps a chunk at one 4KiB page.
+#define BLOCK_STORE_CHUNK_BLOCKS 16
+#define BLOCK_STORE_NUM_CHUNKS (BLOCK_STORE_NUM_BLOCKS / BLOCK_STORE_CHUNK_BLOCKS)
+#define BITMAP_CHUNK (BITMAP_START_BLOCK / BLOCK_STORE_CHUNK_BLOCKS)
+#define BLOCK_STORE_CHUNK_BYTES (BLOCK_STORE_CHUNK_BLOCKS * BLOCK_SIZE_BYTES)
+
+// The chunks of a new store share one page-aligned mapping, optionally backed
+// by huge pages and faulted in up front. Chunks copied on write later get
+// their own page-aligned allocation instead.
+#define HUGE_PAGE_BYTES (2u << 20)
+
+typedef struct block_arena
+{
+    // number of chunks still pointing into the mapping
+    atomic_size_t refcount;
+    void *base;
+    size_t length;
+} block_arena_t;
+
+// The header sits on its own cache line, away from the block data, so
+// refcount traffic from snapshots doesn't bounce lines readers are using.
+typedef struct block_chunk
+{
+    // number of stores (live or snapshot) pointing at this chunk
+    _Alignas(64) atomic_size_t refcount;
+    block_arena_t *arena;  // mapping holding the blocks, NULL if they were allocated on their own
+    block_t *blocks;
+    // per-block sequence counters for concurrent stores, odd while a write is in progress;
+    // on a line of their own so readers polling them share it with nothing that changes
+    _Alignas(64) atomic_uint seq[BLOCK_STORE_CHUNK_BLOCKS];
+} block_chunk_t;
+
+// A shared store's segment is its blocks followed by this header, holding
+// what the processes mapping it must agree on besides the bitmap.
+#define SHARED_MAGIC 0x4253534Du
+#define SHARED_HEADER_BYTES 4096u
+// How long a process attaching waits for the creator to finish setting up
+#define SHARED_ATTACH_TRIES 1000
+#define SHARED_ATTACH_WAIT_NS 1000000
+// Spins on an odd counter before a reader checks whether its writer died
+#define SHARED_READ_SPINS 4096
+
+typedef struct shared_header
+{
+    _Atomic uint32_t magic;      // set by the creator once everything else is ready
+    pthread_mutex_t write_lock;  // robust and process-shared, held by every writer
+    atomic_size_t used;          // the store's used count, for every process
+    _Alignas(64) atomic_uint seq[BLOCK_STORE_NUM_BLOCKS];
+} shared_header_t;
+
+_Static_assert(sizeof(shared_header_t) <= SHARED_HEADER_BYTES, "shared header outgrew its page");
+
+#ifdef BLOCK_STORE_STATS
+// Counters are striped so threads hitting the same store mostly touch their
+// own cache lines; each thread sticks to one stripe and reads merge them all.
+#define STATS_STRIPES 8
+
+typedef struct stats_counters
+{
+    _Atomic uint64_t calls;
+    _Atomic uint64_t failures;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t latency_ns[BLOCK_STORE_LATENCY_BUCKETS];
+} stats_counters_t;
+
+typedef struct stats_stripe
+{
+    _Alignas(64) stats_counters_t ops[BLOCK_STORE_OP_COUNT];
+} stats_stripe_t;
+#endif
+
+// Records are buffered and written out whenever the buffer fills up
+#define TRACE_BUFFER_RECORDS 4096
+
+typedef struct block_store_trace
+{
+    pthread_mutex_t lock;
+    int file;
+    uint64_t start_ns;
+    bool failed;
+    size_t count;
+    block_store_trace_record_t records[TRACE_BUFFER_RECORDS];
+} block_store_trace_t;
+
+typedef struct block_store
+{
+    bitmap_t *bitmap;
+    bool read_only;
+    bool concurrent;  // reads and writes of blocks go through the sequence counters
+    bool sparse;      // chunks are allocated on first write and dropped when all their blocks are free
+    shared_header_t *shared;  // header of the segment holding the blocks, NULL unless BLOCK_STORE_SHARED
+    atomic_size_t used;       // bits set in the bitmap, its own blocks included (in the header if shared)
+    block_store_policy_t policy;
+    buddy_t *buddy;  // free lists mirroring the bitmap, only under BLOCK_STORE_POLICY_BUDDY
+    size_t cursor;   // last block allocated, where next fit and near start looking
+    uint8_t advice[BLOCK_STORE_NUM_CHUNKS];  // block_store_advice_t given for each chunk
+    block_store_trace_t *trace;
+#ifdef BLOCK_STORE_STATS
+    stats_stripe_t *stats;
+#endif
+    block_chunk_t *chunks[BLOCK_STORE_NUM_CHUNKS];
+} block_store_t;
+
+static bool request_impl(block_store_t *const bs, const size_t block_id);
+
+/// Maps the block data for a new store
+/// \param flags BLOCK_STORE_ARENA_* flags
+/// \return The arena, holding one reference for the caller, NULL on error
+static block_arena_t *arena_create(const unsigned flags)
+{
+    block_arena_t *arena = (block_arena_t *)calloc(1, sizeof(block_arena_t));
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    atomic_init(&arena->refcount, 1);
+
+    const int populate = (flags & BLOCK_STORE_ARENA_PREFAULT) ? MAP_POPULATE : 0;
+    arena->base = MAP_FAILED;
+    if (flags & BLOCK_STORE_ARENA_HUGEPAGES)
+    {
+        // explicit huge pages come in whole pages and only if some are reserved
+        arena->length = (BLOCK_STORE_NUM_BYTES + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+        arena->base = mmap(NULL, arena->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    }
+    if (arena->base == MAP_FAILED)
+    {
+        arena->length = BLOCK_STORE_NUM_BYTES;
+        arena->base = mmap(NULL, arena->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+        if (arena->base == MAP_FAILED)
+        {
+            free(arena);
+            return NULL;
+        }
+        if (flags & BLOCK_STORE_ARENA_HUGEPAGES)
+        {
+            // otherwise ask for transparent huge pages, a hint the kernel may ignore
+            madvise(arena->base, arena->length, MADV_HUGEPAGE);
+        }
+    }
+    return arena;
+}
+
+/// Maps the blocks of a shared store, creating and zeroing the segment if it doesn't exist
+/// \param name The shm_open name
+/// \param flags BLOCK_STORE_ARENA_* flags, only PREFAULT applies
+/// \param header Receives the segment's header
+/// \return The arena, holding one reference for the caller, NULL on error
+static block_arena_t *arena_attach(const char *const name, const unsigned flags, shared_header_t **const header)
+{
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    block_arena_t *arena = (block_arena_t *)calloc(1, sizeof(block_arena_t));
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    atomic_init(&arena->refcount, 1);
+    arena->length = BLOCK_STORE_NUM_BYTES + SHARED_HEADER_BYTES;
+
+    bool creator = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1 && errno == EEXIST)
+    {
+        creator = false;
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    }
+    if (fd == -1 || (creator && ftruncate(fd, arena->length) != 0))
+    {
+        goto fail;
+    }
+
+    // the creator may not have sized the segment yet
+    struct stat info;
+    for (int tries = 0; fstat(fd, &info) == 0 && (size_t)info.st_size != arena->length && tries < SHARED_ATTACH_TRIES; tries++)
+    {
+        nanosleep(&(struct timespec){0, SHARED_ATTACH_WAIT_NS}, NULL);
+    }
+    if ((size_t)info.st_size != arena->length)
+    {
+        goto fail;
+    }
+    const int populate = (flags & BLOCK_STORE_ARENA_PREFAULT) ? MAP_POPULATE : 0;
+    arena->base = mmap(NULL, arena->length, PROT_READ | PROT_WRITE, MAP_SHARED | populate, fd, 0);
+    if (arena->base == MAP_FAILED)
+    {
+        goto fail;
+    }
+    close(fd);
+    fd = -1;
+    *header = (shared_header_t *)((uint8_t *)arena->base + BLOCK_STORE_NUM_BYTES);
+
+    if (creator)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&(*header)->write_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        // the bitmap's own block must be taken before anyone can allocate
+        uint8_t *bitmap_data = (uint8_t *)arena->base + BITMAP_START_BLOCK * BLOCK_SIZE_BYTES;
+        __atomic_fetch_or(&bitmap_data[BITMAP_START_BLOCK / 8], 1u << (BITMAP_START_BLOCK % 8), __ATOMIC_RELAXED);
+        atomic_init(&(*header)->used, REQUIRED_BITMAP_BLOCKS);
+        atomic_store_explicit(&(*header)->magic, SHARED_MAGIC, memory_order_release);
+    }
+    for (int tries = 0; atomic_load_explicit(&(*header)->magic, memory_order_acquire) != SHARED_MAGIC; tries++)
+    {
+        if (tries == SHARED_ATTACH_TRIES)
+        {
+            munmap(arena->base, arena->length);
+            goto fail;
+        }
+        nanosleep(&(struct timespec){0, SHARED_ATTACH_WAIT_NS}, NULL);
+    }
+    return arena;
+
+fail:
+    if (fd != -1)
+    {
+        // a segment we created but couldn't set up is of no use to anyone
+        if (creator)
+            shm_unlink(name);
+        close(fd);
+    }
+    free(arena);
+    return NULL;
+}
+
+/// Drops one reference to an arena, unmapping it with the last one
+/// \param arena The arena, may be NULL
+static void arena_put(block_arena_t *const arena)
+{
+    if (arena != NULL && atomic_fetch_sub(&arena->refcount, 1) == 1)
+    {
+        munmap(arena->base, arena->length);
+        free(arena);
+    }
+}
+
+/// Allocates a chunk owned by a single store
+/// \param arena Arena to take the blocks from, NULL to allocate them separately (uninitialized)
+/// \param chunk_id The chunk's place in the arena
+/// \return The new chunk, NULL on error
+static block_chunk_t *chunk_create(block_arena_t *const arena, const size_t chunk_id)
+{
+    block_chunk_t *chunk = (block_chunk_t *)aligned_alloc(_Alignof(block_chunk_t), sizeof(block_chunk_t));
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    atomic_init(&chunk->refcount, 1);
+    for (size_t block = 0; block < BLOCK_STORE_CHUNK_BLOCKS; block++)
+    {
+        atomic_init(&chunk->seq[block], 0);
+    }
+    chunk->arena = arena;
+    if (arena != NULL)
+    {
+        // fresh anonymous mappings are already zeroed
+        atomic_fetch_add(&arena->refcount, 1);
+        chunk->blocks = (block_t *)((uint8_t *)arena->base + chunk_id * BLOCK_STORE_CHUNK_BYTES);
+    }
+    else
+    {
+        chunk->blocks = (block_t *)aligned_alloc(BLOCK_STORE_CHUNK_BYTES, BLOCK_STORE_CHUNK_BYTES);
+        if (chunk->blocks == NULL)
+        {
+            free(chunk);
+            return NULL;
+        }
+    }
+    return chunk;
+}
+
+/// Drops one reference to a chunk, freeing it with the last one
+/// \param chunk The chunk, may be NULL
+static void chunk_put(block_chunk_t *const chunk)
+{
+    if (chunk != NULL && atomic_fetch_sub(&chunk->refcount, 1) == 1)
+    {
+        if (chunk->arena != NULL)
+        {
+            arena_put(chunk->arena);
+        }
+        else
+        {
+            free(chunk->blocks);
+        }
+        free(chunk);
+    }
+}
+
+/// Gives the store a private copy of a chunk before it is modified
+/// \param bs BS device
+/// \param chunk_id The chunk about to be written
+/// \return false if the copy could not be allocated
+static bool chunk_unshare(block_store_t *const bs, const size_t chunk_id)
+{
+    block_chunk_t *shared = bs->chunks[chunk_id];
+    if (shared != NULL && atomic_load(&shared->refcount) == 1)
+    {
+        return true;
+    }
+
+    // a sparse store gets its chunks on first write
+    block_chunk_t *copy = chunk_create(NULL, chunk_id);
+    if (copy == NULL)
+    {
+        return false;
+    }
+    if (shared != NULL)
+    {
+        memcpy(copy->blocks, shared->blocks, BLOCK_STORE_CHUNK_BYTES);
+    }
+    else
+    {
+        memset(copy->blocks, 0, BLOCK_STORE_CHUNK_BYTES);
+    }
+
+    // the bitmap overlays its chunk, so it has to follow the copy
+    if (chunk_id == BITMAP_CHUNK)
+    {
+        bitmap_t *bitmap = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, &copy->blocks[BITMAP_START_BLOCK % BLOCK_STORE_CHUNK_BLOCKS]);
+        if (bitmap == NULL)
+        {
+            chunk_put(copy);
+            return false;
+        }
+        bitmap_destroy(bs->bitmap);
+        bs->bitmap = bitmap;
+    }
+
+    // published for concurrent readers still looking the chunk up
+    __atomic_store_n(&bs->chunks[chunk_id], copy, __ATOMIC_RELEASE);
+    chunk_put(shared);
+    return true;
+}
+
+/// Drops a chunk of a sparse store once none of its blocks are in use
+/// \param bs BS device
+/// \param chunk_id The chunk
+static void chunk_trim(block_store_t *const bs, const size_t chunk_id)
+{
+    if (!bs->sparse || chunk_id == BITMAP_CHUNK || bs->chunks[chunk_id] == NULL ||
+        bitmap_ffs_from(bs->bitmap, chunk_id * BLOCK_STORE_CHUNK_BLOCKS) < (chunk_id + 1) * BLOCK_STORE_CHUNK_BLOCKS)
+    {
+        return;
+    }
+    chunk_put(bs->chunks[chunk_id]);
+    bs->chunks[chunk_id] = NULL;
+}
+
+// What the blocks of a chunk a sparse store never wrote read as
+static const block_t zero_chunk[BLOCK_STORE_CHUNK_BLOCKS];
+
+/// Looks up a block for reading
+///  The block and the rest of its chunk after it are contiguous
+/// \param bs BS device
+/// \param block_id The block
+/// \return Pointer to the block's data
+static const block_t *block_get(const block_store_t *const bs, const size_t block_id)
+{
+    const block_chunk_t *chunk = bs->chunks[block_id / BLOCK_STORE_CHUNK_BLOCKS];
+    return &(chunk != NULL ? chunk->blocks : zero_chunk)[block_id % BLOCK_STORE_CHUNK_BLOCKS];
+}
+
+/// Looks up a block for writing, copying its chunk first if it is shared
+/// \param bs BS device
+/// \param block_id The block
+/// \return Pointer to the block's data, NULL on error
+static block_t *block_get_mut(block_store_t *const bs, const size_t block_id)
+{
+    if (!chunk_unshare(bs, block_id / BLOCK_STORE_CHUNK_BLOCKS))
+    {
+        return NULL;
+    }
+    return &bs->chunks[block_id / BLOCK_STORE_CHUNK_BLOCKS]->blocks[block_id % BLOCK_STORE_CHUNK_BLOCKS];
+}
+
+/// Checks that the store may modify its bitmap, unsharing the bitmap chunk
+/// \param bs BS device
+/// \return true if the bitmap can be written
+static bool bitmap_writable(block_store_t *const bs)
+{
+    // other processes change a shared bitmap too, only the atomic paths may touch it
+    return !bs->read_only && bs->shared == NULL && chunk_unshare(bs, BITMAP_CHUNK);
+}
+
+/// Checks whether a block holds the bitmap
+/// \param block_id The block
+/// \return true for the bitmap's own blocks
+static bool is_bitmap_block(const size_t block_id)
+{
+    return block_id >= BITMAP_START_BLOCK && block_id < BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS;
+}
+
+/// Adjusts the count of blocks in use after bits were set or cleared
+///  Only one thread changes the bitmap of a private store at a time, so a plain
+///  load and store do; a shared store's count takes an atomic add.
+/// \param bs BS device
+/// \param delta Bits newly set, negative for bits cleared
+static void used_add(block_store_t *const bs, const ptrdiff_t delta)
+{
+    if (bs->shared != NULL)
+    {
+        atomic_fetch_add_explicit(&bs->shared->used, (size_t)delta, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_store_explicit(&bs->used, atomic_load_explicit(&bs->used, memory_order_relaxed) + (size_t)delta, memory_order_relaxed);
+    }
+}
+
+/// Counts the bits set in the bitmap from scratch, the slow way
+/// \param bs BS device
+/// \param first First block
+/// \param count Number of blocks
+/// \return Blocks in use in the range
+static size_t used_in_range(const block_store_t *const bs, const size_t first, const size_t count)
+{
+    size_t used = 0;
+    for (size_t block_id = bitmap_ffs_from(bs->bitmap, first); block_id < first + count; block_id = bitmap_ffs_from(bs->bitmap, block_id + 1))
+    {
+        used++;
+    }
+    return used;
+}
+
+/// Resets the count of blocks in use to what the bitmap says, after it was replaced wholesale
+/// \param bs BS device
+static void used_recount(block_store_t *const bs)
+{
+    atomic_store_explicit(bs->shared != NULL ? &bs->shared->used : &bs->used, bitmap_total_set(bs->bitmap), memory_order_relaxed);
+}
+
+static uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+#ifdef BLOCK_STORE_STATS
+
+// stripe picked by this thread, handed out round robin on first use
+static _Thread_local unsigned stats_stripe_id = UINT32_MAX;
+static atomic_uint stats_next_stripe;
+
+static stats_stripe_t *stats_create()
+{
+    stats_stripe_t *stats = (stats_stripe_t *)aligned_alloc(_Alignof(stats_stripe_t), STATS_STRIPES * sizeof(stats_stripe_t));
+    if (stats != NULL)
+    {
+        memset(stats, 0, STATS_STRIPES * sizeof(stats_stripe_t));
+    }
+    return stats;
+}
+
+// Counters for calls that have no store to record into, such as a deserialize that fails
+static stats_stripe_t process_stats[STATS_STRIPES];
+
+/// Adds one call to the calling thread's stripe of a set of counters
+/// \param stats The striped counters
+/// \param op The operation
+/// \param start monotonic_ns() when the call began
+/// \param success Whether the call succeeded
+/// \param bytes Bytes moved by the call
+static void stats_add(stats_stripe_t *const stats, const block_store_op_t op, const uint64_t start, const bool success, const size_t bytes)
+{
+    if (stats_stripe_id == UINT32_MAX)
+    {
+        stats_stripe_id = atomic_fetch_add(&stats_next_stripe, 1) % STATS_STRIPES;
+    }
+
+    // bucket i holds latencies in [2^i, 2^(i+1)) ns
+    const uint64_t elapsed = monotonic_ns() - start;
+    unsigned bucket = 63 - __builtin_clzll(elapsed | 1);
+    if (bucket >= BLOCK_STORE_LATENCY_BUCKETS)
+    {
+        bucket = BLOCK_STORE_LATENCY_BUCKETS - 1;
+    }
+
+    stats_counters_t *counters = &stats[stats_stripe_id].ops[op];
+    atomic_fetch_add_explicit(&counters->calls, 1, memory_order_relaxed);
+    if (!success)
+    {
+        atomic_fetch_add_explicit(&counters->failures, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&counters->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->latency_ns[bucket], 1, memory_order_relaxed);
+}
+
+/// Adds one call to the store's counters
+/// \param bs BS device, nothing is recorded if NULL
+/// \param op The operation
+/// \param start monotonic_ns() when the call began
+/// \param success Whether the call succeeded
+/// \param bytes Bytes moved by the call
+static void stats_record(const block_store_t *const bs, const block_store_op_t op, const uint64_t start, const bool success, const size_t bytes)
+{
+    if (bs != NULL && bs->stats != NULL)
+    {
+        stats_add(bs->stats, op, start, success, bytes);
+    }
+}
+
+/// Sums striped counters into totals
+/// \param stats The striped counters
+/// \param totals Filled in with the totals over all stripes
+static void stats_collect(stats_stripe_t *const stats, block_store_stats_t *const totals)
+{
+    memset(totals, 0, sizeof(*totals));
+    for (size_t stripe = 0; stripe < STATS_STRIPES; stripe++)
+    {
+        for (size_t op = 0; op < BLOCK_STORE_OP_COUNT; op++)
+        {
+            stats_counters_t *counters = &stats[stripe].ops[op];
+            totals->ops[op].calls += atomic_load_explicit(&counters->calls, memory_order_relaxed);
+            totals->ops[op].failures += atomic_load_explicit(&counters->failures, memory_order_relaxed);
+            totals->ops[op].bytes += atomic_load_explicit(&counters->bytes, memory_order_relaxed);
+            for (size_t bucket = 0; bucket < BLOCK_STORE_LATENCY_BUCKETS; bucket++)
+            {
+                totals->ops[op].latency_ns[bucket] += atomic_load_explicit(&counters->latency_ns[bucket], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+/// Zeroes striped counters
+/// \param stats The striped counters
+static void stats_clear(stats_stripe_t *const stats)
+{
+    for (size_t stripe = 0; stripe < STATS_STRIPES; stripe++)
+    {
+        for (size_t op = 0; op < BLOCK_STORE_OP_COUNT; op++)
+        {
+            stats_counters_t *counters = &stats[stripe].ops[op];
+            atomic_store_explicit(&counters->calls, 0, memory_order_relaxed);
+            atomic_store_explicit(&counters->failures, 0, memory_order_relaxed);
+            atomic_store_explicit(&counters->bytes, 0, memory_order_relaxed);
+            for (size_t bucket = 0; bucket < BLOCK_STORE_LATENCY_BUCKETS; bucket++)
+            {
+                atomic_store_explicit(&counters->latency_ns[bucket], 0, memory_order_relaxed);
+            }
+        }
+    }
+}
+
+#define STATS_BEGIN(timer) const uint64_t timer = monotonic_ns()
+#define STATS_END(timer, bs, op, success, bytes) stats_record((bs), (op), (timer), (success), (bytes))
+#define STATS_END_PROCESS(timer, op, success, bytes) stats_add(process_stats, (op), (timer), (success), (bytes))
+#else
+#define STATS_BEGIN(timer)
+#define STATS_END(timer, bs, op, success, bytes) UNUSED(success)
+#define STATS_END_PROCESS(timer, op, success, bytes) UNUSED(success)
+#endif
+
+/// Writes out the buffered trace records, the trace lock must be held
+/// \param trace The trace
+static void trace_flush(block_store_trace_t *const trace)
+{
+    const uint8_t *data = (const uint8_t *)trace->records;
+    size_t length = trace->count * sizeof(block_store_trace_record_t);
+    while (length > 0 && !trace->failed)
+    {
+        ssize_t result = write(trace->file, data, length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            trace->failed = true;
+        else
+        {
+            data += result;
+            length -= result;
+        }
+    }
+    trace->count = 0;
+}
+
+/// Appends one call to the store's trace
+/// \param bs BS device with tracing on
+/// \param op The operation
+/// \param block_id The block the call named, or the one allocate returned
+/// \param success Whether the call succeeded
+static void trace_record(const block_store_t *const bs, const block_store_op_t op, const size_t block_id, const bool success)
+{
+    block_store_trace_t *trace = bs->trace;
+    const uint64_t now = monotonic_ns();
+
+    pthread_mutex_lock(&trace->lock);
+    block_store_trace_record_t *record = &trace->records[trace->count++];
+    record->timestamp_ns = now - trace->start_ns;
+    record->block_id = block_id;
+    record->thread_id = (uint32_t)syscall(SYS_gettid);
+    record->op = op;
+    record->success = success;
+    record->reserved = 0;
+    if (trace->count == TRACE_BUFFER_RECORDS)
+    {
+        trace_flush(trace);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+#define TRACE(bs, op, block_id, success)                  \
+    do                                                     \
+    {                                                      \
+        if ((bs) != NULL && (bs)->trace != NULL)           \
+            trace_record((bs), (op), (block_id), (success)); \
+    } while (0)
+
+bool block_store_unlink_shared(const char *const shm_name)
+{
+    return shm_name != NULL && shm_unlink(shm_name) == 0;
+}
+
+/// This creates a new BS device, ready to go
+/// \return Pointer to a new block storage device, NULL on error
+block_store_t *block_store_create()
+{
+    return block_store_create_ex(NULL);
+}
+
+static block_store_t *create_impl(const block_store_config_t *const config, const char *const shm_name);
+
+/// Creates a new BS device with its block data laid out as configured
+/// \param config Creation options, NULL for the defaults
+/// \return Pointer to a new block storage device, NULL on error
+block_store_t *block_store_create_ex(const block_store_config_t *const config)
+{
+    return create_impl(config, NULL);
+}
+
+/// Creates a BS device on a shared memory segment, or attaches to the one already there
+/// \param shm_name The segment's shm_open name
+/// \param config Creation options, NULL for the defaults
+/// \return Pointer to a new block storage device, NULL on error
+block_store_t *block_store_create_shared(const char *const shm_name, const block_store_config_t *const config)
+{
+    return shm_name != NULL ? create_impl(config, shm_name) : NULL;
+}
+
+/// Sets up a new BS device
+/// \param config Creation options, NULL for the defaults
+/// \param shm_name Segment to keep the blocks in, NULL for private memory
+/// \return Pointer to a new block storage device, NULL on error
+static block_store_t *create_impl(const block_store_config_t *const config, const char *const shm_name)
+{
+    // calloc
+    block_store_t *bs = (block_store_t *)calloc(1, sizeof(block_store_t));
+
+    // checks that the malloc was successful
+    if (bs == NULL)
+    {
+        return NULL;
+    }
+
+#ifdef BLOCK_STORE_STATS
+    bs->stats = stats_create();
+    if (bs->stats == NULL)
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
+#endif
+
+    const unsigned flags = config != NULL ? config->flags : 0;
+    const bool shared = shm_name != NULL;
+    bs->concurrent = (flags & BLOCK_STORE_CONCURRENT) || shared;
+    bs->sparse = flags & BLOCK_STORE_SPARSE;
+    // freeing chunks on release would pull them out from under optimistic readers
+    if (bs->concurrent && bs->sparse)
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    if (bs->sparse)
+    {
+        // only the chunk holding the bitmap exists up front
+        if (!chunk_unshare(bs, BITMAP_CHUNK))
+        {
+            block_store_destroy(bs);
+            return NULL;
+        }
+    }
+    else
+    {
+        // every block starts out in a chunk owned only by this store, all in one arena
+        block_arena_t *arena = shared ? arena_attach(shm_name, flags, &bs->shared) : arena_create(flags);
+        if (arena == NULL)
+        {
+            block_store_destroy(bs);
+            return NULL;
+        }
+        for (size_t chunk_id = 0; chunk_id < BLOCK_STORE_NUM_CHUNKS; chunk_id++)
+        {
+            bs->chunks[chunk_id] = chunk_create(arena, chunk_id);
+            if (bs->chunks[chunk_id] == NULL)
+            {
+                arena_put(arena);
+                block_store_destroy(bs);
+                return NULL;
+            }
+        }
+        arena_put(arena);
+    }
+
+    // create the bitmap (unsharing the sparse bitmap chunk already did)
+    if (bs->bitmap == NULL)
+        bs->bitmap = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, &bs->chunks[BITMAP_CHUNK]->blocks[BITMAP_START_BLOCK % BLOCK_STORE_CHUNK_BLOCKS]);
+
+    // check for null bitmap
+    if (bs->bitmap == NULL)
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    // loop through the bitmap and attempt to allocate the block id
+    uint32_t bitmap_index;
+    for (bitmap_index = BITMAP_START_BLOCK; bitmap_index < BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS; bitmap_index++)
+    {
+        if (!request_impl(bs, bitmap_index))
+            break;
+    }
+
+    return bs;
+}
+
+/// Destroys the provided block storage device
+/// This is an idempotent operation, so there is no return value
+/// \param bs BS device
+void block_store_destroy(block_store_t *const bs)
+{
+    // check that block store exists
+    if (bs != NULL)
+    {
+        // finish any trace in progress
+        block_store_trace_stop(bs);
+        // destruct and destroy bitmap
+        bitmap_destroy(bs->bitmap);
+        buddy_destroy(bs->buddy);
+        // drop this store's reference to each chunk
+        for (size_t chunk_id = 0; chunk_id < BLOCK_STORE_NUM_CHUNKS; chunk_id++)
+        {
+            chunk_put(bs->chunks[chunk_id]);
+        }
+#ifdef BLOCK_STORE_STATS
+        free(bs->stats);
+#endif
+        // unallocate the block store memory
+        free(bs);
+    }
+}
+
+/// Finds the free block nearest to a hint, preferring the one after it on a tie
+/// \param bs BS device
+/// \param hint The block id to search outward from
+/// \return Free block's id, SIZE_MAX if the store is full
+static size_t find_near(const block_store_t *const bs, size_t hint)
+{
+    if (hint > BLOCK_STORE_AVAIL_BLOCKS)
+    {
+        hint = BLOCK_STORE_AVAIL_BLOCKS;
+    }
+    const size_t after = bitmap_ffz_from(bs->bitmap, hint);
+    const size_t before = hint ? bitmap_flz_from(bs->bitmap, hint - 1) : SIZE_MAX;
+    if (before == SIZE_MAX || (after != SIZE_MAX && after - hint <= hint - before))
+    {
+        return after;
+    }
+    return before;
+}
+
+/// Finds a free block in the smallest run of free blocks
+/// \param bs BS device
+/// \return Free block's id, SIZE_MAX if the store is full
+static size_t find_best(const block_store_t *const bs)
+{
+    size_t best = SIZE_MAX;
+    size_t best_length = SIZE_MAX;
+    size_t run = bitmap_ffz(bs->bitmap);
+    while (run != SIZE_MAX && best_length > 1)
+    {
+        size_t end = bitmap_ffs_from(bs->bitmap, run);
+        if (end == SIZE_MAX)
+        {
+            end = BLOCK_STORE_NUM_BLOCKS;
+        }
+        if (end - run < best_length)
+        {
+            best = run;
+            best_length = end - run;
+        }
+        run = bitmap_ffz_from(bs->bitmap, end);
+    }
+    return best;
+}
+
+/// Picks the free block the store's policy would hand out next
+/// \param bs BS device
+/// \return Free block's id, SIZE_MAX if the store is full
+static size_t find_free(block_store_t *const bs)
+{
+    size_t block_id;
+    switch (bs->policy)
+    {
+    case BLOCK_STORE_POLICY_BUDDY:
+        // this takes the block off the free lists too
+        return buddy_alloc(bs->buddy, 0);
+    case BLOCK_STORE_POLICY_NEXT_FIT:
+        block_id = bitmap_ffz_from(bs->bitmap, bs->cursor + 1);
+        return block_id != SIZE_MAX ? block_id : bitmap_ffz(bs->bitmap);
+    case BLOCK_STORE_POLICY_BEST_FIT:
+        return find_best(bs);
+    case BLOCK_STORE_POLICY_NEAR:
+        return find_near(bs, bs->cursor);
+    default:
+        return bitmap_ffz(bs->bitmap);
+    }
+}
+
+/// Marks a block of a shared store as in use, atomically
+/// \param bs BS device, shared
+/// \param block_id The block
+/// \return false if it already was
+static bool shared_claim(block_store_t *const bs, const size_t block_id)
+{
+    uint8_t *data = (uint8_t *)block_get(bs, BITMAP_START_BLOCK);
+    const uint8_t bit = 1u << (block_id % 8);
+    if (__atomic_fetch_or(&data[block_id / 8], bit, __ATOMIC_ACQ_REL) & bit)
+    {
+        return false;
+    }
+    used_add(bs, 1);
+    return true;
+}
+
+/// Marks a block of a shared store as free, atomically
+/// \param bs BS device, shared
+/// \param block_id The block
+static void shared_release(block_store_t *const bs, const size_t block_id)
+{
+    uint8_t *data = (uint8_t *)block_get(bs, BITMAP_START_BLOCK);
+    const uint8_t bit = 1u << (block_id % 8);
+    if (__atomic_fetch_and(&data[block_id / 8], (uint8_t)~bit, __ATOMIC_ACQ_REL) & bit)
+    {
+        used_add(bs, -1);
+    }
+}
+
+/// Takes the lowest free block of a shared store, racing other processes for it
+/// \param bs BS device, shared
+/// \return Allocated block's id, SIZE_MAX if the store is full
+static size_t shared_allocate(block_store_t *const bs)
+{
+    uint8_t *data = (uint8_t *)block_get(bs, BITMAP_START_BLOCK);
+    for (size_t byte = 0; byte < BITMAP_SIZE_BYTES; byte++)
+    {
+        uint8_t bits = __atomic_load_n(&data[byte], __ATOMIC_RELAXED);
+        while (bits != 0xFF)
+        {
+            const unsigned bit = (unsigned)__builtin_ctz(~bits & 0xFFu);
+            // a failed exchange reloads bits, so this retries against the latest byte
+            if (__atomic_compare_exchange_n(&data[byte], &bits, (uint8_t)(bits | (1u << bit)), true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            {
+                used_add(bs, 1);
+                return byte * 8 + bit;
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+/// Searches for a free block, marks it as in use, and returns the block's id
+/// \param bs BS device
+/// \return Allocated block's id, SIZE_MAX on error
+static size_t allocate_impl(block_store_t *const bs)
+{
+    if (bs != NULL && bs->shared != NULL)
+    {
+        return bs->read_only ? SIZE_MAX : shared_allocate(bs);
+    }
+
+    // check for valid parameters
+    if (bs == NULL || bs->bitmap == NULL || !bitmap_writable(bs))
+    {
+        return SIZE_MAX;
+    }
+
+    // find a zero bit address in the bitmap, as the policy likes it
+    STATS_BEGIN(scan);
+    size_t block_id = find_free(bs);
+    STATS_END(scan, bs, BLOCK_STORE_OP_FFZ, block_id != SIZE_MAX, 0);
+
+    // check for out of bounds block id
+    if (block_id > (BLOCK_STORE_AVAIL_BLOCKS) || block_id == SIZE_MAX)
+    {
+        return SIZE_MAX;
+    }
+
+    // set the requested bit
+    bitmap_set(bs->bitmap, block_id);
+    used_add(bs, 1);
+    bs->cursor = block_id;
+    // return the allocated block's id
+    return block_id;
+}
+
+size_t block_store_allocate(block_store_t *const bs)
+{
+    STATS_BEGIN(start);
+    size_t block_id = allocate_impl(bs);
+    STATS_END(start, bs, BLOCK_STORE_OP_ALLOCATE, block_id != SIZE_MAX, 0);
+    TRACE(bs, BLOCK_STORE_OP_ALLOCATE, block_id, block_id != SIZE_MAX);
+    return block_id;
+}
+
+/// Allocates the free block nearest to a hint
+/// \param bs BS device
+/// \param hint Block id to allocate near
+/// \return Allocated block's id, SIZE_MAX on error
+static size_t allocate_near_impl(block_store_t *const bs, const size_t hint)
+{
+    // check for valid parameters
+    if (bs == NULL || bs->bitmap == NULL || !bitmap_writable(bs))
+    {
+        return SIZE_MAX;
+    }
+
+    STATS_BEGIN(scan);
+    size_t block_id = find_near(bs, hint);
+    STATS_END(scan, bs, BLOCK_STORE_OP_FFZ, block_id != SIZE_MAX, 0);
+    if (block_id == SIZE_MAX)
+    {
+        return SIZE_MAX;
+    }
+
+    // set the requested bit
+    bitmap_set(bs->bitmap, block_id);
+    used_add(bs, 1);
+    if (bs->buddy)
+    {
+        buddy_claim(bs->buddy, block_id);
+    }
+    bs->cursor = block_id;
+    return block_id;
+}
+
+size_t block_store_allocate_near(block_store_t *const bs, const size_t hint)
+{
+    STATS_BEGIN(start);
+    size_t block_id = allocate_near_impl(bs, hint);
+    STATS_END(start, bs, BLOCK_STORE_OP_ALLOCATE, block_id != SIZE_MAX, 0);
+    TRACE(bs, BLOCK_STORE_OP_ALLOCATE, block_id, block_id != SIZE_MAX);
+    return block_id;
+}
+
+/// Allocates up to n blocks in one pass over the bitmap
+/// \param bs BS device
+/// \param n Number of blocks wanted
+/// \param ids Receives the allocated ids
+/// \param all_or_nothing If set, allocate nothing unless all n blocks are free
+/// \return Number of blocks allocated, 0 on error
+static size_t allocate_n_impl(block_store_t *const bs, const size_t n, size_t *const ids, const bool all_or_nothing)
+{
+    // check for valid parameters
+    if (bs == NULL || bs->bitmap == NULL || ids == NULL || n == 0 || !bitmap_writable(bs))
+    {
+        return 0;
+    }
+
+    // collect the ids first so an all or nothing request can back out for free
+    size_t count = 0;
+    size_t block_id = bitmap_ffz(bs->bitmap);
+    while (count < n && block_id != SIZE_MAX && block_id <= BLOCK_STORE_AVAIL_BLOCKS)
+    {
+        ids[count++] = block_id;
+        block_id = bitmap_ffz_from(bs->bitmap, block_id + 1);
+    }
+    if (count < n && all_or_nothing)
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        bitmap_set(bs->bitmap, ids[i]);
+        if (bs->buddy)
+        {
+            buddy_claim(bs->buddy, ids[i]);
+        }
+    }
+    used_add(bs, (ptrdiff_t)count);
+    if (count > 0)
+    {
+        bs->cursor = ids[count - 1];
+    }
+    return count;
+}
+
+size_t block_store_allocate_n(block_store_t *const bs, const size_t n, size_t *const ids, const bool all_or_nothing)
+{
+    STATS_BEGIN(start);
+    size_t count = allocate_n_impl(bs, n, ids, all_or_nothing);
+    STATS_END(start, bs, BLOCK_STORE_OP_ALLOCATE, count != 0, 0);
+    // traced block by block so a replay allocates the same number
+    for (size_t i = 0; i < count; i++)
+    {
+        TRACE(bs, BLOCK_STORE_OP_ALLOCATE, ids[i], true);
+    }
+    return count;
+}
+
+/// Attempts to allocate the requested block id
+/// \param bs the block store object
+/// \param block_id the requested block identifier
+/// \return boolean indicating succes of operation
+static bool request_impl(block_store_t *const bs, const size_t block_id)
+{
+    if (bs != NULL && bs->shared != NULL)
+    {
+        return !bs->read_only && block_id <= BLOCK_STORE_AVAIL_BLOCKS && shared_claim(bs, block_id);
+    }
+
+    // check for invalid parameters
+    if (bs == NULL || bs->bitmap == NULL || block_id > (BLOCK_STORE_AVAIL_BLOCKS) || bitmap_test(bs->bitmap, block_id) || !bitmap_writable(bs))
+    {
+        return false;
+    }
+
+    // set the requested bit
+    bitmap_set(bs->bitmap, block_id);
+    used_add(bs, 1);
+    if (bs->buddy)
+    {
+        buddy_claim(bs->buddy, block_id);
+    }
+    return true;
+}
+
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+    STATS_BEGIN(start);
+    bool success = request_impl(bs, block_id);
+    STATS_END(start, bs, BLOCK_STORE_OP_REQUEST, success, 0);
+    TRACE(bs, BLOCK_STORE_OP_REQUEST, block_id, success);
+    return success;
+}
+
+/// Frees the specified block
+/// \param bs BS device
+/// \param block_id The block to free
+/// \return false if the request was invalid
+static bool release_impl(block_store_t *const bs, const size_t block_id)
+{
+    if (bs != NULL && bs->shared != NULL)
+    {
+        if (bs->read_only || block_id > BLOCK_STORE_AVAIL_BLOCKS)
+        {
+            return false;
+        }
+        shared_release(bs, block_id);
+        return true;
+    }
+
+    // check for invalid parameters
+    if (bs == NULL || block_id > (BLOCK_STORE_AVAIL_BLOCKS) || !bitmap_writable(bs))
+    {
+        return false;
+    }
+
+    // clear the requested bit, returning it to the buddy lists only if it was in use
+    if (bitmap_test(bs->bitmap, block_id))
+    {
+        used_add(bs, -1);
+        if (bs->buddy)
+        {
+            buddy_free(bs->buddy, block_id, 0);
+        }
+    }
+    bitmap_reset(bs->bitmap, block_id);
+    chunk_trim(bs, block_id / BLOCK_STORE_CHUNK_BLOCKS);
+    return true;
+}
+
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+    STATS_BEGIN(start);
+    bool success = release_impl(bs, block_id);
+    STATS_END(start, bs, BLOCK_STORE_OP_RELEASE, success, 0);
+    TRACE(bs, BLOCK_STORE_OP_RELEASE, block_id, success);
+}
+
+/// Zeroes memory, bypassing the cache for whole chunks that won't be read back soon
+/// \param data Where to start, 16-byte aligned
+/// \param length Number of bytes, a multiple of the block size
+static void zero_blocks(void *const data, const size_t length)
+{
+#ifdef __SSE2__
+    if (length >= BLOCK_STORE_CHUNK_BYTES)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        for (__m128i *out = (__m128i *)data; out < (__m128i *)((uint8_t *)data + length); out++)
+        {
+            _mm_stream_si128(out, zero);
+        }
+        _mm_sfence();
+        return;
+    }
+#endif
+    memset(data, 0, length);
+}
+
+/// Zeroes or discards freed blocks, one chunk at a time
+/// \param bs BS device
+/// \param first First block, none of them the bitmap block
+/// \param count Number of blocks
+/// \param flags BLOCK_STORE_RELEASE_* flags
+/// \return false if a shared chunk could not be copied
+static bool scrub_blocks(block_store_t *const bs, size_t first, size_t count, const unsigned flags)
+{
+    while (count > 0)
+    {
+        const size_t chunk_id = first / BLOCK_STORE_CHUNK_BLOCKS;
+        const size_t within = first % BLOCK_STORE_CHUNK_BLOCKS;
+        const size_t piece = count < BLOCK_STORE_CHUNK_BLOCKS - within ? count : BLOCK_STORE_CHUNK_BLOCKS - within;
+        block_chunk_t *chunk = bs->chunks[chunk_id];
+
+        // a chunk a sparse store never allocated is zero already
+        if (chunk == NULL)
+        {
+            first += piece;
+            count -= piece;
+            continue;
+        }
+
+        // a whole page of the arena nobody else sees can simply be dropped
+        if ((flags & BLOCK_STORE_RELEASE_DISCARD) && piece == BLOCK_STORE_CHUNK_BLOCKS && chunk->arena != NULL &&
+            atomic_load(&chunk->refcount) == 1 && sysconf(_SC_PAGESIZE) == BLOCK_STORE_CHUNK_BYTES &&
+            madvise(chunk->blocks, BLOCK_STORE_CHUNK_BYTES, MADV_DONTNEED) == 0)
+        {
+            first += piece;
+            count -= piece;
+            continue;
+        }
+
+        block_t *block = block_get_mut(bs, first);
+        if (block == NULL)
+        {
+            return false;
+        }
+        zero_blocks(block, piece * BLOCK_SIZE_BYTES);
+        first += piece;
+        count -= piece;
+    }
+    return true;
+}
+
+/// Frees a run of blocks other than the bitmap block
+/// \param bs BS device, bitmap writable
+/// \param first First block
+/// \param count Number of blocks
+/// \param flags BLOCK_STORE_RELEASE_* flags
+/// \return false if zeroing failed
+static bool release_run(block_store_t *const bs, const size_t first, const size_t count, const unsigned flags)
+{
+    if (bs->buddy)
+    {
+        for (size_t block_id = first; block_id < first + count; block_id++)
+        {
+            if (bitmap_test(bs->bitmap, block_id))
+            {
+                buddy_free(bs->buddy, block_id, 0);
+            }
+        }
+    }
+    used_add(bs, -(ptrdiff_t)used_in_range(bs, first, count));
+    bitmap_reset_range(bs->bitmap, first, count);
+    for (size_t chunk_id = first / BLOCK_STORE_CHUNK_BLOCKS; chunk_id <= (first + count - 1) / BLOCK_STORE_CHUNK_BLOCKS; chunk_id++)
+    {
+        chunk_trim(bs, chunk_id);
+    }
+    return !(flags & (BLOCK_STORE_RELEASE_ZERO | BLOCK_STORE_RELEASE_DISCARD)) || scrub_blocks(bs, first, count, flags);
+}
+
+/// Frees count blocks starting at first, skipping the bitmap block
+/// \param bs BS device
+/// \param first First block to free
+/// \param count Number of blocks
+/// \param flags BLOCK_STORE_RELEASE_* flags
+/// \return false if the request was invalid
+static bool release_range_impl(block_store_t *const bs, const size_t first, const size_t count, const unsigned flags)
+{
+    // check for invalid parameters
+    if (bs == NULL || bs->bitmap == NULL || first >= BLOCK_STORE_NUM_BLOCKS || count > BLOCK_STORE_NUM_BLOCKS - first ||
+        !bitmap_writable(bs))
+    {
+        return false;
+    }
+
+    // split around the bitmap block
+    const size_t end = first + count;
+    const size_t bitmap_end = BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS;
+    bool success = true;
+    if (first < BITMAP_START_BLOCK)
+    {
+        const size_t stop = end < BITMAP_START_BLOCK ? end : BITMAP_START_BLOCK;
+        success = release_run(bs, first, stop - first, flags);
+    }
+    if (end > bitmap_end)
+    {
+        const size_t start = first > bitmap_end ? first : bitmap_end;
+        success = release_run(bs, start, end - start, flags) && success;
+    }
+    return success;
+}
+
+bool block_store_release_range(block_store_t *const bs, const size_t first, const size_t count, const unsigned flags)
+{
+    STATS_BEGIN(start);
+    bool success = release_range_impl(bs, first, count, flags);
+    STATS_END(start, bs, BLOCK_STORE_OP_RELEASE, success, 0);
+    // the bitmap block was skipped, a replay must not release it either
+    if (success)
+    {
+        for (size_t block_id = first; block_id < first + count; block_id++)
+        {
+            if (!is_bitmap_block(block_id))
+            {
+                TRACE(bs, BLOCK_STORE_OP_RELEASE, block_id, true);
+            }
+        }
+    }
+    return success;
+}
+
+/// Frees a list of blocks, skipping the bitmap block
+/// \param bs BS device
+/// \param ids The blocks to free
+/// \param n Number of ids
+/// \param flags BLOCK_STORE_RELEASE_* flags
+/// \return false if the request was invalid
+static bool release_list_impl(block_store_t *const bs, const size_t *const ids, const size_t n, const unsigned flags)
+{
+    // check for invalid parameters
+    if (bs == NULL || bs->bitmap == NULL || (ids == NULL && n > 0))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ids[i] > BLOCK_STORE_AVAIL_BLOCKS)
+        {
+            return false;
+        }
+    }
+    if (!bitmap_writable(bs))
+    {
+        return false;
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!is_bitmap_block(ids[i]))
+        {
+            success = release_run(bs, ids[i], 1, flags) && success;
+        }
+    }
+    return success;
+}
+
+bool block_store_release_list(block_store_t *const bs, const size_t *const ids, const size_t n, const unsigned flags)
+{
+    STATS_BEGIN(start);
+    bool success = release_list_impl(bs, ids, n, flags);
+    STATS_END(start, bs, BLOCK_STORE_OP_RELEASE, success, 0);
+    if (success)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!is_bitmap_block(ids[i]))
+            {
+                TRACE(bs, BLOCK_STORE_OP_RELEASE, ids[i], true);
+            }
+        }
+    }
+    return success;
+}
+
+bool block_store_set_policy(block_store_t *const bs, const block_store_policy_t policy)
+{
+    // the other policies keep per-process state about a bitmap everyone changes
+    if (bs == NULL || bs->bitmap == NULL || (bs->shared != NULL && policy != BLOCK_STORE_POLICY_FIRST_FIT))
+    {
+        return false;
+    }
+
+    switch (policy)
+    {
+    case BLOCK_STORE_POLICY_FIRST_FIT:
+    case BLOCK_STORE_POLICY_NEXT_FIT:
+    case BLOCK_STORE_POLICY_BEST_FIT:
+    case BLOCK_STORE_POLICY_NEAR:
+        buddy_destroy(bs->buddy);
+        bs->buddy = NULL;
+        break;
+    case BLOCK_STORE_POLICY_BUDDY:
+        if (bs->buddy == NULL)
+        {
+            bs->buddy = buddy_create(BLOCK_STORE_NUM_BLOCKS);
+            if (bs->buddy == NULL)
+            {
+                return false;
+            }
+        }
+        buddy_rebuild(bs->buddy, bs->bitmap);
+        break;
+    default:
+        return false;
+    }
+    bs->policy = policy;
+    return true;
+}
+
+/// Allocates 2^order contiguous blocks aligned to their size
+/// \param bs BS device
+/// \param order log2 of the extent size
+/// \return First block of the extent, SIZE_MAX on error
+static size_t allocate_extent_impl(block_store_t *const bs, const unsigned order)
+{
+    // check for valid parameters
+    if (bs == NULL || bs->bitmap == NULL || order >= sizeof(size_t) * 8 ||
+        ((size_t)1 << order) > BLOCK_STORE_NUM_BLOCKS || !bitmap_writable(bs))
+    {
+        return SIZE_MAX;
+    }
+    const size_t size = (size_t)1 << order;
+
+    size_t block_id = SIZE_MAX;
+    if (bs->buddy)
+    {
+        block_id = buddy_alloc(bs->buddy, order);
+    }
+    else
+    {
+        // first fit over the aligned positions only, so both policies hand out the same shapes
+        for (size_t start = 0; start + size <= BLOCK_STORE_NUM_BLOCKS && block_id == SIZE_MAX; start += size)
+        {
+            size_t probe = start;
+            while (probe < start + size && !bitmap_test(bs->bitmap, probe))
+            {
+                probe++;
+            }
+            if (probe == start + size)
+            {
+                block_id = start;
+            }
+        }
+    }
+
+    if (block_id == SIZE_MAX)
+    {
+        return SIZE_MAX;
+    }
+    for (size_t offset = 0; offset < size; offset++)
+    {
+        bitmap_set(bs->bitmap, block_id + offset);
+    }
+    used_add(bs, (ptrdiff_t)size);
+    return block_id;
+}
+
+size_t block_store_allocate_extent(block_store_t *const bs, const unsigned order)
+{
+    STATS_BEGIN(start);
+    size_t block_id = allocate_extent_impl(bs, order);
+    STATS_END(start, bs, BLOCK_STORE_OP_ALLOCATE, block_id != SIZE_MAX, 0);
+    // traced block by block, like allocate_n, so a replay allocates the same number
+    if (block_id != SIZE_MAX)
+    {
+        for (size_t offset = 0; offset < ((size_t)1 << order); offset++)
+        {
+            TRACE(bs, BLOCK_STORE_OP_ALLOCATE, block_id + offset, true);
+        }
+    }
+    return block_id;
+}
+
+/// Frees 2^order contiguous blocks aligned to their size
+/// \param bs BS device
+/// \param block_id First block of the extent
+/// \param order log2 of the extent size
+/// \return false if the request was invalid
+static bool release_extent_impl(block_store_t *const bs, const size_t block_id, const unsigned order)
+{
+    // check for invalid parameters
+    if (bs == NULL || bs->bitmap == NULL || order >= sizeof(size_t) * 8)
+    {
+        return false;
+    }
+    const size_t size = (size_t)1 << order;
+    if (size > BLOCK_STORE_NUM_BLOCKS || block_id > BLOCK_STORE_NUM_BLOCKS - size || (block_id & (size - 1)) ||
+        !bitmap_writable(bs))
+    {
+        return false;
+    }
+
+    // an extent over the bitmap block is freed around it, as release_range does
+    if (block_id < BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS && block_id + size > BITMAP_START_BLOCK)
+    {
+        return release_range_impl(bs, block_id, size, 0);
+    }
+
+    // a fully allocated extent goes back to the buddy lists in one piece
+    size_t in_use = 0;
+    for (size_t offset = 0; offset < size; offset++)
+    {
+        in_use += bitmap_test(bs->bitmap, block_id + offset);
+    }
+    if (bs->buddy && in_use == size)
+    {
+        buddy_free(bs->buddy, block_id, order);
+    }
+    used_add(bs, -(ptrdiff_t)in_use);
+
+    for (size_t offset = 0; offset < size; offset++)
+    {
+        if (bs->buddy && in_use != size && bitmap_test(bs->bitmap, block_id + offset))
+        {
+            buddy_free(bs->buddy, block_id + offset, 0);
+        }
+        bitmap_reset(bs->bitmap, block_id + offset);
+    }
+    for (size_t chunk_id = block_id / BLOCK_STORE_CHUNK_BLOCKS; chunk_id <= (block_id + size - 1) / BLOCK_STORE_CHUNK_BLOCKS; chunk_id++)
+    {
+        chunk_trim(bs, chunk_id);
+    }
+    return true;
+}
+
+bool block_store_release_extent(block_store_t *const bs, const size_t block_id, const unsigned order)
+{
+    STATS_BEGIN(start);
+    bool success = release_extent_impl(bs, block_id, order);
+    STATS_END(start, bs, BLOCK_STORE_OP_RELEASE, success, 0);
+    if (success)
+    {
+        for (size_t offset = 0; offset < ((size_t)1 << order); offset++)
+        {
+            if (!is_bitmap_block(block_id + offset))
+            {
+                TRACE(bs, BLOCK_STORE_OP_RELEASE, block_id + offset, true);
+            }
+        }
+    }
+    return success;
+}
+
+/// Counts the number of blocks marked as in use
+/// \param bs BS device
+/// \return Total blocks in use, SIZE_MAX on error
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+    // check for invalid parameters
+    if (bs == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    // kept up to date by everything that sets or clears bits (see block_store_check_used)
+    return atomic_load_explicit(bs->shared != NULL ? &bs->shared->used : &bs->used, memory_order_relaxed) - (REQUIRED_BITMAP_BLOCKS);
+}
+
+bool block_store_check_used(block_store_t *const bs)
+{
+    if (bs == NULL || bs->bitmap == NULL)
+    {
+        return false;
+    }
+    const size_t counted = bitmap_total_set(bs->bitmap);
+    atomic_size_t *used = bs->shared != NULL ? &bs->shared->used : &bs->used;
+    if (atomic_load_explicit(used, memory_order_relaxed) == counted)
+    {
+        return true;
+    }
+    atomic_store_explicit(used, counted, memory_order_relaxed);
+    return false;
+}
+
+/// Counts the number of blocks marked free for use
+/// \param bs BS device
+/// \return Total blocks free, SIZE_MAX on error
+size_t block_store_get_free_blocks(const block_store_t *const bs)
+{
+    // check for invalid parameters
+    if (bs == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    // if i use the available blocks which subtracts 1 it works but that wouldnt make sense
+    // conceptually since I already subtract the one block in the get used method
+    // tests will try to say that (BLOCK_STORE_AVAIL_BLOCKS) - 1 != (256 - 1) - 1 == 254 and that 254 != 254
+    return (BLOCK_STORE_NUM_BLOCKS)-block_store_get_used_blocks(bs);
+}
+
+/// Returns the total number of user-addressable blocks
+/// \return Total blocks
+size_t block_store_get_total_blocks()
+{
+    return (BLOCK_STORE_AVAIL_BLOCKS);
+}
+
+/// Returns how much memory the store's blocks occupy
+/// \param bs BS device
+/// \return Bytes of block data held, SIZE_MAX on error
+size_t block_store_get_resident_bytes(const block_store_t *const bs)
+{
+    if (bs == NULL)
+    {
+        return SIZE_MAX;
+    }
+    size_t bytes = 0;
+    for (size_t chunk_id = 0; chunk_id < BLOCK_STORE_NUM_CHUNKS; chunk_id++)
+    {
+        bytes += bs->chunks[chunk_id] != NULL ? BLOCK_STORE_CHUNK_BYTES : 0;
+    }
+    return bytes;
+}
+
+/// Finds a block's sequence counter, in the segment for shared stores
+/// \param bs BS device, concurrent
+/// \param chunk The block's chunk
+/// \param block_id The block
+/// \return The counter
+static atomic_uint *block_seq(const block_store_t *const bs, block_chunk_t *const chunk, const size_t block_id)
+{
+    return bs->shared != NULL ? &bs->shared->seq[block_id] : &chunk->seq[block_id % BLOCK_STORE_CHUNK_BLOCKS];
+}
+
+/// Takes a shared store's write lock, repairing what a writer that died holding it left behind
+/// \param header The segment's header
+static void shared_lock(shared_header_t *const header)
+{
+    if (pthread_mutex_lock(&header->write_lock) == EOWNERDEAD)
+    {
+        // its block keeps whatever it got to copy, but readers must stop waiting on it
+        for (size_t block_id = 0; block_id < BLOCK_STORE_NUM_BLOCKS; block_id++)
+        {
+            const unsigned seq = atomic_load_explicit(&header->seq[block_id], memory_order_relaxed);
+            if (seq & 1)
+            {
+                atomic_store_explicit(&header->seq[block_id], seq + 1, memory_order_release);
+            }
+        }
+        pthread_mutex_consistent(&header->write_lock);
+    }
+}
+
+/// Copies a block out without locking, retrying if a write overlapped the copy
+/// \param bs BS device
+/// \param block_id The block
+/// \param buffer Where to copy it
+static void block_read_optimistic(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    const size_t within = block_id % BLOCK_STORE_CHUNK_BLOCKS;
+    for (unsigned spins = 0;; spins++)
+    {
+        block_chunk_t *chunk = __atomic_load_n(&bs->chunks[block_id / BLOCK_STORE_CHUNK_BLOCKS], __ATOMIC_ACQUIRE);
+        atomic_uint *seq = block_seq(bs, chunk, block_id);
+        const unsigned before = atomic_load_explicit(seq, memory_order_acquire);
+        if (before & 1)
+        {
+            // a shared store's writer may have died mid-copy, locking recovers if so
+            if (bs->shared != NULL && spins >= SHARED_READ_SPINS)
+            {
+                shared_lock(bs->shared);
+                pthread_mutex_unlock(&bs->shared->write_lock);
+                spins = 0;
+            }
+            continue;
+        }
+        memcpy(buffer, &chunk->blocks[within], BLOCK_SIZE_BYTES);
+        // the copy must be done before the counter is checked again
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(seq, memory_order_relaxed) == before)
+        {
+            return;
+        }
+    }
+}
+
+/// Copies a block in, making the counter odd for the duration so readers retry
+///  (an odd counter also keeps other writers of the block out)
+/// \param bs BS device
+/// \param block_id The block, its chunk already unshared
+/// \param buffer What to copy in
+static void block_write_sequenced(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    block_chunk_t *chunk = bs->chunks[block_id / BLOCK_STORE_CHUNK_BLOCKS];
+    const size_t within = block_id % BLOCK_STORE_CHUNK_BLOCKS;
+    atomic_uint *counter = block_seq(bs, chunk, block_id);
+    if (bs->shared != NULL)
+    {
+        shared_lock(bs->shared);
+    }
+    unsigned seq = atomic_load_explicit(counter, memory_order_relaxed);
+    while ((seq & 1) || !atomic_compare_exchange_weak_explicit(counter, &seq, seq + 1, memory_order_acquire, memory_order_relaxed))
+    {
+        seq = atomic_load_explicit(counter, memory_order_relaxed);
+    }
+    // the odd counter must be visible before any of the new data
+    atomic_thread_fence(memory_order_release);
+    memcpy(&chunk->blocks[within], buffer, BLOCK_SIZE_BYTES);
+    atomic_store_explicit(counter, seq + 2, memory_order_release);
+    if (bs->shared != NULL)
+    {
+        pthread_mutex_unlock(&bs->shared->write_lock);
+    }
+}
+
+// How far ahead reads of a chunk advised SEQUENTIAL prefetch
+#define READ_AHEAD_BLOCKS 2
+#define CACHE_LINE_BYTES 64
+
+/// Pulls a block into the cache
+/// \param bs BS device
+/// \param block_id The block, must be valid
+static void prefetch_block(const block_store_t *const bs, const size_t block_id)
+{
+    const uint8_t *data = (const uint8_t *)block_get(bs, block_id);
+    for (size_t offset = 0; offset < BLOCK_SIZE_BYTES; offset += CACHE_LINE_BYTES)
+    {
+        __builtin_prefetch(data + offset, 0, 3);
+    }
+}
+
+void block_store_prefetch(const block_store_t *const bs, const size_t *const ids, const size_t n)
+{
+    if (bs == NULL || ids == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ids[i] < BLOCK_STORE_NUM_BLOCKS)
+        {
+            prefetch_block(bs, ids[i]);
+        }
+    }
+}
+
+bool block_store_advise(block_store_t *const bs, const size_t first, const size_t count, const block_store_advice_t advice)
+{
+    // check for invalid parameters
+    if (bs == NULL || first >= BLOCK_STORE_NUM_BLOCKS || count == 0 || count > BLOCK_STORE_NUM_BLOCKS - first)
+    {
+        return false;
+    }
+
+    int kernel_advice;
+    switch (advice)
+    {
+    case BLOCK_STORE_ADVICE_NORMAL:
+        kernel_advice = MADV_NORMAL;
+        break;
+    case BLOCK_STORE_ADVICE_SEQUENTIAL:
+        kernel_advice = MADV_SEQUENTIAL;
+        break;
+    case BLOCK_STORE_ADVICE_RANDOM:
+        kernel_advice = MADV_RANDOM;
+        break;
+    case BLOCK_STORE_ADVICE_WILLNEED:
+        kernel_advice = MADV_WILLNEED;
+        break;
+    case BLOCK_STORE_ADVICE_DONTNEED:
+        // MADV_DONTNEED would throw anonymous pages away, MADV_COLD only ages them
+#ifdef MADV_COLD
+        kernel_advice = MADV_COLD;
+#else
+        kernel_advice = MADV_NORMAL;
+#endif
+        break;
+    default:
+        return false;
+    }
+
+    for (size_t chunk_id = first / BLOCK_STORE_CHUNK_BLOCKS; chunk_id <= (first + count - 1) / BLOCK_STORE_CHUNK_BLOCKS; chunk_id++)
+    {
+        bs->advice[chunk_id] = (uint8_t)advice;
+        // the kernel only takes whole pages, chunks outside the arena may share theirs
+        block_chunk_t *chunk = bs->chunks[chunk_id];
+        if (chunk != NULL && chunk->arena != NULL && sysconf(_SC_PAGESIZE) == BLOCK_STORE_CHUNK_BYTES)
+        {
+            madvise(chunk->blocks, BLOCK_STORE_CHUNK_BYTES, kernel_advice);
+        }
+        if (advice == BLOCK_STORE_ADVICE_WILLNEED)
+        {
+            for (size_t block = 0; block < BLOCK_STORE_CHUNK_BLOCKS; block++)
+            {
+                prefetch_block(bs, chunk_id * BLOCK_STORE_CHUNK_BLOCKS + block);
+            }
+        }
+    }
+    return true;
+}
+
+/// Reads data from the specified block and writes it to the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+static size_t read_impl(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    // check for invalid parameters
+    if (bs == NULL || buffer == NULL || block_id > (BLOCK_STORE_AVAIL_BLOCKS) || block_id == 0)
+    {
+        return 0;
+    }
+
+    // a sequential reader wants the next blocks on their way before it gets to them
+    if (bs->advice[block_id / BLOCK_STORE_CHUNK_BLOCKS] == BLOCK_STORE_ADVICE_SEQUENTIAL)
+    {
+        for (size_t ahead = block_id + 1; ahead <= block_id + READ_AHEAD_BLOCKS && ahead < BLOCK_STORE_NUM_BLOCKS; ahead++)
+        {
+            prefetch_block(bs, ahead);
+        }
+    }
+
+    // turn into void pointer
+    if (bs->concurrent)
+    {
+        block_read_optimistic(bs, block_id, buffer);
+    }
+    else
+    {
+        memcpy(buffer, block_get(bs, block_id), BLOCK_SIZE_BYTES);
+    }
+
+    // number of bytes read
+    return BLOCK_SIZE_BYTES;
+}
+
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    STATS_BEGIN(start);
+    size_t bytes = read_impl(bs, block_id, buffer);
+    STATS_END(start, bs, BLOCK_STORE_OP_READ, bytes != 0, bytes);
+    TRACE(bs, BLOCK_STORE_OP_READ, block_id, bytes != 0);
+    return bytes;
+}
+
+/// Reads data from the specified buffer and writes it to the designated block
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+static size_t write_impl(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    // check for invalid parameters
+    if (bs == NULL || buffer == NULL || block_id >= BLOCK_STORE_NUM_BLOCKS || bs->read_only)
+    {
+        return 0;
+    }
+
+    // copy the chunk first if a snapshot still shares it
+    block_t *block = block_get_mut(bs, block_id);
+    if (block == NULL)
+    {
+        return 0;
+    }
+
+    // make into a void pointer
+    if (bs->concurrent)
+    {
+        block_write_sequenced(bs, block_id, buffer);
+    }
+    else
+    {
+        memcpy(block, buffer, BLOCK_SIZE_BYTES);
+    }
+
+    // writing over the bitmap itself invalidates the used count and buddy lists
+    if (block_id >= BITMAP_START_BLOCK && block_id < BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS)
+    {
+        used_recount(bs);
+        if (bs->buddy)
+        {
+            buddy_rebuild(bs->buddy, bs->bitmap);
+        }
+    }
+
+    // number of bytes written
+    return BLOCK_SIZE_BYTES;
+}
+
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    STATS_BEGIN(start);
+    size_t bytes = write_impl(bs, block_id, buffer);
+    STATS_END(start, bs, BLOCK_STORE_OP_WRITE, bytes != 0, bytes);
+    TRACE(bs, BLOCK_STORE_OP_WRITE, block_id, bytes != 0);
+    return bytes;
+}
+
+/// Points a chunk of one store at a chunk of another instead of copying its blocks
+///  Only for private stores without optimistic readers, which could still be
+///  looking at the chunk being dropped
+/// \param dst Destination BS device
+/// \param dst_chunk Chunk to replace, not the bitmap's
+/// \param src Source BS device
+/// \param src_chunk Chunk to share
+/// \return false if a chunk could not be allocated
+static bool chunk_clone(block_store_t *const dst, const size_t dst_chunk, const block_store_t *const src, const size_t src_chunk)
+{
+    block_chunk_t *chunk = src->chunks[src_chunk];
+    if (chunk == NULL && !dst->sparse)
+    {
+        // a dense store keeps all of its chunks, the zeroes get copied instead
+        block_t *blocks = block_get_mut(dst, dst_chunk * BLOCK_STORE_CHUNK_BLOCKS);
+        if (blocks == NULL)
+            return false;
+        memset(blocks, 0, BLOCK_STORE_CHUNK_BYTES);
+        return true;
+    }
+    if (chunk != NULL)
+    {
+        atomic_fetch_add(&chunk->refcount, 1);
+    }
+    chunk_put(dst->chunks[dst_chunk]);
+    dst->chunks[dst_chunk] = chunk;
+    return true;
+}
+
+/// Copies blocks that lie within one chunk of each store
+/// \param dst Destination BS device
+/// \param dst_id First destination block
+/// \param src Source BS device
+/// \param src_id First source block
+/// \param n Number of blocks
+/// \param backward Whether overlapping blocks of one store must be copied last to first
+/// \return false if the destination chunk could not be unshared
+static bool copy_blocks(block_store_t *const dst, const size_t dst_id, const block_store_t *const src, const size_t src_id,
+                        const size_t n, const bool backward)
+{
+    // unshare first: if src is dst the source has to be looked up in the private copy
+    block_t *to = block_get_mut(dst, dst_id);
+    if (to == NULL)
+    {
+        return false;
+    }
+    if (!dst->concurrent && !src->concurrent)
+    {
+        memmove(to, block_get(src, src_id), n * BLOCK_SIZE_BYTES);
+        return true;
+    }
+
+    // block by block, so readers of either store never see a torn one
+    for (size_t i = 0; i < n; i++)
+    {
+        const size_t offset = backward ? n - 1 - i : i;
+        block_t data;
+        if (src->concurrent)
+            block_read_optimistic(src, src_id + offset, &data);
+        else
+            data = *block_get(src, src_id + offset);
+        if (dst->concurrent)
+            block_write_sequenced(dst, dst_id + offset, &data);
+        else
+            to[offset] = data;
+    }
+    return true;
+}
+
+size_t block_store_copy_range(block_store_t *const dst, const size_t dst_id, const block_store_t *const src,
+                              const size_t src_id, const size_t n)
+{
+    // check for invalid parameters; the bitmap's blocks can't be copied over
+    if (dst == NULL || src == NULL || dst->bitmap == NULL || src->bitmap == NULL || dst->read_only || n == 0 ||
+        n > BLOCK_STORE_NUM_BLOCKS || dst_id > BLOCK_STORE_NUM_BLOCKS - n || src_id > BLOCK_STORE_NUM_BLOCKS - n ||
+        (dst_id < BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS && dst_id + n > BITMAP_START_BLOCK))
+    {
+        return 0;
+    }
+    if (dst == src && dst_id == src_id)
+    {
+        return n * BLOCK_SIZE_BYTES;
+    }
+
+    // a destination starting inside its own source is copied from the end, as memmove would
+    const bool backward = dst == src && dst_id > src_id && dst_id < src_id + n;
+    // whole chunks of private stores are shared copy-on-write rather than copied
+    const bool clone = !dst->concurrent && !src->concurrent;
+
+    size_t done = 0;
+    while (done < n)
+    {
+        // a piece stays within one chunk of each side, they are not contiguous in memory
+        size_t piece = n - done;
+        size_t from, to;
+        if (backward)
+        {
+            const size_t from_end = src_id + n - done;
+            const size_t to_end = dst_id + n - done;
+            const size_t from_room = (from_end - 1) % BLOCK_STORE_CHUNK_BLOCKS + 1;
+            const size_t to_room = (to_end - 1) % BLOCK_STORE_CHUNK_BLOCKS + 1;
+            piece = piece < from_room ? piece : from_room;
+            piece = piece < to_room ? piece : to_room;
+            from = from_end - piece;
+            to = to_end - piece;
+        }
+        else
+        {
+            from = src_id + done;
+            to = dst_id + done;
+            const size_t from_room = BLOCK_STORE_CHUNK_BLOCKS - from % BLOCK_STORE_CHUNK_BLOCKS;
+            const size_t to_room = BLOCK_STORE_CHUNK_BLOCKS - to % BLOCK_STORE_CHUNK_BLOCKS;
+            piece = piece < from_room ? piece : from_room;
+            piece = piece < to_room ? piece : to_room;
+        }
+
+        const bool copied = clone && piece == BLOCK_STORE_CHUNK_BLOCKS
+                                ? chunk_clone(dst, to / BLOCK_STORE_CHUNK_BLOCKS, src, from / BLOCK_STORE_CHUNK_BLOCKS)
+                                : copy_blocks(dst, to, src, from, piece, backward);
+        if (!copied)
+        {
+            break;
+        }
+        done += piece;
+    }
+    return done * BLOCK_SIZE_BYTES;
+}
+
+bool block_store_fragmentation_report(const block_store_t *const bs, block_store_fragmentation_t *const report)
+{
+    if (bs == NULL || bs->bitmap == NULL || report == NULL)
+    {
+        return false;
+    }
+    memset(report, 0, sizeof(*report));
+
+    // walk the runs, each ending where the first block of the other kind starts
+    for (size_t block_id = 0; block_id < BLOCK_STORE_NUM_BLOCKS;)
+    {
+        const bool used = bitmap_test(bs->bitmap, block_id);
+        size_t end = used ? bitmap_ffz_from(bs->bitmap, block_id) : bitmap_ffs_from(bs->bitmap, block_id);
+        if (end > BLOCK_STORE_NUM_BLOCKS)
+        {
+            end = BLOCK_STORE_NUM_BLOCKS;
+        }
+        const size_t length = end - block_id;
+        if (used)
+        {
+            report->used_extents++;
+        }
+        else
+        {
+            report->free_extents++;
+            report->free_blocks += length;
+            report->largest_free_extent = length > report->largest_free_extent ? length : report->largest_free_extent;
+            report->free_extent_histogram[63 - __builtin_clzll(length)]++;
+        }
+        block_id = end;
+    }
+    if (report->free_extents > 0)
+    {
+        report->average_free_extent = (double)report->free_blocks / report->free_extents;
+    }
+    if (report->used_extents > 0)
+    {
+        report->average_used_extent = (double)(BLOCK_STORE_NUM_BLOCKS - report->free_blocks) / report->used_extents;
+    }
+    return true;
+}
+
+size_t block_store_compact(block_store_t *const bs, const size_t max_moves, size_t *const map,
+                           void (*func)(size_t, size_t, void *), void *arg)
+{
+    if (bs == NULL || bs->bitmap == NULL || !bitmap_writable(bs))
+    {
+        return SIZE_MAX;
+    }
+
+    // two fingers: the lowest hole fills from the highest allocated block until they cross,
+    //  so a moved block always lands below every block still to move
+    size_t moved = 0;
+    size_t hole = 1;
+    size_t top = BLOCK_STORE_NUM_BLOCKS - 1;
+    while (moved < max_moves)
+    {
+        hole = bitmap_ffz_from(bs->bitmap, hole);
+        top = bitmap_fls_from(bs->bitmap, top);
+        // the bitmap's own blocks stay put
+        while (top != SIZE_MAX && top >= BITMAP_START_BLOCK && top < BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS)
+        {
+            top = top > 0 ? bitmap_fls_from(bs->bitmap, top - 1) : SIZE_MAX;
+        }
+        if (hole == SIZE_MAX || top == SIZE_MAX || hole > top)
+        {
+            break;
+        }
+
+        // a copy, since writing may unshare the chunk the source is in
+        const block_t data = *block_get(bs, top);
+        if (write_impl(bs, hole, &data) == 0)
+        {
+            return moved > 0 ? moved : SIZE_MAX;
+        }
+        bitmap_set(bs->bitmap, hole);
+        bitmap_reset(bs->bitmap, top);
+        if (bs->buddy)
+        {
+            buddy_claim(bs->buddy, hole);
+            buddy_free(bs->buddy, top, 0);
+        }
+        chunk_trim(bs, top / BLOCK_STORE_CHUNK_BLOCKS);
+        // traced as the calls that would make the move by hand, so a replay ends with the same bitmap
+        TRACE(bs, BLOCK_STORE_OP_REQUEST, hole, true);
+        TRACE(bs, BLOCK_STORE_OP_WRITE, hole, true);
+        TRACE(bs, BLOCK_STORE_OP_RELEASE, top, true);
+
+        if (map != NULL)
+        {
+            map[top] = hole;
+        }
+        if (func != NULL)
+        {
+            func(top, hole, arg);
+        }
+        moved++;
+    }
+    return moved;
+}
+
+/// Writes a byte range of the image to the same offset in a file
+/// \param bs BS device
+/// \param file The file descriptor
+/// \param offset Image offset to start at
+/// \param length Number of bytes to write
+/// \return false on a write error
+static bool image_pwrite(const block_store_t *const bs, const int file, size_t offset, size_t length)
+{
+    while (length > 0)
+    {
+        // a write can't cross a chunk, they are not contiguous in memory
+        const size_t within = offset % BLOCK_STORE_CHUNK_BYTES;
+        const size_t piece = length < BLOCK_STORE_CHUNK_BYTES - within ? length : BLOCK_STORE_CHUNK_BYTES - within;
+        const uint8_t *data = (const uint8_t *)block_get(bs, offset / BLOCK_SIZE_BYTES) + offset % BLOCK_SIZE_BYTES;
+
+        ssize_t result = pwrite(file, data, piece, offset);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        offset += result;
+        length -= result;
+    }
+    return true;
+}
+
+/// Reads a byte range of the image from the same offset in a file
+///  (the store's chunks must not be shared)
+/// \param bs BS device
+/// \param file The file descriptor
+/// \param offset Image offset to start at
+/// \param length Number of bytes to read
+/// \return false on a read error, running out of file is not an error
+static bool image_pread(block_store_t *const bs, const int file, size_t offset, size_t length)
+{
+    while (length > 0)
+    {
+        const size_t within = offset % BLOCK_STORE_CHUNK_BYTES;
+        const size_t piece = length < BLOCK_STORE_CHUNK_BYTES - within ? length : BLOCK_STORE_CHUNK_BYTES - within;
+        uint8_t *data = (uint8_t *)bs->chunks[offset / BLOCK_STORE_CHUNK_BYTES]->blocks + within;
+
+        ssize_t result = pread(file, data, piece, offset);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return false;
+        if (result == 0)
+            return true;
+        offset += result;
+        length -= result;
+    }
+    return true;
+}
+
+/// Drops the contents of a free byte range of an existing image file
+///  Punches a hole where the filesystem supports it, otherwise writes zeroes
+/// \param file The file descriptor
+/// \param offset Image offset to start at
+/// \param length Number of bytes to discard
+/// \return false on error
+static bool image_discard(const int file, size_t offset, size_t length)
+{
+    if (fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+    {
+        return true;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        return false;
+    }
+
+    static const uint8_t zeroes[BLOCK_SIZE_BYTES];
+    for (; length > 0; offset += BLOCK_SIZE_BYTES, length -= BLOCK_SIZE_BYTES)
+    {
+        if (pwrite(file, zeroes, BLOCK_SIZE_BYTES, offset) != BLOCK_SIZE_BYTES)
+            return false;
+    }
+    return true;
+}
+
+/// Reads the data regions of an image file that fall in a byte range
+///  Holes are skipped, they are free blocks and stay zeroed in the store
+/// \param bs BS device, its chunks must not be shared
+/// \param file The file descriptor
+/// \param begin First image offset of the range
+/// \param end Image offset just past the range
+/// \return false on a read error
+static bool image_read_regions(block_store_t *const bs, const int file, off_t begin, const off_t end)
+{
+    while (begin < end)
+    {
+        off_t data = lseek(file, begin, SEEK_DATA);
+        if (data == -1)
+        {
+            // ENXIO means no data is left, EINVAL means no hole support so read everything
+            if (errno == EINVAL)
+                return image_pread(bs, file, begin, end - begin);
+            return errno == ENXIO;
+        }
+        if (data >= end)
+            return true;
+
+        off_t hole = lseek(file, data, SEEK_HOLE);
+        if (hole == -1 || hole > end)
+            hole = end;
+        if (!image_pread(bs, file, data, hole - data))
+            return false;
+        begin = hole;
+    }
+    return true;
+}
+
+/// Writes the allocated blocks of a block range to an image file
+///  Walks the bitmap one run of equal bits at a time; free runs that lie
+///  inside the file's old contents are discarded so no stale data remains
+/// \param bs BS device
+/// \param file The file descriptor
+/// \param first_block First block of the range
+/// \param end_block Block just past the range
+/// \param old_size Size of the file before this write
+/// \return false on a write error
+static bool image_write_runs(const block_store_t *const bs, const int file, const size_t first_block, const size_t end_block, const off_t old_size)
+{
+    size_t run_start = first_block;
+    while (run_start < end_block)
+    {
+        const bool allocated = bitmap_test(bs->bitmap, run_start);
+        size_t run_end = run_start + 1;
+        while (run_end < end_block && bitmap_test(bs->bitmap, run_end) == allocated)
+            run_end++;
+
+        const size_t offset = run_start * BLOCK_SIZE_BYTES;
+        const size_t length = (run_end - run_start) * BLOCK_SIZE_BYTES;
+        if (allocated && !image_pwrite(bs, file, offset, length))
+            return false;
+        if (!allocated && (off_t)offset < old_size && !image_discard(file, offset, length))
+            return false;
+        run_start = run_end;
+    }
+    return true;
+}
+
+/// Checksums the superblock fields that precede the checksum
+/// \param superblock The superblock
+/// \return FNV-1a hash of those bytes
+static uint32_t superblock_checksum(const block_store_superblock_t *const superblock)
+{
+    const uint8_t *bytes = (const uint8_t *)superblock;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(block_store_superblock_t, checksum); i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/// Writes the superblock describing the store into an image file
+/// \param bs BS device
+/// \param file The file descriptor
+/// \return false on a write error
+static bool image_write_superblock(const block_store_t *const bs, const int file)
+{
+    block_store_superblock_t superblock;
+    memset(&superblock, 0, sizeof(superblock));
+    superblock.magic = BLOCK_STORE_SUPER_MAGIC;
+    superblock.version = BLOCK_STORE_SUPER_VERSION;
+    superblock.superblock_bytes = sizeof(superblock);
+    superblock.block_size = BLOCK_SIZE_BYTES;
+    superblock.block_count = BLOCK_STORE_NUM_BLOCKS;
+    superblock.bitmap_block = BITMAP_START_BLOCK;
+    superblock.bitmap_bytes = BITMAP_SIZE_BYTES;
+    superblock.used_blocks = block_store_get_used_blocks(bs);
+    superblock.features = 0;
+    superblock.checksum = superblock_checksum(&superblock);
+    return pwrite(file, &superblock, sizeof(superblock), BLOCK_STORE_SUPER_OFFSET) == sizeof(superblock);
+}
+
+/// Checks an image file before any of its blocks are read
+///  A superblock must match this build's geometry and features; an image
+///  without one (written before superblocks existed) only has to be complete
+/// \param file The file descriptor
+/// \param superblock Filled in from the file, magic is 0 if it has none
+/// \return false if the image must be refused
+static bool image_check(const int file, block_store_superblock_t *const superblock)
+{
+    struct stat st;
+    if (fstat(file, &st) == -1 || st.st_size != BLOCK_STORE_NUM_BYTES ||
+        pread(file, superblock, sizeof(*superblock), BLOCK_STORE_SUPER_OFFSET) != sizeof(*superblock))
+    {
+        return false;
+    }
+    if (superblock->magic != BLOCK_STORE_SUPER_MAGIC)
+    {
+        superblock->magic = 0;
+        return true;
+    }
+    return superblock->version == BLOCK_STORE_SUPER_VERSION &&
+           superblock->superblock_bytes == sizeof(*superblock) &&
+           superblock->checksum == superblock_checksum(superblock) &&
+           superblock->block_size == BLOCK_SIZE_BYTES &&
+           superblock->block_count == BLOCK_STORE_NUM_BLOCKS &&
+           superblock->bitmap_block == BITMAP_START_BLOCK &&
+           superblock->bitmap_bytes == BITMAP_SIZE_BYTES &&
+           superblock->used_blocks <= BLOCK_STORE_AVAIL_BLOCKS &&
+           (superblock->features & ~BLOCK_STORE_FEATURES_SUPPORTED) == 0;
+}
+
+/// Finishes loading an image: drops the superblock from the bitmap block and
+///  checks the loaded bitmap agrees with it
+/// \param bs BS device that was just read
+/// \param superblock The image's superblock, magic 0 if it has none
+/// \return false if the image is inconsistent
+static bool image_loaded(block_store_t *const bs, const block_store_superblock_t *const superblock)
+{
+    uint8_t *bitmap_block = (uint8_t *)&bs->chunks[BITMAP_CHUNK]->blocks[BITMAP_START_BLOCK % BLOCK_STORE_CHUNK_BLOCKS];
+    used_recount(bs);
+    if (superblock->magic == 0)
+    {
+        return true;
+    }
+    memset(bitmap_block + BITMAP_SIZE_BYTES, 0, sizeof(*superblock));
+    return block_store_get_used_blocks(bs) == superblock->used_blocks;
+}
+
+bool block_store_read_superblock(const char *const filename, block_store_superblock_t *const superblock)
+{
+    if (filename == NULL)
+    {
+        return false;
+    }
+    int file = open(filename, O_RDONLY);
+    if (file == -1)
+    {
+        return false;
+    }
+    block_store_superblock_t found;
+    bool success = image_check(file, &found) && found.magic != 0;
+    close(file);
+    if (success && superblock != NULL)
+    {
+        *superblock = found;
+    }
+    return success;
+}
+
+/// Copies a byte range between two files, in the kernel when it can
+/// \param from Source file descriptor
+/// \param to Destination file descriptor
+/// \param offset Offset to start at, the same in both files
+/// \param length Number of bytes
+/// \return false on an I/O error
+static bool image_copy_region(const int from, const int to, off_t offset, size_t length)
+{
+    bool in_kernel = true;
+    uint8_t buffer[BLOCK_STORE_CHUNK_BYTES];
+    while (length > 0)
+    {
+        ssize_t result;
+        if (in_kernel)
+        {
+            off_t in = offset, out = offset;
+            result = copy_file_range(from, &in, to, &out, length, 0);
+            // older kernels and some file system pairs can't, copy through user space instead
+            if (result < 0 && (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL))
+            {
+                in_kernel = false;
+                continue;
+            }
+        }
+        else
+        {
+            result = pread(from, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+            if (result > 0)
+                result = pwrite(to, buffer, result, offset);
+        }
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        offset += result;
+        length -= result;
+    }
+    return true;
+}
+
+size_t block_store_copy_image(const char *const src_filename, const char *const dst_filename)
+{
+    if (src_filename == NULL || dst_filename == NULL)
+    {
+        return 0;
+    }
+    const int from = open(src_filename, O_RDONLY);
+    if (from == -1)
+    {
+        return 0;
+    }
+    block_store_superblock_t superblock;
+    struct stat from_st, to_st;
+    const int to = image_check(from, &superblock) && fstat(from, &from_st) == 0
+                       ? open(dst_filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR)
+                       : -1;
+    // truncating the source would lose it
+    bool success = to != -1 && fstat(to, &to_st) == 0 &&
+                   (from_st.st_dev != to_st.st_dev || from_st.st_ino != to_st.st_ino) && ftruncate(to, 0) == 0;
+
+    // a reflink shares the source's extents, nothing is copied until one side is written
+    if (success && ioctl(to, FICLONE, from) != 0)
+    {
+        // otherwise the data regions are copied, the holes of a sparse image stay holes
+        success = ftruncate(to, BLOCK_STORE_NUM_BYTES) == 0;
+        for (off_t begin = 0; success && begin < BLOCK_STORE_NUM_BYTES;)
+        {
+            off_t data = lseek(from, begin, SEEK_DATA);
+            off_t hole = data == -1 ? -1 : lseek(from, data, SEEK_HOLE);
+            if (data == -1 && errno == ENXIO)
+                break;
+            if (data == -1 || hole == -1)
+            {
+                // no hole support, copy everything
+                data = begin;
+                hole = BLOCK_STORE_NUM_BYTES;
+            }
+            if (hole > BLOCK_STORE_NUM_BYTES)
+                hole = BLOCK_STORE_NUM_BYTES;
+            success = image_copy_region(from, to, data, hole - data);
+            begin = hole;
+        }
+    }
+    if (to != -1)
+    {
+        success = close(to) == 0 && success;
+    }
+    close(from);
+    return success ? BLOCK_STORE_NUM_BYTES : 0;
+}
+
+/// Imports BS device from the given file
+/// \param filename The file to load
+/// \return Pointer to new BS device, NULL on error
+static block_store_t *deserialize_impl(const char *const filename)
+{
+    // check for invalid parameters
+    if (filename == NULL)
+    {
+        return NULL;
+    }
+
+    //initialize blockstore
+    block_store_t *bs = block_store_create();
+    if (bs == NULL)
+    {
+        return NULL;
+    }
+
+    //file that we are importing from
+    int file = open(filename, O_RDONLY);
+
+    //if file is invalid
+    if (file == -1)
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    //refuse a wrong or truncated image before reading any of it
+    block_store_superblock_t superblock;
+    bool success = image_check(file, &superblock);
+
+    //read only the data regions of the file, holes are free blocks and stay zeroed;
+    //with nothing allocated only the bitmap block needs reading
+    if (success && superblock.magic != 0 && superblock.used_blocks == 0)
+    {
+        success = image_pread(bs, file, BITMAP_START_BLOCK * BLOCK_SIZE_BYTES, REQUIRED_BITMAP_BLOCKS * BLOCK_SIZE_BYTES);
+    }
+    else if (success)
+    {
+        success = image_read_regions(bs, file, 0, BLOCK_STORE_NUM_BYTES);
+    }
+    close(file);
+    success = success && image_loaded(bs, &superblock);
+
+    if (!success)
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+block_store_t *block_store_deserialize(const char *const filename)
+{
+    STATS_BEGIN(start);
+    block_store_t *bs = deserialize_impl(filename);
+    STATS_END_PROCESS(start, BLOCK_STORE_OP_DESERIALIZE, bs != NULL, bs != NULL ? BLOCK_STORE_NUM_BYTES : 0);
+    return bs;
+}
+
+/// Writes the BS device to file, overwriting it if it exists
+///  Only allocated blocks are written, free blocks are left as holes
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Size of the image written, 0 on error
+static size_t serialize_impl(const block_store_t *const bs, const char *const filename)
+{
+    // check for invalid parameters
+    if (filename == NULL || bs == NULL)
+    {
+        return 0;
+    }
+
+    // file that we are importing from
+    int file = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+
+    //if file is invalid
+    if (file == -1)
+    {
+        return 0;
+    }
+
+    // anything past the old end of file is already a hole
+    struct stat st;
+    if (fstat(file, &st) == -1)
+    {
+        close(file);
+        return 0;
+    }
+
+    //write allocated extents, discarding whatever an older image left in free ones
+    bool success = image_write_runs(bs, file, 0, BLOCK_STORE_NUM_BLOCKS, st.st_size) &&
+                   image_write_superblock(bs, file);
+
+    //the image always spans the whole device, trailing free blocks included
+    if (success)
+    {
+        success = ftruncate(file, BLOCK_STORE_NUM_BYTES) == 0;
+    }
+
+    close(file);
+    return success ? BLOCK_STORE_NUM_BYTES : 0;
+}
+
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+{
+    STATS_BEGIN(start);
+    size_t bytes = serialize_impl(bs, filename);
+    STATS_END(start, bs, BLOCK_STORE_OP_SERIALIZE, bytes != 0, bytes);
+    TRACE(bs, BLOCK_STORE_OP_SERIALIZE, 0, bytes != 0);
+    return bytes;
+}
+
+/// Shares every chunk of the store with a new store object
+/// \param bs BS device
+/// \param read_only Whether the new store rejects modification
+/// \return The new store, NULL on error
+static block_store_t *block_store_share(const block_store_t *const bs, const bool read_only)
+{
+    // copying a chunk on write would split it off from the other processes
+    if (bs == NULL || bs->bitmap == NULL || bs->shared != NULL)
+    {
+        return NULL;
+    }
+
+    block_store_t *copy = (block_store_t *)calloc(1, sizeof(block_store_t));
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+
+#ifdef BLOCK_STORE_STATS
+    copy->stats = stats_create();
+    if (copy->stats == NULL)
+    {
+        free(copy);
+        return NULL;
+    }
+#endif
+
+    // the bitmap overlays the shared chunk until one side writes to it
+    copy->bitmap = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, &bs->chunks[BITMAP_CHUNK]->blocks[BITMAP_START_BLOCK % BLOCK_STORE_CHUNK_BLOCKS]);
+    if (copy->bitmap == NULL)
+    {
+        block_store_destroy(copy);
+        return NULL;
+    }
+
+    for (size_t chunk_id = 0; chunk_id < BLOCK_STORE_NUM_CHUNKS; chunk_id++)
+    {
+        if (bs->chunks[chunk_id] != NULL)
+        {
+            atomic_fetch_add(&bs->chunks[chunk_id]->refcount, 1);
+        }
+        copy->chunks[chunk_id] = bs->chunks[chunk_id];
+    }
+    copy->read_only = read_only;
+    atomic_init(&copy->used, atomic_load_explicit(&bs->used, memory_order_relaxed));
+    copy->sparse = bs->sparse;
+    if (bs->policy != BLOCK_STORE_POLICY_FIRST_FIT && !block_store_set_policy(copy, bs->policy))
+    {
+        block_store_destroy(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+/// Takes a read-only point-in-time snapshot sharing all blocks with the store
+/// \param bs BS device
+/// \return The snapshot, NULL on error
+block_store_t *block_store_snapshot(const block_store_t *const bs)
+{
+    return block_store_share(bs, true);
+}
+
+/// Creates a writable copy sharing all blocks with the store until either side writes
+/// \param bs BS device (or snapshot)
+/// \return The clone, NULL on error
+block_store_t *block_store_clone(const block_store_t *const bs)
+{
+    return block_store_share(bs, false);
+}
+
+/// Reports every block whose allocation state or contents differ between two stores
+/// \param a First BS device or snapshot
+/// \param b Second BS device or snapshot
+/// \param func Called with each differing block id, may be NULL
+/// \param arg Passed through to func
+/// \return Number of differing blocks, SIZE_MAX on error
+size_t block_store_diff(const block_store_t *const a, const block_store_t *const b, void (*func)(size_t, void *), void *arg)
+{
+    // check for invalid parameters
+    if (a == NULL || b == NULL || a->bitmap == NULL || b->bitmap == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    size_t differences = 0;
+    for (size_t block_id = 0; block_id < BLOCK_STORE_NUM_BLOCKS; block_id++)
+    {
+        if (block_id >= BITMAP_START_BLOCK && block_id < BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS)
+        {
+            continue;
+        }
+
+        // chunks that are still shared cannot differ, skip them whole
+        const size_t chunk_id = block_id / BLOCK_STORE_CHUNK_BLOCKS;
+        const bool in_a = bitmap_test(a->bitmap, block_id);
+        const bool in_b = bitmap_test(b->bitmap, block_id);
+        if (in_a == in_b && (a->chunks[chunk_id] == b->chunks[chunk_id] || !in_a))
+        {
+            continue;
+        }
+        if (in_a == in_b && memcmp(block_get(a, block_id), block_get(b, block_id), BLOCK_SIZE_BYTES) == 0)
+        {
+            continue;
+        }
+
+        differences++;
+        if (func != NULL)
+        {
+            func(block_id, arg);
+        }
+    }
+    return differences;
+}
+
+// Stream framing: every frame is a fixed header of little-endian words
+// followed by length bytes of payload. The bitmap goes first, then runs of
+// allocated blocks (never crossing a chunk), then an end frame carrying the
+// number of blocks sent so the reader can tell a cut-off stream from a whole one.
+#define STREAM_MAGIC 0x31465342  // "BSF1"
+#define STREAM_HEADER_BYTES 20
+
+typedef enum { STREAM_BITMAP = 1, STREAM_BLOCKS = 2, STREAM_END = 3 } STREAM_FRAME_TYPE;
+
+typedef struct stream_frame
+{
+    uint32_t type;
+    uint32_t first_block;
+    uint32_t block_count;
+    uint32_t length;
+} stream_frame_t;
+
+static void put32(uint8_t *const out, const uint32_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
 
-typedef struct block_store
+static uint32_t get32(const uint8_t *const in)
 {
-    bitmap_t *bitmap;
-    block_t blocks[BLOCK_STORE_NUM_BLOCKS];
-} block_store_t;
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
 
-/// This creates a new BS device, ready to go
-/// \return Pointer to a new block storage device, NULL on error
-block_store_t *block_store_create()
+/// Pushes the whole buffer through a write callback
+/// \return false if the callback failed or stopped accepting data
+static bool stream_write_all(block_store_write_fn write_fn, void *arg, const void *buffer, size_t length)
 {
-    // calloc
-    block_store_t *bs = (block_store_t *)calloc(1, sizeof(block_store_t));
+    const uint8_t *data = (const uint8_t *)buffer;
+    while (length > 0)
+    {
+        ssize_t result = write_fn(arg, data, length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        data += result;
+        length -= result;
+    }
+    return true;
+}
 
-    // checks that the malloc was successful
-    if (bs == NULL)
+/// Fills the whole buffer from a read callback
+/// \return false if the callback failed or the stream ended early
+static bool stream_read_all(block_store_read_fn read_fn, void *arg, void *buffer, size_t length)
+{
+    uint8_t *data = (uint8_t *)buffer;
+    while (length > 0)
     {
-        return NULL;
+        ssize_t result = read_fn(arg, data, length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        data += result;
+        length -= result;
     }
+    return true;
+}
 
-    // create the bitmap
-    bs->bitmap = bitmap_overlay(BLOCK_STORE_NUM_BLOCKS, &((bs->blocks)[BITMAP_START_BLOCK]));
+static bool stream_write_frame(block_store_write_fn write_fn, void *arg, const stream_frame_t *const frame)
+{
+    uint8_t header[STREAM_HEADER_BYTES];
+    put32(header, STREAM_MAGIC);
+    put32(header + 4, frame->type);
+    put32(header + 8, frame->first_block);
+    put32(header + 12, frame->block_count);
+    put32(header + 16, frame->length);
+    return stream_write_all(write_fn, arg, header, sizeof(header));
+}
 
-    // loop through the bitmap and attempt to allocate the block id
-    uint32_t bitmap_index;
-    for (bitmap_index = BITMAP_START_BLOCK; bitmap_index < BITMAP_START_BLOCK + REQUIRED_BITMAP_BLOCKS; bitmap_index++)
+static bool stream_read_frame(block_store_read_fn read_fn, void *arg, stream_frame_t *const frame)
+{
+    uint8_t header[STREAM_HEADER_BYTES];
+    if (!stream_read_all(read_fn, arg, header, sizeof(header)) || get32(header) != STREAM_MAGIC)
     {
-        if (!block_store_request(bs, bitmap_index))
-            break;
+        return false;
+    }
+    frame->type = get32(header + 4);
+    frame->first_block = get32(header + 8);
+    frame->block_count = get32(header + 12);
+    frame->length = get32(header + 16);
+    return true;
+}
+
+/// Streams the BS device through a write callback in bounded frames
+/// \param bs BS device
+/// \param write_fn Called with each piece of the stream
+/// \param write_arg Passed through to write_fn
+/// \param progress Called after each frame (may be NULL)
+/// \param progress_arg Passed through to progress
+/// \return Number of bytes streamed, 0 on error
+static size_t serialize_stream_impl(const block_store_t *const bs, block_store_write_fn write_fn, void *write_arg,
+                                    block_store_progress_fn progress, void *progress_arg)
+{
+    // check for invalid parameters
+    if (bs == NULL || bs->bitmap == NULL || write_fn == NULL)
+    {
+        return 0;
     }
 
-    // check for null bitmap
-    if (bs->bitmap == NULL)
+    const size_t bitmap_bytes = bitmap_get_bytes(bs->bitmap);
+    const size_t total = bitmap_bytes + block_store_get_used_blocks(bs) * BLOCK_SIZE_BYTES;
+    size_t done = 0;
+    size_t streamed = 0;
+
+    stream_frame_t frame = {STREAM_BITMAP, BITMAP_START_BLOCK, REQUIRED_BITMAP_BLOCKS, bitmap_bytes};
+    if (!stream_write_frame(write_fn, write_arg, &frame) || !stream_write_all(write_fn, write_arg, bitmap_export(bs->bitmap), bitmap_bytes))
     {
-        return NULL;
+        return 0;
     }
+    done += bitmap_bytes;
+    streamed += STREAM_HEADER_BYTES + bitmap_bytes;
+    if (progress != NULL)
+        progress(done, total, progress_arg);
 
-    return bs;
+    // one frame per run of allocated blocks, split at chunk boundaries
+    uint32_t blocks_sent = 0;
+    size_t block_id = 0;
+    while (block_id < BLOCK_STORE_NUM_BLOCKS)
+    {
+        if (!bitmap_test(bs->bitmap, block_id) || is_bitmap_block(block_id))
+        {
+            block_id++;
+            continue;
+        }
+
+        size_t run_end = block_id + 1;
+        while (run_end < BLOCK_STORE_NUM_BLOCKS && run_end % BLOCK_STORE_CHUNK_BLOCKS != 0 &&
+               bitmap_test(bs->bitmap, run_end) && !is_bitmap_block(run_end))
+            run_end++;
+
+        const size_t length = (run_end - block_id) * BLOCK_SIZE_BYTES;
+        frame.type = STREAM_BLOCKS;
+        frame.first_block = block_id;
+        frame.block_count = run_end - block_id;
+        frame.length = length;
+        if (!stream_write_frame(write_fn, write_arg, &frame) || !stream_write_all(write_fn, write_arg, block_get(bs, block_id), length))
+        {
+            return 0;
+        }
+        blocks_sent += frame.block_count;
+        done += length;
+        streamed += STREAM_HEADER_BYTES + length;
+        if (progress != NULL)
+            progress(done, total, progress_arg);
+        block_id = run_end;
+    }
+
+    frame.type = STREAM_END;
+    frame.first_block = 0;
+    frame.block_count = blocks_sent;
+    frame.length = 0;
+    if (!stream_write_frame(write_fn, write_arg, &frame))
+    {
+        return 0;
+    }
+    return streamed + STREAM_HEADER_BYTES;
 }
 
-/// Destroys the provided block storage device
-/// This is an idempotent operation, so there is no return value
-/// \param bs BS device
-void block_store_destroy(block_store_t *const bs)
+size_t block_store_serialize_stream(const block_store_t *const bs, block_store_write_fn write_fn, void *write_arg,
+                                    block_store_progress_fn progress, void *progress_arg)
 {
-    // check that block store exists
-    if (bs != NULL)
+    STATS_BEGIN(start);
+    size_t bytes = serialize_stream_impl(bs, write_fn, write_arg, progress, progress_arg);
+    STATS_END(start, bs, BLOCK_STORE_OP_SERIALIZE, bytes != 0, bytes);
+    TRACE(bs, BLOCK_STORE_OP_SERIALIZE, 0, bytes != 0);
+    return bytes;
+}
+
+/// Rebuilds a BS device from a stream produced by block_store_serialize_stream
+/// \param read_fn Called to fetch more of the stream
+/// \param read_arg Passed through to read_fn
+/// \param progress Called after each frame (may be NULL)
+/// \param progress_arg Passed through to progress
+/// \return Pointer to new BS device, NULL on error or malformed stream
+static block_store_t *deserialize_stream_impl(block_store_read_fn read_fn, void *read_arg,
+                                              block_store_progress_fn progress, void *progress_arg)
+{
+    // check for invalid parameters
+    if (read_fn == NULL)
     {
-        // destruct and destroy bitmap
-        bitmap_destroy(bs->bitmap);
-        // unallocate the block store memory
-        free(bs);
+        return NULL;
+    }
+
+    block_store_t *bs = block_store_create();
+    if (bs == NULL)
+    {
+        return NULL;
+    }
+
+    // the bitmap frame has to come first, it tells us how much data follows
+    stream_frame_t frame;
+    uint8_t *bitmap_data = (uint8_t *)&bs->chunks[BITMAP_CHUNK]->blocks[BITMAP_START_BLOCK % BLOCK_STORE_CHUNK_BLOCKS];
+    const size_t bitmap_bytes = bitmap_get_bytes(bs->bitmap);
+    if (!stream_read_frame(read_fn, read_arg, &frame) || frame.type != STREAM_BITMAP || frame.length != bitmap_bytes ||
+        !stream_read_all(read_fn, read_arg, bitmap_data, bitmap_bytes))
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    used_recount(bs);
+
+    const size_t used = block_store_get_used_blocks(bs);
+    const size_t total = bitmap_bytes + used * BLOCK_SIZE_BYTES;
+    size_t done = bitmap_bytes;
+    uint32_t blocks_received = 0;
+    bool received[BLOCK_STORE_NUM_BLOCKS] = {false};
+    if (progress != NULL)
+        progress(done, total, progress_arg);
+
+    while (stream_read_frame(read_fn, read_arg, &frame))
+    {
+        // every block the bitmap marks as in use has to have arrived, exactly once
+        if (frame.type == STREAM_END && frame.block_count == blocks_received && blocks_received == used && frame.length == 0)
+        {
+            return bs;
+        }
+
+        // a block frame never crosses a chunk, so it lands in one contiguous piece
+        const size_t first = frame.first_block;
+        const size_t count = frame.block_count;
+        if (frame.type != STREAM_BLOCKS || count == 0 || first >= BLOCK_STORE_NUM_BLOCKS ||
+            first % BLOCK_STORE_CHUNK_BLOCKS + count > BLOCK_STORE_CHUNK_BLOCKS ||
+            frame.length != count * BLOCK_SIZE_BYTES || is_bitmap_block(first) || is_bitmap_block(first + count - 1))
+        {
+            break;
+        }
+        // only blocks the bitmap says are allocated are ever sent, and never twice
+        bool expected = true;
+        for (size_t block_id = first; block_id < first + count && expected; block_id++)
+        {
+            expected = bitmap_test(bs->bitmap, block_id) && !received[block_id];
+            received[block_id] = true;
+        }
+        if (!expected || !stream_read_all(read_fn, read_arg, block_get_mut(bs, first), frame.length))
+        {
+            break;
+        }
+
+        blocks_received += count;
+        done += frame.length;
+        if (progress != NULL)
+            progress(done, total, progress_arg);
     }
+
+    block_store_destroy(bs);
+    return NULL;
 }
 
-/// Searches for a free block, marks it as in use, and returns the block's id
+block_store_t *block_store_deserialize_stream(block_store_read_fn read_fn, void *read_arg,
+                                              block_store_progress_fn progress, void *progress_arg)
+{
+    STATS_BEGIN(start);
+    block_store_t *bs = deserialize_stream_impl(read_fn, read_arg, progress, progress_arg);
+    STATS_END_PROCESS(start, BLOCK_STORE_OP_DESERIALIZE, bs != NULL, bs != NULL ? block_store_get_used_blocks(bs) * BLOCK_SIZE_BYTES : 0);
+    return bs;
+}
+
+static ssize_t fd_write(void *arg, const void *buffer, size_t length)
+{
+    return write(*(const int *)arg, buffer, length);
+}
+
+static ssize_t fd_read(void *arg, void *buffer, size_t length)
+{
+    return read(*(const int *)arg, buffer, length);
+}
+
+/// Streams the BS device to a file descriptor (file, pipe or socket)
 /// \param bs BS device
-/// \return Allocated block's id, SIZE_MAX on error
-size_t block_store_allocate(block_store_t *const bs)
+/// \param fd The descriptor to write to
+/// \return Number of bytes streamed, 0 on error
+size_t block_store_serialize_fd(const block_store_t *const bs, int fd)
 {
-    // check for valid parameters
-    if (bs == NULL || bs->bitmap == NULL)
+    if (fd < 0)
     {
-        return SIZE_MAX;
+        return 0;
     }
+    return block_store_serialize_stream(bs, fd_write, &fd, NULL, NULL);
+}
 
-    // find the first zero bit address in the bitmap
-    size_t block_id = bitmap_ffz(bs->bitmap);
-
-    // check for out of bounds block id
-    if (block_id > (BLOCK_STORE_AVAIL_BLOCKS) || block_id == SIZE_MAX)
+/// Rebuilds a BS device from a stream read from a file descriptor
+/// \param fd The descriptor to read from
+/// \return Pointer to new BS device, NULL on error
+block_store_t *block_store_deserialize_fd(int fd)
+{
+    if (fd < 0)
     {
-        return SIZE_MAX;
+        return NULL;
     }
-
-    // set the requested bit
-    bitmap_set(bs->bitmap, block_id);
-    // return the allocated block's id
-    return block_id;
+    return block_store_deserialize_stream(fd_read, &fd, NULL, NULL);
 }
 
-/// Attempts to allocate the requested block id
-/// \param bs the block store object
-/// \param block_id the requested block identifier
-/// \return boolean indicating succes of operation
-bool block_store_request(block_store_t *const bs, const size_t block_id)
+/// Collects the operation counters and latency histograms of the BS device
+/// \param bs BS device
+/// \param stats Filled in with the totals over all threads
+/// \return false on error or if statistics were compiled out
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats)
 {
+#ifdef BLOCK_STORE_STATS
     // check for invalid parameters
-    if (bs == NULL || bs->bitmap == NULL || block_id > (BLOCK_STORE_AVAIL_BLOCKS) || bitmap_test(bs->bitmap, block_id))
+    if (bs == NULL || bs->stats == NULL || stats == NULL)
     {
         return false;
     }
 
-    // set the requested bit
-    bitmap_set(bs->bitmap, block_id);
+    stats_collect(bs->stats, stats);
     return true;
+#else
+    UNUSED(bs);
+    UNUSED(stats);
+    return false;
+#endif
 }
 
-/// Frees the specified block
+/// Zeroes the operation counters and latency histograms of the BS device
 /// \param bs BS device
-/// \param block_id The block to free
-void block_store_release(block_store_t *const bs, const size_t block_id)
+void block_store_reset_stats(block_store_t *const bs)
+{
+#ifdef BLOCK_STORE_STATS
+    if (bs != NULL && bs->stats != NULL)
+    {
+        stats_clear(bs->stats);
+    }
+#else
+    UNUSED(bs);
+#endif
+}
+
+/// Collects the counters of calls kept for the whole process rather than per store
+/// \param stats Filled in with the totals over all threads
+/// \return false on error or if statistics were compiled out
+bool block_store_get_process_stats(block_store_stats_t *const stats)
 {
+#ifdef BLOCK_STORE_STATS
     // check for invalid parameters
-    if (bs == NULL || block_id > (BLOCK_STORE_AVAIL_BLOCKS))
+    if (stats == NULL)
     {
-        return;
+        return false;
     }
 
-    // clear the requested bit
-    bitmap_reset(bs->bitmap, block_id);
+    stats_collect(process_stats, stats);
+    return true;
+#else
+    UNUSED(stats);
+    return false;
+#endif
 }
 
-/// Counts the number of blocks marked as in use
+/// Zeroes the counters kept for the whole process
+void block_store_reset_process_stats()
+{
+#ifdef BLOCK_STORE_STATS
+    stats_clear(process_stats);
+#endif
+}
+
+/// Starts recording every API call on the BS device to a binary trace file
 /// \param bs BS device
-/// \return Total blocks in use, SIZE_MAX on error
-size_t block_store_get_used_blocks(const block_store_t *const bs)
+/// \param filename The trace file, replaced if it exists
+/// \return false on error or if a trace is already running
+bool block_store_trace_start(block_store_t *const bs, const char *const filename)
 {
     // check for invalid parameters
-    if (bs == NULL)
+    if (bs == NULL || filename == NULL || bs->trace != NULL)
     {
-        return SIZE_MAX;
+        return false;
+    }
+
+    block_store_trace_t *trace = (block_store_trace_t *)calloc(1, sizeof(block_store_trace_t));
+    if (trace == NULL)
+    {
+        return false;
+    }
+    trace->file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (trace->file == -1)
+    {
+        free(trace);
+        return false;
+    }
+
+    const block_store_trace_header_t header = {BLOCK_STORE_TRACE_MAGIC, BLOCK_STORE_TRACE_VERSION, sizeof(block_store_trace_record_t), 0};
+    if (write(trace->file, &header, sizeof(header)) != sizeof(header))
+    {
+        close(trace->file);
+        free(trace);
+        return false;
     }
 
-    // the number of set bits in the bitmap
-    return bitmap_total_set(bs->bitmap) - (REQUIRED_BITMAP_BLOCKS);
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->start_ns = monotonic_ns();
+    bs->trace = trace;
+    return true;
 }
 
-/// Counts the number of blocks marked free for use
+/// Stops recording and closes the trace file
 /// \param bs BS device
-/// \return Total blocks free, SIZE_MAX on error
-size_t block_store_get_free_blocks(const block_store_t *const bs)
+/// \return false if there was no trace or part of it could not be written
+bool block_store_trace_stop(block_store_t *const bs)
 {
-    // check for invalid parameters
-    if (bs == NULL)
+    if (bs == NULL || bs->trace == NULL)
     {
-        return SIZE_MAX;
+        return false;
     }
 
-    // if i use the available blocks which subtracts 1 it works but that wouldnt make sense
-    // conceptually since I already subtract the one block in the get used method
-    // tests will try to say that (BLOCK_STORE_AVAIL_BLOCKS) - 1 != (256 - 1) - 1 == 254 and that 254 != 254
-    return (BLOCK_STORE_NUM_BLOCKS)-block_store_get_used_blocks(bs);
+    block_store_trace_t *trace = bs->trace;
+    bs->trace = NULL;
+    trace_flush(trace);
+    bool success = !trace->failed;
+    success = close(trace->file) == 0 && success;
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+    return success;
 }
 
-/// Returns the total number of user-addressable blocks
-/// \return Total blocks
-size_t block_store_get_total_blocks()
+// One worker's share of a parallel image transfer: a range of whole chunks
+typedef struct image_job
 {
-    return (BLOCK_STORE_AVAIL_BLOCKS);
+    block_store_t *bs;
+    int file;
+    bool write;
+    size_t first_block;
+    size_t end_block;
+    bool success;
+} image_job_t;
+
+static void *image_worker(void *arg)
+{
+    image_job_t *job = (image_job_t *)arg;
+    if (job->write)
+        job->success = image_write_runs(job->bs, job->file, job->first_block, job->end_block, 0);
+    else
+        job->success = image_read_regions(job->bs, job->file, job->first_block * BLOCK_SIZE_BYTES, job->end_block * BLOCK_SIZE_BYTES);
+    return NULL;
 }
 
-/// Reads data from the specified block and writes it to the designated buffer
+/// Moves the whole image between store and file with several threads,
+///  each doing pwrite/pread on its own disjoint range of chunks
 /// \param bs BS device
-/// \param block_id Source block id
-/// \param buffer Data buffer to write to
-/// \return Number of bytes read, 0 on error
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+/// \param file The file descriptor
+/// \param write true to write the image, false to read it
+/// \param n_threads Number of threads, 0 for one per online CPU
+/// \return false if any range failed
+static bool image_parallel(block_store_t *const bs, const int file, const bool write, size_t n_threads)
 {
-    // check for invalid parameters
-    if (bs == NULL || buffer == NULL || block_id > (BLOCK_STORE_AVAIL_BLOCKS) || block_id == 0)
+    if (n_threads == 0)
     {
-        return 0;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (n_threads > BLOCK_STORE_NUM_CHUNKS)
+    {
+        n_threads = BLOCK_STORE_NUM_CHUNKS;
     }
 
-    // turn into void pointer
-    memcpy(buffer, &((bs->blocks)[block_id]), BLOCK_SIZE_BYTES);
+    image_job_t jobs[BLOCK_STORE_NUM_CHUNKS];
+    pthread_t threads[BLOCK_STORE_NUM_CHUNKS];
+    bool started[BLOCK_STORE_NUM_CHUNKS];
+    const size_t chunks_per_job = (BLOCK_STORE_NUM_CHUNKS + n_threads - 1) / n_threads;
+    size_t n_jobs = 0;
+    for (size_t chunk = 0; chunk < BLOCK_STORE_NUM_CHUNKS; chunk += chunks_per_job, n_jobs++)
+    {
+        const size_t end = chunk + chunks_per_job < BLOCK_STORE_NUM_CHUNKS ? chunk + chunks_per_job : BLOCK_STORE_NUM_CHUNKS;
+        image_job_t job = {bs, file, write, chunk * BLOCK_STORE_CHUNK_BLOCKS, end * BLOCK_STORE_CHUNK_BLOCKS, false};
+        jobs[n_jobs] = job;
+    }
 
-    // number of bytes read
-    return BLOCK_SIZE_BYTES;
+    // the calling thread takes the first range itself, and any a thread couldn't be started for
+    for (size_t i = 1; i < n_jobs; i++)
+    {
+        started[i] = pthread_create(&threads[i], NULL, image_worker, &jobs[i]) == 0;
+    }
+    image_worker(&jobs[0]);
+
+    bool success = jobs[0].success;
+    for (size_t i = 1; i < n_jobs; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            image_worker(&jobs[i]);
+        success = success && jobs[i].success;
+    }
+    return success;
 }
 
-/// Reads data from the specified buffer and writes it to the designated block
+/// Writes the BS device to file with several threads, then fsyncs and renames it into place
 /// \param bs BS device
-/// \param block_id Destination block id
-/// \param buffer Data buffer to read from
-/// \return Number of bytes written, 0 on error
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+/// \param filename The file to write to
+/// \param n_threads Number of threads, 0 for one per online CPU
+/// \return Size of the image written, 0 on error
+static size_t serialize_parallel_impl(const block_store_t *const bs, const char *const filename, const size_t n_threads)
 {
     // check for invalid parameters
-    if (bs == NULL || buffer == NULL)
+    if (filename == NULL || bs == NULL)
     {
         return 0;
     }
 
-    // make into a void pointer
-    memcpy(&((bs->blocks)[block_id]), buffer, BLOCK_SIZE_BYTES);
+    // build the new image next to the old one so readers never see half of it
+    const size_t name_length = strlen(filename);
+    char *temp_name = (char *)malloc(name_length + sizeof(".tmp"));
+    if (temp_name == NULL)
+    {
+        return 0;
+    }
+    memcpy(temp_name, filename, name_length);
+    memcpy(temp_name + name_length, ".tmp", sizeof(".tmp"));
 
-    // number of bytes written
-    return BLOCK_SIZE_BYTES;
+    int file = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (file == -1)
+    {
+        free(temp_name);
+        return 0;
+    }
+
+    // size the file first, free blocks are then holes and workers only write allocated runs
+    bool success = ftruncate(file, BLOCK_STORE_NUM_BYTES) == 0 &&
+                   image_parallel((block_store_t *)bs, file, true, n_threads) &&
+                   image_write_superblock(bs, file) &&
+                   fsync(file) == 0;
+    success = close(file) == 0 && success;
+    success = success && rename(temp_name, filename) == 0;
+    if (!success)
+    {
+        unlink(temp_name);
+    }
+    free(temp_name);
+    return success ? BLOCK_STORE_NUM_BYTES : 0;
 }
 
-/// Imports BS device from the given file
+size_t block_store_serialize_parallel(const block_store_t *const bs, const char *const filename, const size_t n_threads)
+{
+    STATS_BEGIN(start);
+    size_t bytes = serialize_parallel_impl(bs, filename, n_threads);
+    STATS_END(start, bs, BLOCK_STORE_OP_SERIALIZE, bytes != 0, bytes);
+    TRACE(bs, BLOCK_STORE_OP_SERIALIZE, 0, bytes != 0);
+    return bytes;
+}
+
+/// Imports BS device from the given file with several threads
 /// \param filename The file to load
+/// \param n_threads Number of threads, 0 for one per online CPU
 /// \return Pointer to new BS device, NULL on error
-block_store_t *block_store_deserialize(const char *const filename)
+static block_store_t *deserialize_parallel_impl(const char *const filename, const size_t n_threads)
 {
     // check for invalid parameters
     if (filename == NULL)
@@ -221,49 +3202,35 @@ block_store_t *block_store_deserialize(const char *const filename)
         return NULL;
     }
 
-    //initialize blockstore
     block_store_t *bs = block_store_create();
+    if (bs == NULL)
+    {
+        return NULL;
+    }
 
-    //file that we are importing from
     int file = open(filename, O_RDONLY);
-
-    //if file is invalid
     if (file == -1)
     {
         block_store_destroy(bs);
         return NULL;
     }
 
-    //read in file to blockstore
-    read(file, bs->blocks, BLOCK_STORE_NUM_BYTES);
+    block_store_superblock_t superblock;
+    bool success = image_check(file, &superblock) && image_parallel(bs, file, false, n_threads);
     close(file);
+    success = success && image_loaded(bs, &superblock);
+    if (!success)
+    {
+        block_store_destroy(bs);
+        return NULL;
+    }
     return bs;
 }
 
-/// Writes the entirety of the BS device to file, overwriting it if it exists
-/// \param bs BS device
-/// \param filename The file to write to
-/// \return Number of bytes written, 0 on error
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+block_store_t *block_store_deserialize_parallel(const char *const filename, const size_t n_threads)
 {
-    // check for invalid parameters
-    if (filename == NULL || bs == NULL)
-    {
-        return 0;
-    }
-
-    // file that we are importing from
-    int file = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-
-    //if file is invalid
-    if (file == -1)
-    {
-        return 0;
-    }
-
-    //writes BS to file
-    size_t bytes_written = write(file, bs->blocks, BLOCK_STORE_NUM_BYTES);
-
-    close(file);
-    return bytes_written;
+    STATS_BEGIN(start);
+    block_store_t *bs = deserialize_parallel_impl(filename, n_threads);
+    STATS_END_PROCESS(start, BLOCK_STORE_OP_DESERIALIZE, bs != NULL, bs != NULL ? BLOCK_STORE_NUM_BYTES : 0);
+    return bs;
 }
\ No newline at end of file
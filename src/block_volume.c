@@ -0,0 +1,1022 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "block_volume.h"
+
+// A vectored request handed to the stripe workers. Each worker handles the
+// ids that map to its own store and the caller waits for all of them.
+typedef struct volume_job
+{
+    bool write;
+    const size_t *block_ids;
+    size_t n;
+    void *const *read_buffers;
+    const void *const *write_buffers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    size_t remaining;  // workers still busy with this job
+    size_t bytes;
+} volume_job_t;
+
+typedef struct stripe
+{
+    pthread_mutex_t lock;  // guards bs
+    block_store_t *bs;     // NULL if the store was lost
+
+    // job slot for this stripe's worker, one job at a time
+    pthread_mutex_t job_lock;
+    pthread_cond_t job_changed;
+    volume_job_t *job;
+    bool stop;
+    pthread_t worker;
+    bool worker_started;
+} stripe_t;
+
+struct block_volume
+{
+    size_t n_stores;
+    block_volume_policy_t policy;
+    atomic_size_t next_store;
+    stripe_t *stripes;
+
+    // parity images, taken after any stripe lock
+    size_t n_parity;
+    pthread_mutex_t parity_lock;
+    uint8_t *parity[BLOCK_PARITY_MAX];  // BLOCK_STORE_NUM_BYTES each, NULL if lost
+};
+
+/// Tests a block's bit in a copy of a store's bitmap block
+/// \param bitmap The bitmap block
+/// \param local_id The block
+/// \return true if the block is allocated
+static bool bitmap_allocated(const uint8_t *const bitmap, const size_t local_id)
+{
+    return bitmap[local_id >> 3] & (1u << (local_id & 7));
+}
+
+/// Reads what parity covers of a block: its contents if allocated, zeroes if free
+/// \param bs The store
+/// \param bitmap A copy of the store's bitmap block
+/// \param local_id The block
+/// \param out Receives BLOCK_SIZE_BYTES
+static void covered_block(const block_store_t *const bs, const uint8_t *const bitmap, const size_t local_id, uint8_t *const out)
+{
+    if (local_id == BITMAP_START_BLOCK)
+        memcpy(out, bitmap, BLOCK_SIZE_BYTES);
+    else if (local_id != 0 && bitmap_allocated(bitmap, local_id))
+        block_store_read(bs, local_id, out);
+    else
+        memset(out, 0, BLOCK_SIZE_BYTES);
+}
+
+/// Folds a change to what one store's block contributes into the parity
+///  Parity is linear, so old ^ new can go in as two separate deltas
+/// \param volume The volume, the stripe's lock held
+/// \param index The stripe
+/// \param local_id The block
+/// \param delta Old XOR new contents, or the old contents
+/// \param more The new contents, NULL if delta is all of the change
+static void parity_update(block_volume_t *const volume, const size_t index, const size_t local_id, const uint8_t *const delta,
+                          const uint8_t *const more)
+{
+    void *rows[BLOCK_PARITY_MAX] = {NULL};
+    for (size_t p = 0; p < volume->n_parity; p++)
+    {
+        if (volume->parity[p] != NULL)
+            rows[p] = volume->parity[p] + local_id * BLOCK_SIZE_BYTES;
+    }
+    pthread_mutex_lock(&volume->parity_lock);
+    block_parity_update(index, delta, rows, volume->n_parity, BLOCK_SIZE_BYTES);
+    if (more != NULL)
+        block_parity_update(index, more, rows, volume->n_parity, BLOCK_SIZE_BYTES);
+    pthread_mutex_unlock(&volume->parity_lock);
+}
+
+/// Updates the parity for a block that was just allocated or freed: its bit
+///  flipped, and its contents appeared or went back to counting as zeroes
+/// \param volume The volume, the stripe's lock held
+/// \param index The stripe
+/// \param local_id The block
+static void parity_flip(block_volume_t *const volume, const size_t index, const size_t local_id)
+{
+    uint8_t delta[BLOCK_SIZE_BYTES];
+    if (local_id != 0 && block_store_read(volume->stripes[index].bs, local_id, delta) == BLOCK_SIZE_BYTES)
+    {
+        parity_update(volume, index, local_id, delta, NULL);
+    }
+    memset(delta, 0, sizeof(delta));
+    delta[local_id >> 3] = (uint8_t)(1u << (local_id & 7));
+    parity_update(volume, index, BITMAP_START_BLOCK, delta, NULL);
+}
+
+/// Writes a block of a store, keeping the parity in step
+/// \param volume The volume, the stripe's lock held
+/// \param index The stripe, not lost
+/// \param local_id The block
+/// \param buffer The new contents
+/// \return Number of bytes written, 0 on error
+static size_t stripe_write(block_volume_t *const volume, const size_t index, const size_t local_id, const void *const buffer)
+{
+    block_store_t *const bs = volume->stripes[index].bs;
+    if (volume->n_parity == 0)
+    {
+        return block_store_write(bs, local_id, buffer);
+    }
+    if (local_id == BITMAP_START_BLOCK || buffer == NULL)
+    {
+        return 0;
+    }
+
+    // a free block counts as zeroes however it is written, until it is allocated
+    uint8_t bitmap[BLOCK_SIZE_BYTES];
+    block_store_read(bs, BITMAP_START_BLOCK, bitmap);
+    if (local_id == 0 || !bitmap_allocated(bitmap, local_id))
+    {
+        return block_store_write(bs, local_id, buffer);
+    }
+    uint8_t old[BLOCK_SIZE_BYTES];
+    block_store_read(bs, local_id, old);
+    const size_t bytes = block_store_write(bs, local_id, buffer);
+    if (bytes != 0)
+    {
+        parity_update(volume, index, local_id, old, (const uint8_t *)buffer);
+    }
+    return bytes;
+}
+
+/// Takes every stripe lock, in order, then the parity lock
+/// \param volume The volume
+static void volume_lock_all(block_volume_t *const volume)
+{
+    for (size_t i = 0; i < volume->n_stores; i++)
+        pthread_mutex_lock(&volume->stripes[i].lock);
+    pthread_mutex_lock(&volume->parity_lock);
+}
+
+/// Releases what volume_lock_all took
+/// \param volume The volume
+static void volume_unlock_all(block_volume_t *const volume)
+{
+    pthread_mutex_unlock(&volume->parity_lock);
+    for (size_t i = volume->n_stores; i-- > 0;)
+        pthread_mutex_unlock(&volume->stripes[i].lock);
+}
+
+/// Gathers what parity covers of a run of rows (the same local blocks of every
+///  store) and the parity of those rows, rebuilding whatever was lost
+/// \param volume The volume, all locks held
+/// \param first First local block
+/// \param count Number of local blocks
+/// \param buffers n_stores + n_parity buffers of count blocks each
+/// \return false if more images are lost than the parity can rebuild
+static bool volume_gather(block_volume_t *const volume, const size_t first, const size_t count, uint8_t *const *buffers)
+{
+    size_t lost[BLOCK_PARITY_MAX];
+    size_t n_lost = 0;
+    for (size_t i = 0; i < volume->n_stores + volume->n_parity; i++)
+    {
+        const bool is_store = i < volume->n_stores;
+        if (is_store ? volume->stripes[i].bs == NULL : volume->parity[i - volume->n_stores] == NULL)
+        {
+            if (n_lost == volume->n_parity)
+                return false;
+            lost[n_lost++] = i;
+        }
+        else if (is_store)
+        {
+            uint8_t bitmap[BLOCK_SIZE_BYTES];
+            block_store_read(volume->stripes[i].bs, BITMAP_START_BLOCK, bitmap);
+            for (size_t row = 0; row < count; row++)
+                covered_block(volume->stripes[i].bs, bitmap, first + row, buffers[i] + row * BLOCK_SIZE_BYTES);
+        }
+        else
+        {
+            memcpy(buffers[i], volume->parity[i - volume->n_stores] + first * BLOCK_SIZE_BYTES, count * BLOCK_SIZE_BYTES);
+        }
+    }
+    return n_lost == 0 ||
+           block_parity_recover((void *const *)buffers, volume->n_stores, volume->n_parity, lost, n_lost, count * BLOCK_SIZE_BYTES);
+}
+
+/// Allocates one buffer per store and parity image
+/// \param volume The volume
+/// \param count Blocks per buffer
+/// \return The buffers, all in one allocation freed with free(), NULL on error
+static uint8_t **volume_buffers(const block_volume_t *const volume, const size_t count)
+{
+    const size_t n = volume->n_stores + volume->n_parity;
+    const size_t header = (n * sizeof(uint8_t *) + 63) & ~(size_t)63;
+    uint8_t **buffers = (uint8_t **)aligned_alloc(64, header + n * count * BLOCK_SIZE_BYTES);
+    if (buffers == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        buffers[i] = (uint8_t *)buffers + header + i * count * BLOCK_SIZE_BYTES;
+    }
+    return buffers;
+}
+
+/// Reads a block of a lost store, rebuilt from the other stores and the parity
+/// \param volume The volume, no locks held
+/// \param index The lost stripe
+/// \param local_id The block
+/// \param buffer Receives BLOCK_SIZE_BYTES
+/// \return Number of bytes read, 0 on error
+static size_t degraded_read(block_volume_t *const volume, const size_t index, const size_t local_id, void *const buffer)
+{
+    // block 0 can't be read back from a whole store either
+    if (local_id == 0 || buffer == NULL)
+    {
+        return 0;
+    }
+    uint8_t **buffers = volume_buffers(volume, 1);
+    if (buffers == NULL)
+    {
+        return 0;
+    }
+    volume_lock_all(volume);
+    const bool success = volume_gather(volume, local_id, 1, buffers);
+    volume_unlock_all(volume);
+    if (success)
+    {
+        memcpy(buffer, buffers[index], BLOCK_SIZE_BYTES);
+    }
+    free(buffers);
+    return success ? BLOCK_SIZE_BYTES : 0;
+}
+
+/// Does this stripe's share of a vectored job
+/// \param volume The volume
+/// \param index The stripe
+/// \param job The job
+/// \return Bytes moved
+static size_t stripe_run_job(block_volume_t *const volume, const size_t index, const volume_job_t *const job)
+{
+    stripe_t *stripe = &volume->stripes[index];
+    size_t bytes = 0;
+    pthread_mutex_lock(&stripe->lock);
+    // a lost store can only be read, each block rebuilt under every lock
+    if (stripe->bs == NULL)
+    {
+        pthread_mutex_unlock(&stripe->lock);
+        for (size_t i = 0; i < job->n && !job->write; i++)
+        {
+            const size_t block_id = job->block_ids[i];
+            if (block_id % volume->n_stores == index && block_id < block_volume_get_total_blocks(volume))
+                bytes += degraded_read(volume, index, block_id / volume->n_stores, job->read_buffers[i]);
+        }
+        return bytes;
+    }
+    for (size_t i = 0; i < job->n; i++)
+    {
+        const size_t block_id = job->block_ids[i];
+        if (block_id % volume->n_stores != index || block_id >= block_volume_get_total_blocks(volume))
+        {
+            continue;
+        }
+        if (job->write)
+            bytes += stripe_write(volume, index, block_id / volume->n_stores, job->write_buffers[i]);
+        else
+            bytes += block_store_read(stripe->bs, block_id / volume->n_stores, job->read_buffers[i]);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return bytes;
+}
+
+typedef struct worker_arg
+{
+    block_volume_t *volume;
+    size_t index;
+} worker_arg_t;
+
+static void *stripe_worker(void *arg)
+{
+    block_volume_t *volume = ((worker_arg_t *)arg)->volume;
+    const size_t index = ((worker_arg_t *)arg)->index;
+    free(arg);
+    stripe_t *stripe = &volume->stripes[index];
+
+    for (;;)
+    {
+        pthread_mutex_lock(&stripe->job_lock);
+        while (stripe->job == NULL && !stripe->stop)
+            pthread_cond_wait(&stripe->job_changed, &stripe->job_lock);
+        volume_job_t *job = stripe->job;
+        stripe->job = NULL;
+        pthread_cond_broadcast(&stripe->job_changed);
+        pthread_mutex_unlock(&stripe->job_lock);
+        if (job == NULL)
+        {
+            return NULL;
+        }
+
+        const size_t bytes = stripe_run_job(volume, index, job);
+        pthread_mutex_lock(&job->lock);
+        job->bytes += bytes;
+        if (--job->remaining == 0)
+            pthread_cond_signal(&job->finished);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/// Builds a volume around already created stores (takes ownership of them)
+/// \param stores The stores
+/// \param n_stores Number of stores
+/// \param policy Allocation policy
+/// \return The volume, NULL on error (the stores are destroyed)
+static block_volume_t *volume_assemble(block_store_t **stores, const size_t n_stores, const block_volume_policy_t policy)
+{
+    block_volume_t *volume = (block_volume_t *)calloc(1, sizeof(block_volume_t));
+    stripe_t *stripes = (stripe_t *)calloc(n_stores, sizeof(stripe_t));
+    if (volume == NULL || stripes == NULL)
+    {
+        for (size_t i = 0; i < n_stores; i++)
+            block_store_destroy(stores[i]);
+        free(stripes);
+        free(volume);
+        return NULL;
+    }
+
+    volume->n_stores = n_stores;
+    volume->policy = policy;
+    atomic_init(&volume->next_store, 0);
+    volume->stripes = stripes;
+    pthread_mutex_init(&volume->parity_lock, NULL);
+    for (size_t i = 0; i < n_stores; i++)
+    {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+        pthread_mutex_init(&stripes[i].job_lock, NULL);
+        pthread_cond_init(&stripes[i].job_changed, NULL);
+        stripes[i].bs = stores[i];
+    }
+
+    // one worker per store for vectored I/O
+    for (size_t i = 0; i < n_stores; i++)
+    {
+        worker_arg_t *arg = (worker_arg_t *)malloc(sizeof(worker_arg_t));
+        if (arg == NULL)
+        {
+            block_volume_destroy(volume);
+            return NULL;
+        }
+        arg->volume = volume;
+        arg->index = i;
+        if (pthread_create(&stripes[i].worker, NULL, stripe_worker, arg) != 0)
+        {
+            free(arg);
+            block_volume_destroy(volume);
+            return NULL;
+        }
+        stripes[i].worker_started = true;
+    }
+    return volume;
+}
+
+/// Computes the parity of the whole volume from its stores
+/// \param volume The volume, none of its stores lost, its parity images allocated
+/// \return false if memory ran out
+static bool volume_encode(block_volume_t *const volume)
+{
+    uint8_t **buffers = volume_buffers(volume, BLOCK_STORE_NUM_BLOCKS);
+    if (buffers == NULL)
+    {
+        return false;
+    }
+    volume_lock_all(volume);
+    bool success = volume_gather(volume, 0, BLOCK_STORE_NUM_BLOCKS, buffers) &&
+                   block_parity_encode((const void *const *)buffers, volume->n_stores, (void *const *)volume->parity,
+                                       volume->n_parity, BLOCK_STORE_NUM_BYTES);
+    volume_unlock_all(volume);
+    free(buffers);
+    return success;
+}
+
+block_volume_t *block_volume_create(const size_t n_stores, const block_volume_policy_t policy)
+{
+    return block_volume_create_parity(n_stores, 0, policy);
+}
+
+block_volume_t *block_volume_create_parity(const size_t n_stores, const size_t n_parity, const block_volume_policy_t policy)
+{
+    // check for invalid parameters
+    if (n_stores == 0 || n_parity > BLOCK_PARITY_MAX || (n_parity > 0 && n_stores > BLOCK_PARITY_MAX_DATA))
+    {
+        return NULL;
+    }
+
+    block_store_t **stores = (block_store_t **)calloc(n_stores, sizeof(block_store_t *));
+    if (stores == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < n_stores; i++)
+    {
+        stores[i] = block_store_create();
+        if (stores[i] == NULL)
+        {
+            for (size_t j = 0; j < i; j++)
+                block_store_destroy(stores[j]);
+            free(stores);
+            return NULL;
+        }
+    }
+
+    block_volume_t *volume = volume_assemble(stores, n_stores, policy);
+    free(stores);
+    if (volume == NULL || n_parity == 0)
+    {
+        return volume;
+    }
+
+    volume->n_parity = n_parity;
+    for (size_t p = 0; p < n_parity; p++)
+    {
+        volume->parity[p] = (uint8_t *)aligned_alloc(64, BLOCK_STORE_NUM_BYTES);
+        if (volume->parity[p] == NULL)
+        {
+            block_volume_destroy(volume);
+            return NULL;
+        }
+    }
+    if (!volume_encode(volume))
+    {
+        block_volume_destroy(volume);
+        return NULL;
+    }
+    return volume;
+}
+
+void block_volume_destroy(block_volume_t *const volume)
+{
+    if (volume == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < volume->n_stores; i++)
+    {
+        stripe_t *stripe = &volume->stripes[i];
+        if (stripe->worker_started)
+        {
+            pthread_mutex_lock(&stripe->job_lock);
+            stripe->stop = true;
+            pthread_cond_broadcast(&stripe->job_changed);
+            pthread_mutex_unlock(&stripe->job_lock);
+            pthread_join(stripe->worker, NULL);
+        }
+    }
+    for (size_t i = 0; i < volume->n_stores; i++)
+    {
+        stripe_t *stripe = &volume->stripes[i];
+        block_store_destroy(stripe->bs);
+        pthread_cond_destroy(&stripe->job_changed);
+        pthread_mutex_destroy(&stripe->job_lock);
+        pthread_mutex_destroy(&stripe->lock);
+    }
+    for (size_t p = 0; p < volume->n_parity; p++)
+    {
+        free(volume->parity[p]);
+    }
+    pthread_mutex_destroy(&volume->parity_lock);
+    free(volume->stripes);
+    free(volume);
+}
+
+size_t block_volume_get_stores(const block_volume_t *const volume)
+{
+    return volume == NULL ? 0 : volume->n_stores;
+}
+
+size_t block_volume_get_parity(const block_volume_t *const volume)
+{
+    return volume == NULL ? 0 : volume->n_parity;
+}
+
+/// Counts the lost stores and parity images
+/// \param volume The volume, all locks held (images only come back under every lock, in rebuild)
+/// \return Number of lost images
+static size_t count_missing(const block_volume_t *const volume)
+{
+    size_t missing = 0;
+    for (size_t i = 0; i < volume->n_stores; i++)
+    {
+        missing += volume->stripes[i].bs == NULL;
+    }
+    for (size_t p = 0; p < volume->n_parity; p++)
+    {
+        missing += volume->parity[p] == NULL;
+    }
+    return missing;
+}
+
+size_t block_volume_get_missing(block_volume_t *const volume)
+{
+    // check for invalid parameters
+    if (volume == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    volume_lock_all(volume);
+    const size_t missing = count_missing(volume);
+    volume_unlock_all(volume);
+    return missing;
+}
+
+size_t block_volume_get_total_blocks(const block_volume_t *const volume)
+{
+    return volume == NULL ? 0 : volume->n_stores * BLOCK_STORE_NUM_BLOCKS;
+}
+
+/// Picks the store with the fewest used blocks
+/// \param volume The volume
+/// \return The stripe index
+static size_t least_loaded_store(block_volume_t *const volume)
+{
+    size_t best = 0;
+    size_t best_used = SIZE_MAX;
+    for (size_t i = 0; i < volume->n_stores; i++)
+    {
+        pthread_mutex_lock(&volume->stripes[i].lock);
+        const size_t used = block_store_get_used_blocks(volume->stripes[i].bs);
+        pthread_mutex_unlock(&volume->stripes[i].lock);
+        // a lost store reports SIZE_MAX and is never picked
+        if (used < best_used)
+        {
+            best = i;
+            best_used = used;
+        }
+    }
+    return best;
+}
+
+size_t block_volume_allocate(block_volume_t *const volume)
+{
+    // check for invalid parameters
+    if (volume == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    // start at the preferred store and move on to the next one if it is full
+    size_t first;
+    if (volume->policy == BLOCK_VOLUME_LEAST_LOADED)
+        first = least_loaded_store(volume);
+    else
+        first = atomic_fetch_add(&volume->next_store, 1) % volume->n_stores;
+
+    for (size_t attempt = 0; attempt < volume->n_stores; attempt++)
+    {
+        const size_t index = (first + attempt) % volume->n_stores;
+        stripe_t *stripe = &volume->stripes[index];
+        pthread_mutex_lock(&stripe->lock);
+        const size_t local_id = stripe->bs != NULL ? block_store_allocate(stripe->bs) : SIZE_MAX;
+        if (local_id != SIZE_MAX && volume->n_parity > 0)
+        {
+            parity_flip(volume, index, local_id);
+        }
+        pthread_mutex_unlock(&stripe->lock);
+        if (local_id != SIZE_MAX)
+        {
+            return local_id * volume->n_stores + index;
+        }
+    }
+    return SIZE_MAX;
+}
+
+bool block_volume_request(block_volume_t *const volume, const size_t block_id)
+{
+    // check for invalid parameters
+    if (volume == NULL || block_id >= block_volume_get_total_blocks(volume))
+    {
+        return false;
+    }
+
+    const size_t index = block_id % volume->n_stores;
+    stripe_t *stripe = &volume->stripes[index];
+    pthread_mutex_lock(&stripe->lock);
+    const bool success = stripe->bs != NULL && block_store_request(stripe->bs, block_id / volume->n_stores);
+    if (success && volume->n_parity > 0)
+    {
+        parity_flip(volume, index, block_id / volume->n_stores);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return success;
+}
+
+void block_volume_release(block_volume_t *const volume, const size_t block_id)
+{
+    // check for invalid parameters
+    if (volume == NULL || block_id >= block_volume_get_total_blocks(volume))
+    {
+        return;
+    }
+
+    const size_t index = block_id % volume->n_stores;
+    const size_t local_id = block_id / volume->n_stores;
+    stripe_t *stripe = &volume->stripes[index];
+    pthread_mutex_lock(&stripe->lock);
+    if (volume->n_parity == 0)
+    {
+        block_store_release(stripe->bs, local_id);
+    }
+    else if (stripe->bs != NULL && local_id != BITMAP_START_BLOCK)
+    {
+        // only a block that was allocated changes what parity covers
+        uint8_t bitmap[BLOCK_SIZE_BYTES];
+        block_store_read(stripe->bs, BITMAP_START_BLOCK, bitmap);
+        block_store_release(stripe->bs, local_id);
+        if (bitmap_allocated(bitmap, local_id))
+            parity_flip(volume, index, local_id);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+size_t block_volume_get_used_blocks(block_volume_t *const volume)
+{
+    // check for invalid parameters
+    if (volume == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < volume->n_stores; i++)
+    {
+        pthread_mutex_lock(&volume->stripes[i].lock);
+        const bool lost = volume->stripes[i].bs == NULL;
+        used += lost ? 0 : block_store_get_used_blocks(volume->stripes[i].bs);
+        pthread_mutex_unlock(&volume->stripes[i].lock);
+
+        // a lost store's count comes from its rebuilt bitmap
+        uint8_t bitmap[BLOCK_SIZE_BYTES];
+        if (lost)
+        {
+            if (degraded_read(volume, i, BITMAP_START_BLOCK, bitmap) == 0)
+                return SIZE_MAX;
+            for (size_t byte = 0; byte < BITMAP_SIZE_BYTES; byte++)
+                used += __builtin_popcount(bitmap[byte]);
+            used -= REQUIRED_BITMAP_BLOCKS;
+        }
+    }
+    return used;
+}
+
+size_t block_volume_read(block_volume_t *const volume, const size_t block_id, void *buffer)
+{
+    return block_volume_readv(volume, &block_id, 1, &buffer);
+}
+
+size_t block_volume_write(block_volume_t *const volume, const size_t block_id, const void *buffer)
+{
+    return block_volume_writev(volume, &block_id, 1, &buffer);
+}
+
+/// Runs a vectored job, fanning out to the workers of every store it touches
+/// \param volume The volume
+/// \param job The job, its ids and buffers already filled in
+/// \return Total bytes moved
+static size_t volume_run(block_volume_t *const volume, volume_job_t *const job)
+{
+    // find the stores involved; a job on a single store runs on the calling thread
+    size_t touched = 0;
+    size_t only = 0;
+    bool *involved = (bool *)calloc(volume->n_stores, sizeof(bool));
+    if (involved == NULL)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < job->n; i++)
+    {
+        const size_t index = job->block_ids[i] % volume->n_stores;
+        if (!involved[index])
+        {
+            involved[index] = true;
+            touched++;
+            only = index;
+        }
+    }
+    if (touched <= 1)
+    {
+        free(involved);
+        return touched == 0 ? 0 : stripe_run_job(volume, only, job);
+    }
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->finished, NULL);
+    job->remaining = touched;
+    job->bytes = 0;
+    for (size_t index = 0; index < volume->n_stores; index++)
+    {
+        if (!involved[index])
+            continue;
+        stripe_t *stripe = &volume->stripes[index];
+        pthread_mutex_lock(&stripe->job_lock);
+        while (stripe->job != NULL)
+            pthread_cond_wait(&stripe->job_changed, &stripe->job_lock);
+        stripe->job = job;
+        pthread_cond_broadcast(&stripe->job_changed);
+        pthread_mutex_unlock(&stripe->job_lock);
+    }
+    free(involved);
+
+    pthread_mutex_lock(&job->lock);
+    while (job->remaining > 0)
+        pthread_cond_wait(&job->finished, &job->lock);
+    const size_t bytes = job->bytes;
+    pthread_mutex_unlock(&job->lock);
+    pthread_cond_destroy(&job->finished);
+    pthread_mutex_destroy(&job->lock);
+    return bytes;
+}
+
+size_t block_volume_readv(block_volume_t *const volume, const size_t *const block_ids, const size_t n, void *const *buffers)
+{
+    // check for invalid parameters
+    if (volume == NULL || block_ids == NULL || buffers == NULL)
+    {
+        return 0;
+    }
+
+    volume_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.write = false;
+    job.block_ids = block_ids;
+    job.n = n;
+    job.read_buffers = buffers;
+    return volume_run(volume, &job);
+}
+
+size_t block_volume_writev(block_volume_t *const volume, const size_t *const block_ids, const size_t n, const void *const *buffers)
+{
+    // check for invalid parameters
+    if (volume == NULL || block_ids == NULL || buffers == NULL)
+    {
+        return 0;
+    }
+
+    volume_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.write = true;
+    job.block_ids = block_ids;
+    job.n = n;
+    job.write_buffers = buffers;
+    return volume_run(volume, &job);
+}
+
+/// Writes a parity image to a file of its own
+/// \param parity The image, may be NULL if lost
+/// \param filename The file to write to
+/// \return Size of the image written, 0 on error
+static size_t parity_save(const uint8_t *const parity, const char *const filename)
+{
+    if (parity == NULL || filename == NULL)
+    {
+        return 0;
+    }
+    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (file == -1)
+    {
+        return 0;
+    }
+    size_t done = 0;
+    while (done < BLOCK_STORE_NUM_BYTES)
+    {
+        const ssize_t written = pwrite(file, parity + done, BLOCK_STORE_NUM_BYTES - done, done);
+        if (written <= 0)
+            break;
+        done += written;
+    }
+    const bool success = close(file) == 0 && done == BLOCK_STORE_NUM_BYTES;
+    return success ? BLOCK_STORE_NUM_BYTES : 0;
+}
+
+/// Reads a parity image back from its file
+/// \param filename The file
+/// \return The image, NULL if the file is missing, the wrong size or unreadable
+static uint8_t *parity_load(const char *const filename)
+{
+    int file = filename != NULL ? open(filename, O_RDONLY) : -1;
+    struct stat st;
+    if (file == -1 || fstat(file, &st) == -1 || st.st_size != BLOCK_STORE_NUM_BYTES)
+    {
+        if (file != -1)
+            close(file);
+        return NULL;
+    }
+    uint8_t *parity = (uint8_t *)aligned_alloc(64, BLOCK_STORE_NUM_BYTES);
+    size_t done = 0;
+    while (parity != NULL && done < BLOCK_STORE_NUM_BYTES)
+    {
+        const ssize_t result = pread(file, parity + done, BLOCK_STORE_NUM_BYTES - done, done);
+        if (result <= 0)
+            break;
+        done += result;
+    }
+    close(file);
+    if (done != BLOCK_STORE_NUM_BYTES)
+    {
+        free(parity);
+        return NULL;
+    }
+    return parity;
+}
+
+size_t block_volume_serialize(block_volume_t *const volume, const char *const *filenames)
+{
+    // check for invalid parameters
+    if (volume == NULL || filenames == NULL)
+    {
+        return 0;
+    }
+
+    // the stores and the parity are written at one point in time, or they could disagree
+    size_t total = 0;
+    volume_lock_all(volume);
+    for (size_t i = 0; i < volume->n_stores + volume->n_parity; i++)
+    {
+        const size_t bytes = i < volume->n_stores ? block_store_serialize(volume->stripes[i].bs, filenames[i])
+                                                  : parity_save(volume->parity[i - volume->n_stores], filenames[i]);
+        if (bytes == 0)
+        {
+            total = 0;
+            break;
+        }
+        total += bytes;
+    }
+    volume_unlock_all(volume);
+    return total;
+}
+
+block_volume_t *block_volume_deserialize(const char *const *filenames, const size_t n_stores, const block_volume_policy_t policy)
+{
+    return block_volume_deserialize_parity(filenames, n_stores, 0, policy);
+}
+
+block_volume_t *block_volume_deserialize_parity(const char *const *filenames, const size_t n_stores, const size_t n_parity,
+                                                const block_volume_policy_t policy)
+{
+    // check for invalid parameters
+    if (filenames == NULL || n_stores == 0 || n_parity > BLOCK_PARITY_MAX || (n_parity > 0 && n_stores > BLOCK_PARITY_MAX_DATA))
+    {
+        return NULL;
+    }
+
+    block_store_t **stores = (block_store_t **)calloc(n_stores, sizeof(block_store_t *));
+    if (stores == NULL)
+    {
+        return NULL;
+    }
+    uint8_t *parity[BLOCK_PARITY_MAX] = {NULL};
+    size_t lost = 0;
+    for (size_t i = 0; i < n_stores + n_parity && lost <= n_parity; i++)
+    {
+        if (i < n_stores)
+            stores[i] = block_store_deserialize(filenames[i]);
+        else
+            parity[i - n_stores] = parity_load(filenames[i]);
+        lost += i < n_stores ? stores[i] == NULL : parity[i - n_stores] == NULL;
+    }
+    if (lost > n_parity)
+    {
+        for (size_t i = 0; i < n_stores; i++)
+            block_store_destroy(stores[i]);
+        for (size_t p = 0; p < n_parity; p++)
+            free(parity[p]);
+        free(stores);
+        return NULL;
+    }
+
+    block_volume_t *volume = volume_assemble(stores, n_stores, policy);
+    free(stores);
+    if (volume == NULL)
+    {
+        for (size_t p = 0; p < n_parity; p++)
+            free(parity[p]);
+        return NULL;
+    }
+    volume->n_parity = n_parity;
+    memcpy(volume->parity, parity, sizeof(parity));
+    return volume;
+}
+
+size_t block_volume_rebuild(block_volume_t *const volume)
+{
+    // check for invalid parameters
+    if (volume == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    uint8_t **buffers = volume_buffers(volume, BLOCK_STORE_NUM_BLOCKS);
+    if (buffers == NULL)
+    {
+        return SIZE_MAX;
+    }
+    size_t rebuilt = 0;
+    volume_lock_all(volume);
+    if (count_missing(volume) == 0)
+    {
+        volume_unlock_all(volume);
+        free(buffers);
+        return 0;
+    }
+    if (!volume_gather(volume, 0, BLOCK_STORE_NUM_BLOCKS, buffers))
+    {
+        volume_unlock_all(volume);
+        free(buffers);
+        return SIZE_MAX;
+    }
+
+    for (size_t i = 0; i < volume->n_stores; i++)
+    {
+        if (volume->stripes[i].bs != NULL)
+            continue;
+        block_store_t *bs = block_store_create();
+        if (bs == NULL)
+            break;
+        // the bitmap goes first, then every block it says is allocated
+        const uint8_t *bitmap = buffers[i] + BITMAP_START_BLOCK * BLOCK_SIZE_BYTES;
+        block_store_write(bs, BITMAP_START_BLOCK, bitmap);
+        for (size_t local_id = 1; local_id < BLOCK_STORE_NUM_BLOCKS; local_id++)
+        {
+            if (local_id != BITMAP_START_BLOCK && bitmap_allocated(bitmap, local_id))
+                block_store_write(bs, local_id, buffers[i] + local_id * BLOCK_SIZE_BYTES);
+        }
+        volume->stripes[i].bs = bs;
+        rebuilt++;
+    }
+    for (size_t p = 0; p < volume->n_parity; p++)
+    {
+        if (volume->parity[p] != NULL)
+            continue;
+        volume->parity[p] = (uint8_t *)aligned_alloc(64, BLOCK_STORE_NUM_BYTES);
+        if (volume->parity[p] == NULL)
+            break;
+        memcpy(volume->parity[p], buffers[volume->n_stores + p], BLOCK_STORE_NUM_BYTES);
+        rebuilt++;
+    }
+    const bool whole = count_missing(volume) == 0;
+    volume_unlock_all(volume);
+    free(buffers);
+    return whole ? rebuilt : SIZE_MAX;
+}
+
+size_t block_volume_verify(block_volume_t *const volume)
+{
+    // check for invalid parameters
+    if (volume == NULL || volume->n_parity == 0)
+    {
+        return SIZE_MAX;
+    }
+
+    uint8_t **buffers = volume_buffers(volume, BLOCK_STORE_NUM_BLOCKS);
+    if (buffers == NULL)
+    {
+        return SIZE_MAX;
+    }
+    volume_lock_all(volume);
+    const bool whole = count_missing(volume) == 0;
+    if (whole)
+    {
+        volume_gather(volume, 0, BLOCK_STORE_NUM_BLOCKS, buffers);
+    }
+    volume_unlock_all(volume);
+    if (!whole)
+    {
+        free(buffers);
+        return SIZE_MAX;
+    }
+
+    // recompute into the buffers that held the kept parity, comparing against a copy of it
+    size_t mismatched = SIZE_MAX;
+    uint8_t *kept = (uint8_t *)malloc(volume->n_parity * BLOCK_STORE_NUM_BYTES);
+    if (kept != NULL)
+    {
+        for (size_t p = 0; p < volume->n_parity; p++)
+            memcpy(kept + p * BLOCK_STORE_NUM_BYTES, buffers[volume->n_stores + p], BLOCK_STORE_NUM_BYTES);
+        block_parity_encode((const void *const *)buffers, volume->n_stores, (void *const *)(buffers + volume->n_stores),
+                            volume->n_parity, BLOCK_STORE_NUM_BYTES);
+        mismatched = 0;
+        for (size_t row = 0; row < BLOCK_STORE_NUM_BLOCKS; row++)
+        {
+            bool differs = false;
+            for (size_t p = 0; p < volume->n_parity; p++)
+            {
+                differs = differs || memcmp(kept + p * BLOCK_STORE_NUM_BYTES + row * BLOCK_SIZE_BYTES,
+                                            buffers[volume->n_stores + p] + row * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES) != 0;
+            }
+            mismatched += differs;
+        }
+    }
+    free(kept);
+    free(buffers);
+    return mismatched;
+}
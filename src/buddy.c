@@ -0,0 +1,211 @@
+#include "buddy.h"
+#include <string.h>
+
+#define NIL SIZE_MAX
+#define NOT_FREE UINT8_MAX
+
+struct buddy 
+{
+    size_t n_blocks;
+    unsigned max_order;
+    size_t *head;       // first free extent of each order, NIL if none
+    size_t *next;       // free lists are doubly linked through the first block of each extent
+    size_t *prev;
+    uint8_t *order;     // order of the free extent starting at a block, NOT_FREE otherwise
+};
+
+static void list_push(buddy_t *const buddy, const size_t block, const unsigned order) 
+{
+    buddy->order[block] = order;
+    buddy->prev[block] = NIL;
+    buddy->next[block] = buddy->head[order];
+    if (buddy->head[order] != NIL) 
+    {
+        buddy->prev[buddy->head[order]] = block;
+    }
+    buddy->head[order] = block;
+}
+
+static void list_remove(buddy_t *const buddy, const size_t block) 
+{
+    const unsigned order = buddy->order[block];
+    if (buddy->prev[block] != NIL) 
+    {
+        buddy->next[buddy->prev[block]] = buddy->next[block];
+    } 
+    else 
+    {
+        buddy->head[order] = buddy->next[block];
+    }
+    if (buddy->next[block] != NIL) 
+    {
+        buddy->prev[buddy->next[block]] = buddy->prev[block];
+    }
+    buddy->order[block] = NOT_FREE;
+}
+
+buddy_t *buddy_create(const size_t n_blocks) 
+{
+    if (n_blocks == 0) 
+    {
+        return NULL;
+    }
+    buddy_t *buddy = (buddy_t *) calloc(1, sizeof(buddy_t));
+    if (buddy) 
+    {
+        buddy->n_blocks = n_blocks;
+        while (buddy->max_order + 1 < sizeof(size_t) * 8 && ((size_t) 2 << buddy->max_order) <= n_blocks) 
+        {
+            ++buddy->max_order;
+        }
+        buddy->head  = (size_t *) malloc((buddy->max_order + 1) * sizeof(size_t));
+        buddy->next  = (size_t *) malloc(n_blocks * sizeof(size_t));
+        buddy->prev  = (size_t *) malloc(n_blocks * sizeof(size_t));
+        buddy->order = (uint8_t *) malloc(n_blocks);
+        if (buddy->head && buddy->next && buddy->prev && buddy->order) 
+        {
+            for (unsigned order = 0; order <= buddy->max_order; ++order) 
+            {
+                buddy->head[order] = NIL;
+            }
+            memset(buddy->order, NOT_FREE, n_blocks);
+            return buddy;
+        }
+        buddy_destroy(buddy);
+    }
+    return NULL;
+}
+
+void buddy_destroy(buddy_t *buddy) 
+{
+    if (buddy) 
+    {
+        free(buddy->head);
+        free(buddy->next);
+        free(buddy->prev);
+        free(buddy->order);
+        free(buddy);
+    }
+}
+
+void buddy_rebuild(buddy_t *const buddy, const bitmap_t *const bitmap) 
+{
+    for (unsigned order = 0; order <= buddy->max_order; ++order) 
+    {
+        buddy->head[order] = NIL;
+    }
+    memset(buddy->order, NOT_FREE, buddy->n_blocks);
+
+    size_t block = 0;
+    while (block < buddy->n_blocks) 
+    {
+        if (bitmap_test(bitmap, block)) 
+        {
+            ++block;
+            continue;
+        }
+        // grow the extent while it stays aligned, in range and free
+        unsigned order = 0;
+        while (order < buddy->max_order && (block & (((size_t) 2 << order) - 1)) == 0 &&
+               block + ((size_t) 2 << order) <= buddy->n_blocks) 
+        {
+            const size_t size = (size_t) 1 << order;
+            size_t probe = block + size;
+            while (probe < block + 2 * size && !bitmap_test(bitmap, probe)) 
+            {
+                ++probe;
+            }
+            if (probe != block + 2 * size) 
+            {
+                break;
+            }
+            ++order;
+        }
+        list_push(buddy, block, order);
+        block += (size_t) 1 << order;
+    }
+}
+
+size_t buddy_alloc(buddy_t *const buddy, const unsigned order) 
+{
+    if (order > buddy->max_order) 
+    {
+        return SIZE_MAX;
+    }
+    unsigned found = order;
+    while (found <= buddy->max_order && buddy->head[found] == NIL) 
+    {
+        ++found;
+    }
+    if (found > buddy->max_order) 
+    {
+        return SIZE_MAX;
+    }
+
+    const size_t block = buddy->head[found];
+    list_remove(buddy, block);
+    // hand the upper halves back until the extent is the right size
+    while (found > order) 
+    {
+        --found;
+        list_push(buddy, block + ((size_t) 1 << found), found);
+    }
+    return block;
+}
+
+void buddy_free(buddy_t *const buddy, size_t block, unsigned order) 
+{
+    while (order < buddy->max_order) 
+    {
+        const size_t other = block ^ ((size_t) 1 << order);
+        if (other >= buddy->n_blocks || buddy->order[other] != order) 
+        {
+            break;
+        }
+        list_remove(buddy, other);
+        block &= ~((size_t) 1 << order);
+        ++order;
+    }
+    list_push(buddy, block, order);
+}
+
+bool buddy_claim(buddy_t *const buddy, const size_t block) 
+{
+    if (block >= buddy->n_blocks) 
+    {
+        return false;
+    }
+    // find the free extent holding the block, if there is one
+    for (unsigned order = 0; order <= buddy->max_order; ++order) 
+    {
+        size_t base = block & ~(((size_t) 1 << order) - 1);
+        if (buddy->order[base] != order) 
+        {
+            continue;
+        }
+
+        list_remove(buddy, base);
+        // split it, keeping the halves that don't hold the block on the free lists
+        while (order > 0) 
+        {
+            --order;
+            const size_t half = (size_t) 1 << order;
+            if (block >= base + half) 
+            {
+                list_push(buddy, base, order);
+                base += half;
+            } 
+            else 
+            {
+                list_push(buddy, base + half, order);
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+unsigned buddy_max_order(const buddy_t *const buddy) 
+{
+    return buddy->max_order;
+}
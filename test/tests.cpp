@@ -1,6 +1,25 @@
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bitmap.h"
 #include "block_store.h"
+#include "block_store.hpp"
+#include "block_volume.h"
+#include "block_parity.h"
+#include "block_async.h"
+#include "block_server.h"
+#include "block_client.h"
 //#include "./src/block_store.c"
 
 // The object is opaque, so we can't really test things directly....
@@ -222,7 +241,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -250,7 +269,7 @@ TEST(block_store_write_read, null_buffer_write) {
 TEST(block_store_write_read, null_bs_read) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_read(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
     score += 2;
@@ -484,3 +503,1618 @@ TEST(block_store_deserialize, null_filename)
     score += 2;
 }
 
+
+
+TEST(block_store_snapshot, snapshot_is_frozen)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    char before[BLOCK_SIZE_BYTES] = "before the snapshot";
+    char after[BLOCK_SIZE_BYTES] = "after the snapshot";
+    ASSERT_EQ(true, block_store_request(bs, 10));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, before));
+
+    block_store_t *snap = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snap) << "block_store_snapshot returned NULL when it should not have\n";
+
+    // Changes to the live store should not show up in the snapshot...
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, after));
+    ASSERT_EQ(true, block_store_request(bs, 11));
+
+    char read_buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snap, 10, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, before, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(1, block_store_get_used_blocks(snap));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, after, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+
+    // ...and the snapshot itself can't be modified.
+    ASSERT_EQ(0, block_store_write(snap, 10, after));
+    ASSERT_EQ(false, block_store_request(snap, 12));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(snap));
+
+    // Dropping the live store first must leave the snapshot intact.
+    block_store_destroy(bs);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snap, 10, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, before, BLOCK_SIZE_BYTES));
+    block_store_destroy(snap);
+}
+
+TEST(block_store_snapshot, clone_is_writable)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char original[BLOCK_SIZE_BYTES] = "original";
+    char changed[BLOCK_SIZE_BYTES] = "changed";
+    ASSERT_EQ(true, block_store_request(bs, 20));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 20, original));
+
+    block_store_t *clone = block_store_clone(bs);
+    ASSERT_NE(nullptr, clone) << "block_store_clone returned NULL when it should not have\n";
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(clone, 20, changed));
+    block_store_release(clone, 20);
+    ASSERT_EQ(0, block_store_get_used_blocks(clone));
+
+    char read_buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 20, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, original, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+
+    block_store_destroy(clone);
+    block_store_destroy(bs);
+}
+
+static void collect_block(size_t block_id, void *arg)
+{
+    static_cast<std::vector<size_t> *>(arg)->push_back(block_id);
+}
+
+TEST(block_store_snapshot, diff)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char data[BLOCK_SIZE_BYTES] = "data";
+    ASSERT_EQ(true, block_store_request(bs, 1));
+    ASSERT_EQ(true, block_store_request(bs, 2));
+    ASSERT_EQ(true, block_store_request(bs, 3));
+
+    block_store_t *first = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, first);
+    ASSERT_EQ(0, block_store_diff(first, bs, NULL, NULL));
+
+    // 1 is rewritten, 2 is freed, 200 is new, 3 is untouched
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 1, data));
+    block_store_release(bs, 2);
+    ASSERT_EQ(true, block_store_request(bs, 200));
+    block_store_t *second = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, second);
+
+    std::vector<size_t> changed;
+    ASSERT_EQ(3, block_store_diff(first, second, collect_block, &changed));
+    ASSERT_EQ((std::vector<size_t>{1, 2, 200}), changed);
+
+    ASSERT_EQ(SIZE_MAX, block_store_diff(first, NULL, NULL, NULL));
+
+    block_store_destroy(second);
+    block_store_destroy(first);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_snapshot, copy_range)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char data[BLOCK_SIZE_BYTES];
+    char back[BLOCK_SIZE_BYTES];
+    for (size_t block_id = 1; block_id < 120; block_id++) {
+        memset(data, (int)block_id, sizeof(data));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, block_id, data));
+    }
+
+    // overlapping ranges in both directions come out as memmove would leave them
+    ASSERT_EQ(20 * BLOCK_SIZE_BYTES, block_store_copy_range(bs, 10, bs, 5, 20));
+    for (size_t block_id = 10; block_id < 30; block_id++) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, block_id, back));
+        ASSERT_EQ((char)(block_id - 5), back[BLOCK_SIZE_BYTES - 1]) << "block " << block_id;
+    }
+    ASSERT_EQ(20 * BLOCK_SIZE_BYTES, block_store_copy_range(bs, 40, bs, 45, 20));
+    for (size_t block_id = 40; block_id < 60; block_id++) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, block_id, back));
+        ASSERT_EQ((char)(block_id + 5), back[0]) << "block " << block_id;
+    }
+
+    // whole chunks go to another store shared, and stay independent after a write
+    block_store_t *copy = block_store_create();
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(40 * BLOCK_SIZE_BYTES, block_store_copy_range(copy, 144, bs, 64, 40));
+    memset(data, 0xEE, sizeof(data));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 80, data));
+    for (size_t block_id = 144; block_id < 184; block_id++) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(copy, block_id, back));
+        ASSERT_EQ((char)(block_id - 80), back[0]) << "block " << block_id;
+    }
+    ASSERT_EQ(0, block_store_get_used_blocks(copy));
+
+    // the bitmap can't be copied over, snapshots can't be copied into
+    ASSERT_EQ(0, block_store_copy_range(copy, 120, bs, 1, 10));
+    ASSERT_EQ(0, block_store_copy_range(bs, 250, bs, 1, 10));
+    block_store_t *frozen = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, frozen);
+    ASSERT_EQ(0, block_store_copy_range(frozen, 1, bs, 2, 1));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_copy_range(copy, 1, frozen, 80, 1));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(copy, 1, back));
+    ASSERT_EQ((char)0xEE, back[0]);
+    block_store_destroy(frozen);
+
+    // concurrent stores copy block by block
+    block_store_config_t config = {BLOCK_STORE_CONCURRENT};
+    block_store_t *concurrent = block_store_create_ex(&config);
+    ASSERT_NE(nullptr, concurrent);
+    ASSERT_EQ(32 * BLOCK_SIZE_BYTES, block_store_copy_range(concurrent, 16, bs, 16, 32));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 47, data));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(concurrent, 47, back));
+    ASSERT_EQ(0, memcmp(data, back, BLOCK_SIZE_BYTES));
+
+    // an image copies without being loaded
+    ASSERT_EQ(true, block_store_request(copy, 150));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(copy, "copy_src.bs"));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_copy_image("copy_src.bs", "copy_dst.bs"));
+    ASSERT_EQ(0, block_store_copy_image("copy_src.bs", "copy_src.bs"));
+    block_store_t *loaded = block_store_deserialize("copy_dst.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(0, block_store_diff(copy, loaded, NULL, NULL));
+    block_store_destroy(loaded);
+    unlink("copy_src.bs");
+    unlink("copy_dst.bs");
+
+    block_store_destroy(concurrent);
+    block_store_destroy(copy);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_policy, buddy_extents)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_request(bs, 5));
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_POLICY_BUDDY));
+
+    // 8-block extents come back aligned, distinct and clear of 5 and the bitmap block
+    std::vector<size_t> extents;
+    for (size_t i = 0; i < 8; i++)
+    {
+        size_t id = block_store_allocate_extent(bs, 3);
+        ASSERT_NE(SIZE_MAX, id);
+        ASSERT_EQ(0, id % 8);
+        ASSERT_FALSE(id <= 5 && 5 < id + 8);
+        ASSERT_FALSE(id <= BITMAP_START_BLOCK && BITMAP_START_BLOCK < id + 8);
+        extents.push_back(id);
+    }
+    std::sort(extents.begin(), extents.end());
+    ASSERT_EQ(extents.end(), std::unique(extents.begin(), extents.end()));
+    ASSERT_EQ(1 + 8 * 8, block_store_get_used_blocks(bs));
+
+    // single blocks come from the leftover singles (4 and 126) before any extent is split
+    size_t id = block_store_allocate(bs);
+    ASSERT_TRUE(id == 4 || id == 126);
+    block_store_release(bs, id);
+
+    // freeing everything merges back up to the halves around the bitmap block
+    for (size_t extent : extents)
+    {
+        ASSERT_EQ(true, block_store_release_extent(bs, extent, 3));
+    }
+    block_store_release(bs, 5);
+    ASSERT_EQ(128, block_store_allocate_extent(bs, 7));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, 7));
+    ASSERT_EQ(false, block_store_release_extent(bs, 129, 1));
+    ASSERT_EQ(true, block_store_release_extent(bs, 128, 7));
+
+    // clones keep the policy, and switching back to first fit gives the lowest id
+    block_store_t *clone = block_store_clone(bs);
+    ASSERT_NE(nullptr, clone);
+    ASSERT_EQ(128, block_store_allocate_extent(clone, 7));
+    ASSERT_EQ(true, block_store_set_policy(clone, BLOCK_STORE_POLICY_FIRST_FIT));
+    ASSERT_EQ(0, block_store_allocate(clone));
+    ASSERT_EQ(8, block_store_allocate_extent(clone, 3));
+
+    block_store_destroy(clone);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_policy, release_extent_keeps_bitmap_block)
+{
+    const block_store_policy_t policies[] = {BLOCK_STORE_POLICY_FIRST_FIT, BLOCK_STORE_POLICY_BUDDY};
+    for (block_store_policy_t policy : policies)
+    {
+        block_store_t *bs = block_store_create();
+        ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+        ASSERT_EQ(true, block_store_set_policy(bs, policy));
+        ASSERT_EQ(true, block_store_request(bs, 3));
+        ASSERT_NE(SIZE_MAX, block_store_allocate_extent(bs, 4));
+
+        // the whole store as one extent frees everything but the bitmap's block
+        ASSERT_EQ(true, block_store_release_extent(bs, 0, 8));
+        ASSERT_EQ(0, block_store_get_used_blocks(bs));
+        ASSERT_EQ(true, block_store_check_used(bs));
+        ASSERT_EQ(false, block_store_request(bs, BITMAP_START_BLOCK));
+
+        size_t ids[BLOCK_STORE_NUM_BLOCKS];
+        ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - 1, block_store_allocate_n(bs, BLOCK_STORE_NUM_BLOCKS, ids, false));
+        ASSERT_EQ(ids + BLOCK_STORE_NUM_BLOCKS - 1, std::find(ids, ids + BLOCK_STORE_NUM_BLOCKS - 1, (size_t)BITMAP_START_BLOCK));
+        block_store_destroy(bs);
+    }
+}
+
+TEST(block_store_policy, allocate_near)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    for (size_t id = 0; id < 120; id++)
+    {
+        ASSERT_EQ(true, block_store_request(bs, id));
+    }
+    block_store_release(bs, 10);
+    block_store_release(bs, 40);
+    block_store_release(bs, 41);
+
+    // nearest free block, the one after the hint on a tie, searching across the bitmap block
+    ASSERT_EQ(10, block_store_allocate_near(bs, 12));
+    ASSERT_EQ(40, block_store_allocate_near(bs, 39));
+    ASSERT_EQ(120, block_store_allocate_near(bs, 100));
+    ASSERT_EQ(128, block_store_allocate_near(bs, 127));
+    ASSERT_EQ(255, block_store_allocate_near(bs, 1000));
+
+    // next fit carries on from the last allocation, near stays next to it
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_POLICY_NEXT_FIT));
+    ASSERT_EQ(121, block_store_allocate_near(bs, 121));
+    ASSERT_EQ(122, block_store_allocate(bs));
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_POLICY_NEAR));
+    ASSERT_EQ(129, block_store_allocate_near(bs, 129));
+    ASSERT_EQ(130, block_store_allocate(bs));
+
+    // best fit picks the single free block over the larger runs
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_POLICY_BEST_FIT));
+    ASSERT_EQ(41, block_store_allocate(bs));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_policy, allocate_n)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_request(bs, 1));
+    ASSERT_EQ(true, block_store_request(bs, 3));
+
+    size_t ids[BLOCK_STORE_NUM_BLOCKS];
+    ASSERT_EQ(4, block_store_allocate_n(bs, 4, ids, false));
+    ASSERT_EQ((std::vector<size_t>{0, 2, 4, 5}), std::vector<size_t>(ids, ids + 4));
+    ASSERT_EQ(6, block_store_get_used_blocks(bs));
+
+    // 249 blocks are left, the bitmap block is skipped
+    ASSERT_EQ(0, block_store_allocate_n(bs, 250, ids, true));
+    ASSERT_EQ(6, block_store_get_used_blocks(bs));
+    ASSERT_EQ(249, block_store_allocate_n(bs, 250, ids, false));
+    ASSERT_EQ(std::find(ids, ids + 249, (size_t)BITMAP_START_BLOCK), ids + 249);
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    ASSERT_EQ(0, block_store_allocate_n(bs, 1, ids, false));
+    ASSERT_EQ(0, block_store_allocate_n(bs, 1, NULL, false));
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_release, range_and_list)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char data[BLOCK_SIZE_BYTES];
+    memset(data, 0xAB, sizeof(data));
+    for (size_t id = 1; id < BLOCK_STORE_NUM_BLOCKS; id++)
+    {
+        if (id != BITMAP_START_BLOCK)
+        {
+            ASSERT_EQ(true, block_store_request(bs, id));
+            ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, data));
+        }
+    }
+    ASSERT_EQ(true, block_store_request(bs, 0));
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+
+    // 100..159 spans the bitmap block, which stays allocated and intact
+    ASSERT_EQ(true, block_store_release_range(bs, 100, 60, BLOCK_STORE_RELEASE_DISCARD));
+    ASSERT_EQ(255 - 59, block_store_get_used_blocks(bs));
+    char back[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 144, back));
+    ASSERT_EQ(0, back[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 99, back));
+    ASSERT_EQ((char)0xAB, back[0]);
+    ASSERT_EQ(100, block_store_allocate(bs));
+    ASSERT_EQ(128, block_store_allocate_near(bs, 127));
+
+    // the snapshot still sees the old contents
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snapshot, 144, back));
+    ASSERT_EQ((char)0xAB, back[0]);
+
+    const size_t ids[] = {5, 7, BITMAP_START_BLOCK, 250};
+    ASSERT_EQ(true, block_store_release_list(bs, ids, 4, BLOCK_STORE_RELEASE_ZERO));
+    ASSERT_EQ(5, block_store_allocate(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 7, back));
+    ASSERT_EQ(0, back[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 6, back));
+    ASSERT_EQ((char)0xAB, back[0]);
+
+    const size_t bad[] = {1, 256};
+    ASSERT_EQ(false, block_store_release_list(bs, bad, 2, 0));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 1, back));
+    ASSERT_EQ(false, block_store_release_range(bs, 200, 57, 0));
+    ASSERT_EQ(false, block_store_release_range(snapshot, 1, 1, 0));
+
+    block_store_destroy(snapshot);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_hints, prefetch_and_advise)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char data[BLOCK_SIZE_BYTES] = "advised";
+    char back[BLOCK_SIZE_BYTES] = {0};
+    ASSERT_EQ(true, block_store_request(bs, 20));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 20, data));
+
+    // hints never change what is read
+    const size_t ids[] = {20, 21, 1000};
+    block_store_prefetch(bs, ids, 3);
+    block_store_prefetch(NULL, ids, 3);
+    const block_store_advice_t advice[] = {BLOCK_STORE_ADVICE_SEQUENTIAL, BLOCK_STORE_ADVICE_RANDOM,
+                                           BLOCK_STORE_ADVICE_WILLNEED, BLOCK_STORE_ADVICE_DONTNEED,
+                                           BLOCK_STORE_ADVICE_NORMAL};
+    for (block_store_advice_t hint : advice)
+    {
+        ASSERT_EQ(true, block_store_advise(bs, 0, BLOCK_STORE_NUM_BLOCKS, hint));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 20, back));
+        ASSERT_STREQ(data, back);
+    }
+    ASSERT_EQ(true, block_store_advise(bs, 250, 6, BLOCK_STORE_ADVICE_SEQUENTIAL));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 255, back));
+    ASSERT_EQ(false, block_store_advise(bs, 250, 7, BLOCK_STORE_ADVICE_SEQUENTIAL));
+    ASSERT_EQ(false, block_store_advise(bs, 0, 0, BLOCK_STORE_ADVICE_SEQUENTIAL));
+
+    block_store_destroy(bs);
+}
+
+static void count_move(size_t from, size_t to, void *arg)
+{
+    EXPECT_LT(to, from);
+    ++*static_cast<size_t *>(arg);
+}
+
+TEST(block_store_compact, fragmentation_and_compaction)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    // every third block from 3 on, each holding its own id
+    std::vector<size_t> owners;
+    for (size_t id = 3; id < BLOCK_STORE_NUM_BLOCKS; id += 3)
+    {
+        if (block_store_request(bs, id))
+        {
+            char data[BLOCK_SIZE_BYTES] = {0};
+            memcpy(data, &id, sizeof(id));
+            ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, data));
+            owners.push_back(id);
+        }
+    }
+
+    block_store_fragmentation_t report;
+    ASSERT_EQ(false, block_store_fragmentation_report(NULL, &report));
+    ASSERT_EQ(true, block_store_fragmentation_report(bs, &report));
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - owners.size() - 1, report.free_blocks);
+    ASSERT_EQ(3, report.largest_free_extent);
+    ASSERT_EQ(owners.size(), report.used_extents);  // 126 and 127 make one run
+    ASSERT_EQ(report.free_extents, report.free_extent_histogram[0] + report.free_extent_histogram[1]);
+
+    // compact a few blocks at a time, owners following through the map
+    std::vector<size_t> map(BLOCK_STORE_NUM_BLOCKS, SIZE_MAX);
+    size_t calls = 0, moves = 0, moved;
+    while ((moved = block_store_compact(bs, 8, map.data(), count_move, &moves)) != 0)
+    {
+        ASSERT_NE(SIZE_MAX, moved);
+        ASSERT_LE(moved, 8);
+        calls++;
+    }
+    ASSERT_GT(calls, 1);
+    ASSERT_EQ(owners.size(), block_store_get_used_blocks(bs));
+    for (size_t &owner : owners)
+    {
+        const size_t original = owner;
+        if (map[owner] != SIZE_MAX)
+        {
+            owner = map[owner];
+            moves--;
+        }
+        size_t id = 0;
+        char back[BLOCK_SIZE_BYTES];
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, owner, back));
+        memcpy(&id, back, sizeof(id));
+        ASSERT_EQ(original, id);
+        ASSERT_EQ(false, block_store_request(bs, owner));
+    }
+    ASSERT_EQ(0, moves);
+
+    // everything now sits in one run after block 0, apart from the bitmap's block,
+    //  leaving all of the store above the bitmap free in one piece
+    ASSERT_EQ(true, block_store_fragmentation_report(bs, &report));
+    ASSERT_EQ(2, report.used_extents);
+    ASSERT_EQ(3, report.free_extents);
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_START_BLOCK - 1, report.largest_free_extent);
+    ASSERT_EQ(SIZE_MAX, block_store_compact(NULL, 1, NULL, NULL, NULL));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_policy, used_count_follows_every_change)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_check_used(NULL));
+    size_t expected = 0;
+
+    ASSERT_NE(SIZE_MAX, block_store_allocate(bs));
+    ASSERT_EQ(true, block_store_request(bs, 50));
+    ASSERT_EQ(false, block_store_request(bs, 50));
+    expected += 2;
+    size_t ids[10];
+    ASSERT_EQ(10, block_store_allocate_n(bs, 10, ids, true));
+    expected += 10;
+    ASSERT_NE(SIZE_MAX, block_store_allocate_near(bs, 200));
+    ASSERT_NE(SIZE_MAX, block_store_allocate_extent(bs, 3));
+    expected += 9;
+    ASSERT_EQ(expected, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - expected, block_store_get_free_blocks(bs));
+    ASSERT_EQ(true, block_store_check_used(bs));
+
+    block_store_release(bs, 50);
+    block_store_release(bs, 50);
+    ASSERT_EQ(true, block_store_release_list(bs, ids, 4, 0));
+    expected -= 5;
+    ASSERT_EQ(expected, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_release_range(bs, 0, BLOCK_STORE_NUM_BLOCKS / 2, 0));
+    ASSERT_EQ(true, block_store_check_used(bs));
+    expected = block_store_get_used_blocks(bs);
+    ASSERT_EQ(true, block_store_set_policy(bs, BLOCK_STORE_POLICY_BUDDY));
+    size_t extent = block_store_allocate_extent(bs, 2);
+    ASSERT_NE(SIZE_MAX, extent);
+    ASSERT_EQ(expected + 4, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_release_extent(bs, extent, 2));
+    ASSERT_EQ(expected, block_store_get_used_blocks(bs));
+
+    // a snapshot starts from the same count and the two go their own ways
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    ASSERT_EQ(true, block_store_request(bs, 10));
+    ASSERT_EQ(expected, block_store_get_used_blocks(snapshot));
+    ASSERT_EQ(expected + 1, block_store_get_used_blocks(bs));
+    block_store_destroy(snapshot);
+
+    // overwriting the bitmap block or loading an image replaces the bitmap wholesale
+    char bitmap[BLOCK_SIZE_BYTES];
+    memset(bitmap, 0, sizeof(bitmap));
+    bitmap[0] = 0x0F;
+    bitmap[BITMAP_START_BLOCK / 8] = 1 << (BITMAP_START_BLOCK % 8);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, BITMAP_START_BLOCK, bitmap));
+    ASSERT_EQ(4, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_check_used(bs));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(4, block_store_get_used_blocks(bs));
+    ASSERT_EQ(true, block_store_check_used(bs));
+    block_store_destroy(bs);
+}
+
+TEST(bitmap, search_from)
+{
+    bitmap_t *bitmap = bitmap_create(200);
+    ASSERT_NE(nullptr, bitmap);
+    for (size_t bit = 3; bit < 190; bit++)
+    {
+        bitmap_set(bitmap, bit);
+    }
+    ASSERT_EQ(0, bitmap_ffz(bitmap));
+    ASSERT_EQ(3, bitmap_ffs(bitmap));
+    ASSERT_EQ(190, bitmap_ffz_from(bitmap, 3));
+    ASSERT_EQ(2, bitmap_flz_from(bitmap, 189));
+    ASSERT_EQ(199, bitmap_flz_from(bitmap, 1000));
+    ASSERT_EQ(100, bitmap_ffs_from(bitmap, 100));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs_from(bitmap, 190));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(bitmap, 200));
+
+    bitmap_set(bitmap, 0);
+    bitmap_set(bitmap, 1);
+    bitmap_set(bitmap, 2);
+    ASSERT_EQ(SIZE_MAX, bitmap_flz_from(bitmap, 189));
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(bitmap, 5));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_cpp, allocate_and_iterate)
+{
+    typedef BlockStore<100, 64> store_t;
+    static_assert(store_t::num_bytes == 6400, "geometry is compile time");
+    store_t bs;
+    ASSERT_TRUE(bs.valid());
+    ASSERT_EQ(0, bs.allocate());
+    ASSERT_EQ(true, bs.request(99));
+    ASSERT_EQ(false, bs.request(99));
+    ASSERT_EQ(false, bs.request(100));
+    ASSERT_EQ(true, bs.request(64));
+
+    char data[64] = "sixty-four";
+    char back[64] = {0};
+    ASSERT_EQ(64, bs.write(64, data));
+    ASSERT_EQ(64, bs.read(64, back));
+    ASSERT_STREQ(data, back);
+    ASSERT_EQ('s', bs.block(64)[0]);
+    ASSERT_FALSE(bs.block(100));
+    ASSERT_EQ(0, bs.read(100, back));
+
+    ASSERT_EQ((std::vector<size_t>{0, 64, 99}), std::vector<size_t>(bs.begin(), bs.end()));
+    ASSERT_EQ(3, bs.used_blocks());
+    ASSERT_EQ(97, bs.free_blocks());
+
+    // the last word is only partly in the store
+    for (size_t i = 3; i < 100; i++)
+    {
+        ASSERT_NE(SIZE_MAX, bs.allocate());
+    }
+    ASSERT_EQ(SIZE_MAX, bs.allocate());
+    ASSERT_EQ(true, bs.release(70));
+    ASSERT_EQ(70, bs.allocate());
+
+    // moving hands over the blocks without copying them
+    store_t moved(std::move(bs));
+    ASSERT_FALSE(bs.valid());
+    ASSERT_EQ(SIZE_MAX, bs.allocate());
+    ASSERT_EQ(100, moved.used_blocks());
+    ASSERT_EQ('s', moved.block(64)[0]);
+}
+
+TEST(block_store_arena, create_ex)
+{
+    const unsigned flag_sets[] = {0, BLOCK_STORE_ARENA_PREFAULT, BLOCK_STORE_ARENA_HUGEPAGES | BLOCK_STORE_ARENA_PREFAULT};
+    for (unsigned flags : flag_sets)
+    {
+        block_store_config_t config = {flags};
+        block_store_t *bs = block_store_create_ex(&config);
+        ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+        char data[BLOCK_SIZE_BYTES] = "in the arena";
+        char back[BLOCK_SIZE_BYTES] = {0};
+        ASSERT_EQ(true, block_store_request(bs, 200));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 200, data));
+
+        // the snapshot keeps the arena mapped after the store is gone
+        block_store_t *snapshot = block_store_snapshot(bs);
+        ASSERT_NE(nullptr, snapshot);
+        block_store_destroy(bs);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snapshot, 200, back));
+        ASSERT_STREQ(data, back);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snapshot, 201, back));
+        ASSERT_EQ(0, back[0]);
+        block_store_destroy(snapshot);
+    }
+}
+
+TEST(block_store_arena, concurrent_reads_never_torn)
+{
+    block_store_config_t config = {BLOCK_STORE_CONCURRENT};
+    block_store_t *bs = block_store_create_ex(&config);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_request(bs, 1));
+
+    // every write fills the block with one byte value, so a torn read shows two
+    std::atomic<bool> done(false);
+    std::atomic<size_t> torn(0);
+    std::vector<std::thread> threads;
+    for (int writer = 0; writer < 2; writer++)
+    {
+        threads.emplace_back([&, writer]() {
+            char data[BLOCK_SIZE_BYTES];
+            for (int i = 0; i < 20000; i++)
+            {
+                memset(data, writer * 100 + i % 100, sizeof(data));
+                block_store_write(bs, 1, data);
+            }
+        });
+    }
+    for (int reader = 0; reader < 2; reader++)
+    {
+        threads.emplace_back([&]() {
+            char data[BLOCK_SIZE_BYTES];
+            while (!done)
+            {
+                block_store_read(bs, 1, data);
+                if (std::count(data, data + BLOCK_SIZE_BYTES, data[0]) != BLOCK_SIZE_BYTES)
+                {
+                    torn++;
+                }
+            }
+        });
+    }
+    threads[0].join();
+    threads[1].join();
+    done = true;
+    threads[2].join();
+    threads[3].join();
+    ASSERT_EQ(0, torn.load());
+    block_store_destroy(bs);
+}
+
+TEST(block_store_arena, sparse_store)
+{
+    const size_t chunk_bytes = 16 * BLOCK_SIZE_BYTES;
+    block_store_config_t bad = {BLOCK_STORE_SPARSE | BLOCK_STORE_CONCURRENT};
+    ASSERT_EQ(nullptr, block_store_create_ex(&bad));
+
+    block_store_config_t config = {BLOCK_STORE_SPARSE};
+    block_store_t *bs = block_store_create_ex(&config);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(chunk_bytes, block_store_get_resident_bytes(bs));
+
+    // reading a block nobody wrote costs nothing
+    char data[BLOCK_SIZE_BYTES] = "sparse";
+    char back[BLOCK_SIZE_BYTES];
+    memset(back, 0xFF, sizeof(back));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 40, back));
+    ASSERT_EQ(0, back[0]);
+    ASSERT_EQ(0, back[BLOCK_SIZE_BYTES - 1]);
+    ASSERT_EQ(chunk_bytes, block_store_get_resident_bytes(bs));
+
+    ASSERT_EQ(true, block_store_request(bs, 40));
+    ASSERT_EQ(true, block_store_request(bs, 41));
+    ASSERT_EQ(true, block_store_request(bs, 200));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 40, data));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 200, data));
+    ASSERT_EQ(3 * chunk_bytes, block_store_get_resident_bytes(bs));
+
+    // the image round-trips through a dense store
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "sparse.bs"));
+    block_store_t *loaded = block_store_deserialize("sparse.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, 200, back));
+    ASSERT_STREQ(data, back);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, 100, back));
+    ASSERT_EQ(0, back[0]);
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(loaded));
+    block_store_destroy(loaded);
+    unlink("sparse.bs");
+
+    // a chunk goes away with the last block allocated in it, and reads as zero after
+    block_store_release(bs, 40);
+    ASSERT_EQ(3 * chunk_bytes, block_store_get_resident_bytes(bs));
+    block_store_release(bs, 41);
+    ASSERT_EQ(2 * chunk_bytes, block_store_get_resident_bytes(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 40, back));
+    ASSERT_EQ(0, back[0]);
+    ASSERT_EQ(true, block_store_release_range(bs, 192, 16, 0));
+    ASSERT_EQ(chunk_bytes, block_store_get_resident_bytes(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_arena, shared_across_processes)
+{
+    const std::string name = "/hw3_test_" + std::to_string(getpid());
+    block_store_t *bs = block_store_create_shared(name.c_str(), NULL);
+    ASSERT_NE(nullptr, bs) << "block_store_create_shared returned NULL when it should not have\n";
+    ASSERT_EQ(nullptr, block_store_snapshot(bs));
+    ASSERT_EQ(false, block_store_set_policy(bs, BLOCK_STORE_POLICY_BUDDY));
+    ASSERT_EQ(true, block_store_request(bs, 0));
+    ASSERT_EQ(true, block_store_request(bs, 1));
+
+    // two processes allocating at once never get the same block
+    std::vector<pid_t> children;
+    for (int child = 0; child < 2; child++)
+    {
+        pid_t pid = fork();
+        ASSERT_NE(-1, pid);
+        if (pid == 0)
+        {
+            block_store_t *attached = block_store_create_shared(name.c_str(), NULL);
+            char data[BLOCK_SIZE_BYTES];
+            memset(data, 'A' + child, sizeof(data));
+            bool ok = attached != NULL;
+            for (int i = 0; ok && i < 100; i++)
+            {
+                size_t id = block_store_allocate(attached);
+                ok = id != SIZE_MAX && block_store_write(attached, id, data) == BLOCK_SIZE_BYTES;
+            }
+            _exit(ok ? 0 : 1);
+        }
+        children.push_back(pid);
+    }
+    for (pid_t pid : children)
+    {
+        int status = 0;
+        ASSERT_EQ(pid, waitpid(pid, &status, 0));
+        ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    ASSERT_EQ(202, block_store_get_used_blocks(bs));
+    size_t written[2] = {0, 0};
+    char back[BLOCK_SIZE_BYTES];
+    for (size_t id = 2; id < BLOCK_STORE_NUM_BLOCKS; id++)
+    {
+        if (block_store_read(bs, id, back) == BLOCK_SIZE_BYTES && (back[0] == 'A' || back[0] == 'B'))
+        {
+            written[back[0] - 'A']++;
+        }
+    }
+    ASSERT_EQ(100, written[0]);
+    ASSERT_EQ(100, written[1]);
+
+    // a writer killed at any point, even holding the write lock, doesn't wedge the others
+    pid_t writer = fork();
+    ASSERT_NE(-1, writer);
+    if (writer == 0)
+    {
+        block_store_t *attached = block_store_create_shared(name.c_str(), NULL);
+        char data[BLOCK_SIZE_BYTES] = {0};
+        for (;;)
+        {
+            block_store_write(attached, 1, data);
+        }
+    }
+    usleep(20000);
+    kill(writer, SIGKILL);
+    waitpid(writer, NULL, 0);
+    char data[BLOCK_SIZE_BYTES] = "after the crash";
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 1, data));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 1, back));
+    ASSERT_STREQ(data, back);
+
+    block_store_destroy(bs);
+    ASSERT_EQ(true, block_store_unlink_shared(name.c_str()));
+    ASSERT_EQ(false, block_store_unlink_shared(name.c_str()));
+}
+
+TEST(block_store_serialize, sparse_image)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char stale[BLOCK_SIZE_BYTES] = "free blocks are not saved";
+    char kept[BLOCK_SIZE_BYTES] = "allocated blocks are";
+
+    // Block 50 is written while allocated, then again after it is freed.
+    ASSERT_EQ(true, block_store_request(bs, 50));
+    ASSERT_EQ(true, block_store_request(bs, 51));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 50, stale));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 51, kept));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "sparse.bs"));
+    block_store_release(bs, 50);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "sparse.bs"));
+    block_store_destroy(bs);
+
+    // Full length, but only the allocated pages take up space.
+    struct stat st;
+    ASSERT_EQ(0, stat("sparse.bs", &st));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, st.st_size);
+    ASSERT_LT(st.st_blocks * 512, BLOCK_STORE_NUM_BYTES);
+
+    bs = block_store_deserialize("sparse.bs");
+    ASSERT_NE(nullptr, bs) << "block_store_deserialize returned a null pointer\n";
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+
+    char read_buffer[BLOCK_SIZE_BYTES];
+    char zeroes[BLOCK_SIZE_BYTES] = {0};
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 51, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, kept, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 50, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, zeroes, BLOCK_SIZE_BYTES)) << "stale data from the old image was not discarded\n";
+    block_store_destroy(bs);
+    unlink("sparse.bs");
+}
+
+static ssize_t string_write(void *arg, const void *buffer, size_t length)
+{
+    static_cast<std::string *>(arg)->append(static_cast<const char *>(buffer), length);
+    return length;
+}
+
+struct string_reader
+{
+    std::string data;
+    size_t offset;
+};
+
+static ssize_t string_read(void *arg, void *buffer, size_t length)
+{
+    string_reader *reader = static_cast<string_reader *>(arg);
+    // Hand out small pieces to make sure partial reads are handled.
+    length = std::min(length, std::min<size_t>(100, reader->data.size() - reader->offset));
+    memcpy(buffer, reader->data.data() + reader->offset, length);
+    reader->offset += length;
+    return length;
+}
+
+static void record_progress(size_t done, size_t expected, void *arg)
+{
+    static_cast<std::vector<std::pair<size_t, size_t>> *>(arg)->push_back(std::make_pair(done, expected));
+}
+
+TEST(block_store_serialize, superblock)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_request(bs, 10));
+    ASSERT_EQ(true, block_store_request(bs, 11));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "super.bs"));
+
+    block_store_superblock_t superblock;
+    ASSERT_EQ(true, block_store_read_superblock("super.bs", &superblock));
+    ASSERT_EQ(BLOCK_STORE_SUPER_VERSION, superblock.version);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, superblock.block_size);
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, superblock.block_count);
+    ASSERT_EQ(block_store_get_used_blocks(bs), superblock.used_blocks);
+    block_store_destroy(bs);
+
+    // the superblock is not part of the loaded bitmap block
+    bs = block_store_deserialize("super.bs");
+    ASSERT_NE(nullptr, bs) << "block_store_deserialize returned a null pointer\n";
+    char bitmap_block[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, BITMAP_START_BLOCK, bitmap_block));
+    ASSERT_EQ(0, bitmap_block[BITMAP_SIZE_BYTES]);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "super.bs"));
+    block_store_destroy(bs);
+
+    // an unknown feature flag or a bad checksum is refused
+    int file = open("super.bs", O_RDWR);
+    ASSERT_NE(-1, file);
+    superblock.features = BLOCK_STORE_FEATURE_JOURNAL;
+    ASSERT_EQ(sizeof(superblock), pwrite(file, &superblock, sizeof(superblock), BLOCK_STORE_SUPER_OFFSET));
+    ASSERT_EQ(false, block_store_read_superblock("super.bs", NULL));
+    ASSERT_EQ(nullptr, block_store_deserialize("super.bs"));
+    ASSERT_EQ(nullptr, block_store_deserialize_parallel("super.bs", 2));
+
+    // an image from before superblocks loads, but only if it is complete
+    memset(&superblock, 0, sizeof(superblock));
+    ASSERT_EQ(sizeof(superblock), pwrite(file, &superblock, sizeof(superblock), BLOCK_STORE_SUPER_OFFSET));
+    ASSERT_EQ(false, block_store_read_superblock("super.bs", NULL));
+    bs = block_store_deserialize("super.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+    ASSERT_EQ(0, ftruncate(file, BLOCK_STORE_NUM_BYTES - BLOCK_SIZE_BYTES));
+    ASSERT_EQ(nullptr, block_store_deserialize("super.bs"));
+    close(file);
+    unlink("super.bs");
+}
+
+TEST(block_store_stream, callback_round_trip)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char data[BLOCK_SIZE_BYTES];
+    for (size_t id = 10; id < 40; id++) {
+        memset(data, (int) id, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(true, block_store_request(bs, id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, data));
+    }
+
+    std::string stream;
+    std::vector<std::pair<size_t, size_t>> progress;
+    size_t streamed = block_store_serialize_stream(bs, string_write, &stream, record_progress, &progress);
+    ASSERT_EQ(stream.size(), streamed);
+    ASSERT_LT(streamed, 30 * BLOCK_SIZE_BYTES + 1024) << "stream should only carry allocated blocks\n";
+    ASSERT_FALSE(progress.empty());
+    ASSERT_EQ(progress.back().first, progress.back().second);
+    block_store_destroy(bs);
+
+    string_reader reader = {stream, 0};
+    bs = block_store_deserialize_stream(string_read, &reader, NULL, NULL);
+    ASSERT_NE(nullptr, bs) << "block_store_deserialize_stream returned a null pointer\n";
+    ASSERT_EQ(30, block_store_get_used_blocks(bs));
+    char read_buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 10; id < 40; id++) {
+        memset(data, (int) id, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, data, BLOCK_SIZE_BYTES));
+    }
+    block_store_destroy(bs);
+
+    // A stream cut short must be rejected.
+    reader.data = stream.substr(0, stream.size() - 1);
+    reader.offset = 0;
+    ASSERT_EQ(nullptr, block_store_deserialize_stream(string_read, &reader, NULL, NULL));
+}
+
+TEST(block_store_stream, rejects_blocks_the_bitmap_does_not_allocate)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_request(bs, 10));
+    ASSERT_EQ(true, block_store_request(bs, 11));
+    std::string stream;
+    ASSERT_NE(0, block_store_serialize_stream(bs, string_write, &stream, NULL, NULL));
+    block_store_destroy(bs);
+
+    // the bitmap follows the first 20-byte frame header
+    const size_t bitmap_offset = 20;
+    string_reader intact = {stream, 0};
+    bs = block_store_deserialize_stream(string_read, &intact, NULL, NULL);
+    ASSERT_NE(nullptr, bs);
+    block_store_destroy(bs);
+
+    // block 11 is sent but no longer allocated
+    string_reader freed = {stream, 0};
+    freed.data[bitmap_offset + 11 / 8] &= ~(1 << (11 % 8));
+    ASSERT_EQ(nullptr, block_store_deserialize_stream(string_read, &freed, NULL, NULL));
+
+    // block 12 is allocated but never sent, so the END count falls short
+    string_reader missing = {stream, 0};
+    missing.data[bitmap_offset + 12 / 8] |= 1 << (12 % 8);
+    ASSERT_EQ(nullptr, block_store_deserialize_stream(string_read, &missing, NULL, NULL));
+}
+
+TEST(block_store_stream, pipe_round_trip)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char data[BLOCK_SIZE_BYTES] = "through a pipe";
+    ASSERT_EQ(true, block_store_request(bs, 5));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 5, data));
+
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    ASSERT_NE(0, block_store_serialize_fd(bs, fds[1]));
+    close(fds[1]);
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize_fd(fds[0]);
+    close(fds[0]);
+    ASSERT_NE(nullptr, bs) << "block_store_deserialize_fd returned a null pointer\n";
+    char read_buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, data, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(false, block_store_request(bs, 5));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(0, block_store_serialize_fd(NULL, 1));
+    ASSERT_EQ(nullptr, block_store_deserialize_fd(-1));
+}
+
+TEST(block_store_stats, counts_operations)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    block_store_stats_t stats;
+    if (!block_store_get_stats(bs, &stats)) {
+        block_store_destroy(bs);
+        GTEST_SKIP() << "statistics are compiled out\n";
+    }
+    // Creating the store doesn't count as a request.
+    ASSERT_EQ(0, stats.ops[BLOCK_STORE_OP_REQUEST].calls);
+
+    char buffer[BLOCK_SIZE_BYTES] = "counted";
+    size_t id = block_store_allocate(bs);
+    ASSERT_EQ(true, block_store_request(bs, 100));
+    ASSERT_EQ(false, block_store_request(bs, 100));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 100, buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 100, buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 100, buffer));
+    block_store_release(bs, id);
+
+    ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+    ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_ALLOCATE].calls);
+    ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_FFZ].calls);
+    ASSERT_EQ(2, stats.ops[BLOCK_STORE_OP_REQUEST].calls);
+    ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_REQUEST].failures);
+    ASSERT_EQ(1, stats.ops[BLOCK_STORE_OP_RELEASE].calls);
+    ASSERT_EQ(2, stats.ops[BLOCK_STORE_OP_READ].calls);
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, stats.ops[BLOCK_STORE_OP_READ].bytes);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, stats.ops[BLOCK_STORE_OP_WRITE].bytes);
+
+    uint64_t histogram_total = 0;
+    for (size_t bucket = 0; bucket < BLOCK_STORE_LATENCY_BUCKETS; bucket++) {
+        histogram_total += stats.ops[BLOCK_STORE_OP_READ].latency_ns[bucket];
+    }
+    ASSERT_EQ(2, histogram_total);
+
+    block_store_reset_stats(bs);
+    ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+    ASSERT_EQ(0, stats.ops[BLOCK_STORE_OP_READ].calls);
+
+    ASSERT_EQ(false, block_store_get_stats(NULL, &stats));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_stats, counts_failed_deserializes)
+{
+    block_store_stats_t stats;
+    if (!block_store_get_process_stats(&stats)) {
+        GTEST_SKIP() << "statistics are compiled out\n";
+    }
+    block_store_reset_process_stats();
+
+    ASSERT_EQ(nullptr, block_store_deserialize("no_such_image.bs"));
+    FILE *truncated = fopen("truncated.bs", "wb");
+    ASSERT_NE(nullptr, truncated);
+    fputs("too short", truncated);
+    fclose(truncated);
+    ASSERT_EQ(nullptr, block_store_deserialize("truncated.bs"));
+    unlink("truncated.bs");
+
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "counted.bs"));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("counted.bs");
+    unlink("counted.bs");
+    ASSERT_NE(nullptr, bs);
+
+    ASSERT_EQ(true, block_store_get_process_stats(&stats));
+    ASSERT_EQ(3, stats.ops[BLOCK_STORE_OP_DESERIALIZE].calls);
+    ASSERT_EQ(2, stats.ops[BLOCK_STORE_OP_DESERIALIZE].failures);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, stats.ops[BLOCK_STORE_OP_DESERIALIZE].bytes);
+    // The loaded store starts with no counts of its own.
+    ASSERT_EQ(true, block_store_get_stats(bs, &stats));
+    ASSERT_EQ(0, stats.ops[BLOCK_STORE_OP_DESERIALIZE].calls);
+
+    block_store_reset_process_stats();
+    ASSERT_EQ(true, block_store_get_process_stats(&stats));
+    ASSERT_EQ(0, stats.ops[BLOCK_STORE_OP_DESERIALIZE].calls);
+    ASSERT_EQ(false, block_store_get_process_stats(NULL));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_trace, records_calls)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_trace_start(bs, "test.trace"));
+    ASSERT_EQ(false, block_store_trace_start(bs, "test.trace")) << "a second trace should be refused\n";
+
+    char buffer[BLOCK_SIZE_BYTES] = "traced";
+    size_t id = block_store_allocate(bs);
+    ASSERT_EQ(true, block_store_request(bs, 42));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 42, buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 42, buffer));
+    block_store_release(bs, id);
+    ASSERT_EQ(true, block_store_trace_stop(bs));
+    // Calls after stopping are not recorded.
+    block_store_release(bs, 42);
+    block_store_destroy(bs);
+
+    FILE *file = fopen("test.trace", "rb");
+    ASSERT_NE(nullptr, file);
+    block_store_trace_header_t header;
+    ASSERT_EQ(1, fread(&header, sizeof(header), 1, file));
+    ASSERT_EQ(BLOCK_STORE_TRACE_MAGIC, header.magic);
+    ASSERT_EQ(sizeof(block_store_trace_record_t), header.record_bytes);
+    std::vector<block_store_trace_record_t> records(10);
+    ASSERT_EQ(5, fread(records.data(), sizeof(block_store_trace_record_t), records.size(), file));
+    fclose(file);
+    unlink("test.trace");
+
+    const uint8_t ops[] = {BLOCK_STORE_OP_ALLOCATE, BLOCK_STORE_OP_REQUEST, BLOCK_STORE_OP_WRITE,
+                           BLOCK_STORE_OP_READ, BLOCK_STORE_OP_RELEASE};
+    for (size_t i = 0; i < 5; i++) {
+        ASSERT_EQ(ops[i], records[i].op);
+        ASSERT_EQ(1, records[i].success);
+        if (i > 0) {
+            ASSERT_LE(records[i - 1].timestamp_ns, records[i].timestamp_ns);
+        }
+    }
+    ASSERT_EQ(id, records[0].block_id);
+    ASSERT_EQ(42, records[1].block_id);
+}
+
+// Replays the requests and releases of a trace onto a new store, as hw3_replay would.
+static block_store_t *replay_requests(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    block_store_trace_header_t header;
+    if (!file || fread(&header, sizeof(header), 1, file) != 1) {
+        if (file) {
+            fclose(file);
+        }
+        return nullptr;
+    }
+    block_store_t *replayed = block_store_create();
+    block_store_trace_record_t record;
+    while (replayed && fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.op == BLOCK_STORE_OP_REQUEST) {
+            block_store_request(replayed, record.block_id);
+        } else if (record.op == BLOCK_STORE_OP_RELEASE) {
+            EXPECT_NE(BITMAP_START_BLOCK, record.block_id);
+            block_store_release(replayed, record.block_id);
+        }
+    }
+    fclose(file);
+    return replayed;
+}
+
+TEST(block_store_trace, range_release_replays)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_trace_start(bs, "release.trace"));
+    for (size_t id = 100; id < 160; id++) {
+        ASSERT_EQ(id != BITMAP_START_BLOCK, block_store_request(bs, id));
+    }
+    ASSERT_EQ(true, block_store_release_range(bs, 100, 50, 0));
+    const size_t ids[] = {150, BITMAP_START_BLOCK};
+    ASSERT_EQ(true, block_store_release_list(bs, ids, 2, 0));
+    ASSERT_EQ(true, block_store_trace_stop(bs));
+
+    // Replayed the way hw3_replay does it, the bitmap block must survive.
+    block_store_t *replayed = replay_requests("release.trace");
+    ASSERT_NE(nullptr, replayed);
+    unlink("release.trace");
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(replayed));
+    ASSERT_EQ(9, block_store_get_used_blocks(replayed));
+    ASSERT_EQ(false, block_store_request(replayed, BITMAP_START_BLOCK));
+    ASSERT_EQ(true, block_store_check_used(replayed));
+    block_store_destroy(replayed);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_trace, compaction_replays)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(true, block_store_trace_start(bs, "compact.trace"));
+    for (size_t id = 200; id < BLOCK_STORE_NUM_BLOCKS; id += 5) {
+        ASSERT_EQ(true, block_store_request(bs, id));
+    }
+    while (block_store_compact(bs, 4, NULL, NULL, NULL) != 0) {
+    }
+    ASSERT_EQ(true, block_store_trace_stop(bs));
+
+    block_store_t *replayed = replay_requests("compact.trace");
+    ASSERT_NE(nullptr, replayed);
+    unlink("compact.trace");
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(replayed));
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; id++) {
+        ASSERT_EQ(block_store_request(bs, id), block_store_request(replayed, id)) << "block " << id;
+    }
+    block_store_destroy(replayed);
+    block_store_destroy(bs);
+}
+
+TEST(block_volume, round_robin_striping)
+{
+    block_volume_t *volume = block_volume_create(4, BLOCK_VOLUME_ROUND_ROBIN);
+    ASSERT_NE(nullptr, volume) << "block_volume_create returned NULL when it should not have\n";
+    ASSERT_EQ(4, block_volume_get_stores(volume));
+    ASSERT_EQ(4 * BLOCK_STORE_NUM_BLOCKS, block_volume_get_total_blocks(volume));
+
+    // Consecutive allocations should rotate through the stores.
+    for (size_t i = 0; i < 8; i++) {
+        ASSERT_EQ(i, block_volume_allocate(volume));
+    }
+    ASSERT_EQ(8, block_volume_get_used_blocks(volume));
+
+    ASSERT_EQ(true, block_volume_request(volume, 1000));
+    ASSERT_EQ(false, block_volume_request(volume, 1000));
+    ASSERT_EQ(false, block_volume_request(volume, 4 * BLOCK_STORE_NUM_BLOCKS));
+    block_volume_release(volume, 1000);
+    ASSERT_EQ(true, block_volume_request(volume, 1000));
+
+    ASSERT_EQ(SIZE_MAX, block_volume_allocate(NULL));
+    ASSERT_EQ(nullptr, block_volume_create(0, BLOCK_VOLUME_ROUND_ROBIN));
+    block_volume_destroy(volume);
+}
+
+TEST(block_volume, least_loaded)
+{
+    block_volume_t *volume = block_volume_create(3, BLOCK_VOLUME_LEAST_LOADED);
+    ASSERT_NE(nullptr, volume) << "block_volume_create returned NULL when it should not have\n";
+    // Load up stores 0 and 1, the next allocations should go to store 2.
+    ASSERT_EQ(true, block_volume_request(volume, 0));
+    ASSERT_EQ(true, block_volume_request(volume, 1));
+    ASSERT_EQ(2, block_volume_allocate(volume) % 3);
+    block_volume_destroy(volume);
+}
+
+TEST(block_volume, vectored_io_and_serialize)
+{
+    block_volume_t *volume = block_volume_create(3, BLOCK_VOLUME_ROUND_ROBIN);
+    ASSERT_NE(nullptr, volume) << "block_volume_create returned NULL when it should not have\n";
+
+    const size_t count = 30;
+    std::vector<size_t> ids;
+    std::vector<std::vector<char>> data(count, std::vector<char>(BLOCK_SIZE_BYTES));
+    std::vector<const void *> write_buffers;
+    for (size_t i = 0; i < count; i++) {
+        ids.push_back(block_volume_allocate(volume));
+        ASSERT_NE(SIZE_MAX, ids.back());
+        memset(data[i].data(), 'a' + (int) i, BLOCK_SIZE_BYTES);
+        write_buffers.push_back(data[i].data());
+    }
+    ASSERT_EQ(count * BLOCK_SIZE_BYTES, block_volume_writev(volume, ids.data(), count, write_buffers.data()));
+
+    const char *files[] = {"volume0.bs", "volume1.bs", "volume2.bs"};
+    ASSERT_EQ(3 * BLOCK_STORE_NUM_BYTES, block_volume_serialize(volume, files));
+    block_volume_destroy(volume);
+
+    volume = block_volume_deserialize(files, 3, BLOCK_VOLUME_ROUND_ROBIN);
+    ASSERT_NE(nullptr, volume) << "block_volume_deserialize returned NULL when it should not have\n";
+    ASSERT_EQ(count, block_volume_get_used_blocks(volume));
+
+    std::vector<std::vector<char>> read_data(count, std::vector<char>(BLOCK_SIZE_BYTES));
+    std::vector<void *> read_buffers;
+    for (size_t i = 0; i < count; i++) {
+        read_buffers.push_back(read_data[i].data());
+    }
+    // The first three ids are local block 0 of each store, which block_store_read rejects.
+    ASSERT_EQ((count - 3) * BLOCK_SIZE_BYTES, block_volume_readv(volume, ids.data(), count, read_buffers.data()));
+    for (size_t i = 3; i < count; i++) {
+        ASSERT_EQ(data[i], read_data[i]);
+    }
+
+    char single[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_volume_read(volume, ids[5], single));
+    ASSERT_EQ(0, memcmp(single, data[5].data(), BLOCK_SIZE_BYTES));
+    block_volume_destroy(volume);
+}
+
+TEST(block_parity, encode_and_recover)
+{
+    // an odd length leaves a tail for the scalar loop after the vector kernel
+    const size_t n_data = 5, length = 1000;
+    std::vector<std::vector<uint8_t>> original(n_data + 2, std::vector<uint8_t>(length));
+    for (size_t i = 0; i < n_data; i++) {
+        for (size_t j = 0; j < length; j++) {
+            original[i][j] = (uint8_t)(i * 131 + j * 7 + (j >> 5));
+        }
+    }
+    std::vector<const void *> data;
+    for (size_t i = 0; i < n_data; i++) {
+        data.push_back(original[i].data());
+    }
+    void *parity[] = {original[n_data].data(), original[n_data + 1].data()};
+    ASSERT_EQ(true, block_parity_encode(data.data(), n_data, parity, 2, length));
+    ASSERT_EQ(false, block_parity_encode(data.data(), n_data, parity, 3, length));
+
+    // P alone is the XOR of the data
+    for (size_t j = 0; j < length; j++) {
+        uint8_t sum = 0;
+        for (size_t i = 0; i < n_data; i++) {
+            sum ^= original[i][j];
+        }
+        ASSERT_EQ(sum, original[n_data][j]);
+    }
+
+    // any one or two buffers come back
+    for (size_t a = 0; a < n_data + 2; a++) {
+        for (size_t b = a; b < n_data + 2; b++) {
+            std::vector<std::vector<uint8_t>> copy = original;
+            std::vector<void *> buffers;
+            for (auto &buffer : copy) {
+                buffers.push_back(buffer.data());
+            }
+            const size_t lost[] = {a, b};
+            const size_t n_lost = a == b ? 1 : 2;
+            for (size_t i = 0; i < n_lost; i++) {
+                memset(buffers[lost[i]], 0xA5, length);
+            }
+            ASSERT_EQ(true, block_parity_recover(buffers.data(), n_data, 2, lost, n_lost, length));
+            ASSERT_EQ(original, copy) << "lost " << a << " and " << b;
+        }
+    }
+    std::vector<void *> buffers;
+    for (auto &buffer : original) {
+        buffers.push_back(buffer.data());
+    }
+    const size_t three[] = {0, 1, 2};
+    ASSERT_EQ(false, block_parity_recover(buffers.data(), n_data, 2, three, 3, length));
+
+    // updating with a delta matches encoding from scratch
+    std::vector<uint8_t> delta(length, 0x3C);
+    for (size_t j = 0; j < length; j++) {
+        original[3][j] ^= delta[j];
+    }
+    ASSERT_EQ(true, block_parity_update(3, delta.data(), parity, 2, length));
+    std::vector<uint8_t> p(length), q(length);
+    void *fresh[] = {p.data(), q.data()};
+    ASSERT_EQ(true, block_parity_encode(data.data(), n_data, fresh, 2, length));
+    ASSERT_EQ(p, original[n_data]);
+    ASSERT_EQ(q, original[n_data + 1]);
+}
+
+TEST(block_volume, parity_survives_lost_images)
+{
+    ASSERT_EQ(nullptr, block_volume_create_parity(3, 3, BLOCK_VOLUME_ROUND_ROBIN));
+    block_volume_t *volume = block_volume_create_parity(3, 2, BLOCK_VOLUME_ROUND_ROBIN);
+    ASSERT_NE(nullptr, volume) << "block_volume_create_parity returned NULL when it should not have\n";
+    ASSERT_EQ(2, block_volume_get_parity(volume));
+    ASSERT_EQ(0, block_volume_verify(volume));
+
+    // writes, allocations and releases all keep the parity in step
+    std::vector<size_t> ids;
+    char data[BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < 60; i++) {
+        ids.push_back(block_volume_allocate(volume));
+        ASSERT_NE(SIZE_MAX, ids.back());
+        memset(data, 'A' + (int)(i % 26), sizeof(data));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_volume_write(volume, ids.back(), data));
+    }
+    for (size_t i = 3; i < 60; i += 7) {
+        block_volume_release(volume, ids[i]);
+    }
+    memset(data, 'z', sizeof(data));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_volume_write(volume, 600, data));  // free, so not covered
+    ASSERT_EQ(0, block_volume_write(volume, BITMAP_START_BLOCK * 3 + 1, data));
+    ASSERT_EQ(0, block_volume_verify(volume));
+    const size_t used = block_volume_get_used_blocks(volume);
+
+    std::vector<std::vector<char>> before(60, std::vector<char>(BLOCK_SIZE_BYTES));
+    for (size_t i = 3; i < 60; i++) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_volume_read(volume, ids[i], before[i].data()));
+    }
+    const char *files[] = {"volume0.bs", "volume1.bs", "volume2.bs", "volume.p", "volume.q"};
+    ASSERT_EQ(5 * BLOCK_STORE_NUM_BYTES, block_volume_serialize(volume, files));
+    block_volume_destroy(volume);
+
+    // lose a store outright and a parity image to a truncation
+    unlink(files[0]);
+    ASSERT_EQ(0, truncate(files[4], 100));
+    volume = block_volume_deserialize_parity(files, 3, 2, BLOCK_VOLUME_ROUND_ROBIN);
+    ASSERT_NE(nullptr, volume) << "block_volume_deserialize_parity returned NULL when it should not have\n";
+    ASSERT_EQ(2, block_volume_get_missing(volume));
+    ASSERT_EQ(SIZE_MAX, block_volume_verify(volume));
+    ASSERT_EQ(used, block_volume_get_used_blocks(volume));
+
+    // reads of the lost store are rebuilt, the other stores still take writes
+    std::vector<std::vector<char>> after(60, std::vector<char>(BLOCK_SIZE_BYTES));
+    std::vector<void *> buffers;
+    for (size_t i = 0; i < 60; i++) {
+        buffers.push_back(after[i].data());
+    }
+    ASSERT_EQ(57 * BLOCK_SIZE_BYTES, block_volume_readv(volume, ids.data(), 60, buffers.data()));
+    for (size_t i = 4; i < 60; i++) {
+        if ((i - 3) % 7 != 0) {
+            ASSERT_EQ(before[i], after[i]) << "block " << ids[i];
+        }
+    }
+    const size_t id = block_volume_allocate(volume);
+    ASSERT_NE(SIZE_MAX, id);
+    ASSERT_NE(0, id % 3);
+    ASSERT_EQ(0, block_volume_write(volume, ids[3], data));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_volume_write(volume, ids[4], data));
+    memcpy(before[4].data(), data, BLOCK_SIZE_BYTES);
+
+    ASSERT_EQ(2, block_volume_rebuild(volume));
+    ASSERT_EQ(0, block_volume_get_missing(volume));
+    ASSERT_EQ(0, block_volume_verify(volume));
+    // released blocks count as zeroes, so only allocated ones are compared
+    for (size_t i = 4; i < 60; i++) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_volume_read(volume, ids[i], after[i].data()));
+        if ((i - 3) % 7 != 0) {
+            ASSERT_EQ(before[i], after[i]) << "block " << ids[i];
+        }
+    }
+    ASSERT_EQ(5 * BLOCK_STORE_NUM_BYTES, block_volume_serialize(volume, files));
+    block_volume_destroy(volume);
+
+    // three lost images are more than two parity images can cover
+    unlink(files[0]);
+    unlink(files[1]);
+    unlink(files[3]);
+    ASSERT_EQ(nullptr, block_volume_deserialize_parity(files, 3, 2, BLOCK_VOLUME_ROUND_ROBIN));
+    unlink(files[2]);
+    unlink(files[4]);
+}
+
+TEST(block_store_serialize, parallel_round_trip)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    char data[BLOCK_SIZE_BYTES];
+    // Spread blocks over every chunk so each worker has something to do.
+    for (size_t id = 1; id < BLOCK_STORE_NUM_BLOCKS; id += 5) {
+        memset(data, (int) id, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(true, block_store_request(bs, id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, data));
+    }
+    const size_t used = block_store_get_used_blocks(bs);
+
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize_parallel(bs, "parallel.bs", 4));
+    block_store_destroy(bs);
+    struct stat st;
+    ASSERT_EQ(0, stat("parallel.bs", &st));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, st.st_size);
+    ASSERT_NE(0, stat("parallel.bs.tmp", &st)) << "temporary image was left behind\n";
+
+    // Read it back with a different thread count, and with the serial reader.
+    block_store_t *parallel = block_store_deserialize_parallel("parallel.bs", 3);
+    block_store_t *serial = block_store_deserialize("parallel.bs");
+    ASSERT_NE(nullptr, parallel) << "block_store_deserialize_parallel returned a null pointer\n";
+    ASSERT_NE(nullptr, serial);
+    ASSERT_EQ(used, block_store_get_used_blocks(parallel));
+    ASSERT_EQ(0, block_store_diff(parallel, serial, NULL, NULL));
+    char read_buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 1; id < BLOCK_STORE_NUM_BLOCKS; id += 5) {
+        memset(data, (int) id, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(parallel, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, data, BLOCK_SIZE_BYTES));
+    }
+    block_store_destroy(serial);
+    block_store_destroy(parallel);
+    unlink("parallel.bs");
+
+    ASSERT_EQ(nullptr, block_store_deserialize_parallel("does_not_exist.bs", 2));
+    ASSERT_EQ(0, block_store_serialize_parallel(NULL, "parallel.bs", 2));
+}
+
+static void count_completion(block_async_request_t *request, void *arg)
+{
+    static_cast<std::atomic<size_t> *>(arg)->fetch_add(request->result);
+}
+
+TEST(block_async, completion_queue_and_callbacks)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    block_async_t *async = block_async_create(bs, 2, 4);
+    ASSERT_NE(nullptr, async);
+    ASSERT_NE(-1, block_async_fd(async));
+
+    // allocate through the queue, waiting on the eventfd like an event loop would
+    std::vector<block_async_request_t> allocs(8);
+    for (block_async_request_t &request : allocs)
+    {
+        request = block_async_request_t();
+        request.op = BLOCK_ASYNC_ALLOCATE;
+        ASSERT_EQ(true, block_async_submit(async, &request, true));
+    }
+    std::vector<size_t> ids;
+    while (ids.size() < allocs.size())
+    {
+        struct pollfd pfd = {block_async_fd(async), POLLIN, 0};
+        ASSERT_EQ(1, poll(&pfd, 1, 5000));
+        block_async_request_t *done[4];
+        size_t n = block_async_reap(async, done, 4);
+        for (size_t i = 0; i < n; i++)
+        {
+            ids.push_back(done[i]->result);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    ASSERT_EQ((std::vector<size_t>{0, 1, 2, 3, 4, 5, 6, 7}), ids);
+
+    // writes complete through a callback, then a sync saves them all
+    std::atomic<size_t> written(0);
+    std::vector<std::vector<char>> data(7, std::vector<char>(BLOCK_SIZE_BYTES));
+    std::vector<block_async_request_t> writes(7);
+    for (size_t i = 0; i < writes.size(); i++)
+    {
+        data[i][0] = 'a' + i;
+        writes[i] = block_async_request_t();
+        writes[i].op = BLOCK_ASYNC_WRITE;
+        writes[i].block_id = i + 1;
+        writes[i].buffer = data[i].data();
+        writes[i].callback = count_completion;
+        writes[i].arg = &written;
+        ASSERT_EQ(true, block_async_submit(async, &writes[i], true));
+    }
+    block_async_request_t sync = block_async_request_t();
+    sync.op = BLOCK_ASYNC_SYNC;
+    sync.filename = "async.bs";
+    ASSERT_EQ(true, block_async_submit(async, &sync, true));
+    block_async_request_t *done = NULL;
+    while (block_async_reap(async, &done, 1) == 0)
+    {
+        struct pollfd pfd = {block_async_fd(async), POLLIN, 0};
+        ASSERT_EQ(1, poll(&pfd, 1, 5000));
+    }
+    ASSERT_EQ(&sync, done);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, sync.result);
+    ASSERT_EQ(7 * BLOCK_SIZE_BYTES, written.load());
+
+    block_async_destroy(async);
+    block_async_destroy(NULL);
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("async.bs");
+    ASSERT_NE(nullptr, bs);
+    char back[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 7, back));
+    ASSERT_EQ('g', back[0]);
+    block_store_destroy(bs);
+    unlink("async.bs");
+}
+
+TEST(block_server, clients_mirror_the_store)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    block_server_t *server = block_server_create(bs, "test.sock", "server.bs", 8);
+    ASSERT_NE(nullptr, server) << "block_server_create returned NULL when it should not have\n";
+    std::thread serving([server]() { ASSERT_EQ(true, block_server_run(server)); });
+
+    block_client_t *a = block_client_connect("test.sock");
+    block_client_t *b = block_client_connect("test.sock");
+    ASSERT_NE(nullptr, a);
+    ASSERT_NE(nullptr, b);
+    ASSERT_EQ(nullptr, block_client_connect("no-such.sock"));
+
+    // one client's writes are the other's reads
+    char data[BLOCK_SIZE_BYTES] = "over the socket";
+    char back[BLOCK_SIZE_BYTES] = {0};
+    ASSERT_NE(SIZE_MAX, block_client_allocate(a));
+    const size_t id = 5;
+    ASSERT_EQ(true, block_client_request(a, id));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_client_write(a, id, data));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_client_read(b, id, back));
+    ASSERT_STREQ(data, back);
+    ASSERT_EQ(false, block_client_request(b, id));
+    ASSERT_EQ(0, block_client_read(b, id, NULL));
+    ASSERT_EQ(0, block_client_write(b, BLOCK_STORE_NUM_BLOCKS, data));
+
+    // a batch bigger than the ring goes in several round trips
+    std::vector<size_t> ids;
+    for (size_t block_id = 10; block_id < 30; block_id++)
+    {
+        ASSERT_EQ(true, block_client_request(a, block_id));
+        ids.push_back(block_id);
+    }
+    std::vector<std::vector<char>> blocks(ids.size(), std::vector<char>(BLOCK_SIZE_BYTES));
+    std::vector<const void *> sources;
+    std::vector<void *> targets;
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        blocks[i].assign(BLOCK_SIZE_BYTES, static_cast<char>('a' + i));
+        sources.push_back(blocks[i].data());
+    }
+    ASSERT_EQ(ids.size() * BLOCK_SIZE_BYTES, block_client_writev(a, ids.data(), ids.size(), sources.data()));
+    std::vector<std::vector<char>> read_back(ids.size(), std::vector<char>(BLOCK_SIZE_BYTES));
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        targets.push_back(read_back[i].data());
+    }
+    ASSERT_EQ(ids.size() * BLOCK_SIZE_BYTES, block_client_readv(b, ids.data(), ids.size(), targets.data()));
+    ASSERT_EQ(blocks, read_back);
+
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_client_get_used_blocks(a));
+    ASSERT_EQ(block_store_get_free_blocks(bs), block_client_get_free_blocks(b));
+    block_client_release(b, 10);
+    ASSERT_EQ(true, block_client_request(a, 10));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_client_serialize(a));
+
+    // a client flooding requests without reading the results holds up only itself
+    int flood = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, "test.sock");
+    ASSERT_EQ(0, connect(flood, (struct sockaddr *)&address, sizeof(address)));
+    const block_server_request_t used = {BLOCK_SERVER_OP_USED, 0, 0};
+    struct pollfd writable = {flood, POLLOUT, 0};
+    while (send(flood, &used, sizeof(used), MSG_NOSIGNAL) == sizeof(used) || poll(&writable, 1, 100) == 1) {
+    }
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_client_get_used_blocks(b));
+    close(flood);
+
+    block_server_stop(server);
+    serving.join();
+    block_server_destroy(server);
+
+    // the server is gone, calls fail instead of hanging
+    ASSERT_EQ(SIZE_MAX, block_client_allocate(a));
+    ASSERT_EQ(0, block_client_read(a, id, back));
+    block_client_disconnect(a);
+    block_client_disconnect(b);
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("server.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 29, back));
+    ASSERT_EQ('a' + 19, back[0]);
+    block_store_destroy(bs);
+    unlink("server.bs");
+}
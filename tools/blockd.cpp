@@ -0,0 +1,78 @@
+// Serves a block store to other processes over a Unix domain socket.
+//
+//   hw3_blockd SOCKET [--image FILE] [--slots N]
+//
+// The store is loaded from --image if it exists and written back to it when
+// the daemon gets SIGINT or SIGTERM; it is also the only file clients can have
+// the store serialized to, and without it they can't serialize at all. Clients connect with block_client_connect;
+// --slots sets the size of each connection's shared-memory ring.
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "block_server.h"
+#include "block_store.h"
+
+namespace {
+
+block_server_t *running_server = nullptr;
+
+extern "C" void handle_stop(int) {
+    block_server_stop(running_server);
+}
+
+void usage(const char *program) {
+    std::cerr << "usage: " << program << " SOCKET [--image FILE] [--slots N]" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc % 2 != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *image = nullptr;
+    size_t slots = 0;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        const std::string arg = argv[i];
+        if (arg == "--image") {
+            image = argv[i + 1];
+        } else if (arg == "--slots") {
+            slots = strtoull(argv[i + 1], nullptr, 10);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    block_store_t *bs = image && access(image, F_OK) == 0 ? block_store_deserialize(image) : block_store_create();
+    if (!bs) {
+        std::cerr << (image ? image : "block store") << ": could not load" << std::endl;
+        return 1;
+    }
+    block_server_t *server = block_server_create(bs, argv[1], image, slots);
+    if (!server) {
+        perror(argv[1]);
+        block_store_destroy(bs);
+        return 1;
+    }
+
+    running_server = server;
+    struct sigaction action = {};
+    action.sa_handler = handle_stop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    bool ok = block_server_run(server);
+    block_server_destroy(server);
+    if (image && block_store_serialize(bs, image) != BLOCK_STORE_NUM_BYTES) {
+        std::cerr << image << ": could not save" << std::endl;
+        ok = false;
+    }
+    block_store_destroy(bs);
+    return ok ? 0 : 1;
+}
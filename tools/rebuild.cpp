@@ -0,0 +1,81 @@
+// Repairs the images of a block volume kept with parity.
+//
+//   hw3_rebuild [--verify] --parity N STORE... PARITY...
+//
+// The last N files are the parity images, in the order block_volume_serialize
+// wrote them. Images that are missing or fail to load are rebuilt from the rest
+// and the volume is written back. With --verify a whole volume's parity is
+// checked against its stores instead, and disagreeing blocks are reported.
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "block_volume.h"
+
+namespace {
+
+void usage(const char *program) {
+    std::cerr << "usage: " << program << " [--verify] --parity N STORE... PARITY..." << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    bool verify = false;
+    size_t n_parity = 0;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--verify") {
+            verify = true;
+        } else if (arg == "--parity" && i + 1 < argc) {
+            n_parity = strtoull(argv[++i], nullptr, 10);
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (n_parity == 0 || n_parity > BLOCK_PARITY_MAX || files.size() <= n_parity) {
+        usage(argv[0]);
+        return 2;
+    }
+    const size_t n_stores = files.size() - n_parity;
+
+    block_volume_t *volume = block_volume_deserialize_parity(files.data(), n_stores, n_parity, BLOCK_VOLUME_ROUND_ROBIN);
+    if (!volume) {
+        std::cerr << "too many images lost to rebuild" << std::endl;
+        return 1;
+    }
+
+    const size_t missing = block_volume_get_missing(volume);
+    if (verify) {
+        if (missing != 0) {
+            std::cerr << missing << " image(s) lost, rebuild before verifying" << std::endl;
+            block_volume_destroy(volume);
+            return 1;
+        }
+        const size_t mismatched = block_volume_verify(volume);
+        block_volume_destroy(volume);
+        if (mismatched == SIZE_MAX) {
+            std::cerr << "could not verify" << std::endl;
+            return 1;
+        }
+        std::cout << mismatched << " block(s) disagree with the parity (" << block_parity_kernel() << ")" << std::endl;
+        return mismatched == 0 ? 0 : 1;
+    }
+
+    if (missing == 0) {
+        std::cout << "nothing to rebuild" << std::endl;
+        block_volume_destroy(volume);
+        return 0;
+    }
+    bool ok = block_volume_rebuild(volume) == missing &&
+              block_volume_serialize(volume, files.data()) == files.size() * BLOCK_STORE_NUM_BYTES;
+    block_volume_destroy(volume);
+    if (!ok) {
+        std::cerr << "rebuild failed" << std::endl;
+        return 1;
+    }
+    std::cout << "rebuilt " << missing << " image(s)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,195 @@
+// Replays a block store trace recorded with block_store_trace_start.
+//
+//   hw3_replay TRACE [--timing fast|original] [--threads N]
+//
+// --timing fast (default) issues calls back to back; original waits until each
+// call's recorded offset from the start. --threads 1 (default) replays the whole
+// trace in order on one thread; N > 1 spreads the recorded threads over N
+// replay threads sharing one store behind a mutex. Prints throughput and
+// per-operation latency percentiles.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "block_store.h"
+
+namespace {
+
+typedef std::chrono::steady_clock replay_clock;
+
+const char *const op_names[BLOCK_STORE_OP_COUNT] = {"allocate", "request", "release", "read", "write",
+                                                    "serialize", "deserialize", "ffz"};
+
+bool load_trace(const char *path, std::vector<block_store_trace_record_t> &records) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    block_store_trace_header_t header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == BLOCK_STORE_TRACE_MAGIC &&
+              header.version == BLOCK_STORE_TRACE_VERSION && header.record_bytes == sizeof(block_store_trace_record_t);
+    if (ok) {
+        block_store_trace_record_t record;
+        while (fread(&record, sizeof(record), 1, file) == 1) {
+            records.push_back(record);
+        }
+    } else {
+        std::cerr << path << ": not a block store trace" << std::endl;
+    }
+    fclose(file);
+    return ok;
+}
+
+// Replay state shared by all replay threads.
+struct replayer {
+    block_store_t *bs;
+    std::mutex lock;
+    bool original_timing;
+    replay_clock::time_point start;
+    // allocate may hand out different ids than it did when recording
+    std::map<uint64_t, size_t> allocated;
+    std::vector<std::vector<uint64_t>> latencies;
+
+    replayer() : bs(block_store_create()), original_timing(false), latencies(BLOCK_STORE_OP_COUNT) {}
+    ~replayer() { block_store_destroy(bs); }
+
+    size_t map_id(uint64_t id) {
+        std::map<uint64_t, size_t>::const_iterator found = allocated.find(id);
+        return found == allocated.end() ? id : found->second;
+    }
+
+    void apply(const block_store_trace_record_t &record, std::vector<std::vector<uint64_t>> &local) {
+        if (original_timing) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.timestamp_ns));
+        }
+        char buffer[BLOCK_SIZE_BYTES];
+        memset(buffer, static_cast<int>(record.block_id), sizeof(buffer));
+
+        std::lock_guard<std::mutex> guard(lock);
+        replay_clock::time_point begin = replay_clock::now();
+        switch (record.op) {
+            case BLOCK_STORE_OP_ALLOCATE: {
+                size_t id = block_store_allocate(bs);
+                if (record.success && id != SIZE_MAX) {
+                    allocated[record.block_id] = id;
+                }
+                break;
+            }
+            case BLOCK_STORE_OP_REQUEST:
+                block_store_request(bs, map_id(record.block_id));
+                break;
+            case BLOCK_STORE_OP_RELEASE:
+                block_store_release(bs, map_id(record.block_id));
+                allocated.erase(record.block_id);
+                break;
+            case BLOCK_STORE_OP_READ:
+                block_store_read(bs, map_id(record.block_id), buffer);
+                break;
+            case BLOCK_STORE_OP_WRITE:
+                block_store_write(bs, map_id(record.block_id), buffer);
+                break;
+            case BLOCK_STORE_OP_SERIALIZE:
+                block_store_serialize(bs, "hw3_replay.bs");
+                break;
+            default:
+                return;
+        }
+        local[record.op].push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(replay_clock::now() - begin).count());
+    }
+};
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+void usage(const char *program) {
+    std::cerr << "usage: " << program << " TRACE [--timing fast|original] [--threads N]" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 2;
+    }
+    replayer replay;
+    unsigned thread_count = 1;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        const std::string arg = argv[i];
+        if (arg == "--timing") {
+            replay.original_timing = std::string(argv[i + 1]) == "original";
+        } else if (arg == "--threads") {
+            thread_count = std::max(1, atoi(argv[i + 1]));
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argc % 2 != 0 || !replay.bs) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<block_store_trace_record_t> records;
+    if (!load_trace(argv[1], records)) {
+        return 1;
+    }
+
+    // each recorded thread is replayed in order by one replay thread
+    std::vector<std::vector<block_store_trace_record_t>> work(thread_count);
+    std::map<uint32_t, size_t> owner;
+    for (const block_store_trace_record_t &record : records) {
+        std::map<uint32_t, size_t>::iterator found = owner.find(record.thread_id);
+        if (found == owner.end()) {
+            found = owner.insert(std::make_pair(record.thread_id, owner.size() % thread_count)).first;
+        }
+        work[found->second].push_back(record);
+    }
+
+    std::vector<std::vector<std::vector<uint64_t>>> latencies(
+        thread_count, std::vector<std::vector<uint64_t>>(BLOCK_STORE_OP_COUNT));
+    replay.start = replay_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t]() {
+            for (const block_store_trace_record_t &record : work[t]) {
+                replay.apply(record, latencies[t]);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(replay_clock::now() - replay.start).count();
+    remove("hw3_replay.bs");
+
+    printf("replayed %zu calls from %zu threads on %u threads in %.3f s (%.0f ops/s)\n", records.size(),
+           owner.size(), thread_count, seconds, records.size() / seconds);
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n", "op", "count", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns",
+           "max ns");
+    for (size_t op = 0; op < BLOCK_STORE_OP_COUNT; ++op) {
+        std::vector<uint64_t> merged;
+        for (unsigned t = 0; t < thread_count; ++t) {
+            merged.insert(merged.end(), latencies[t][op].begin(), latencies[t][op].end());
+        }
+        if (merged.empty()) {
+            continue;
+        }
+        std::sort(merged.begin(), merged.end());
+        printf("%-12s %10zu %10llu %10llu %10llu %10llu %10llu\n", op_names[op], merged.size(),
+               (unsigned long long) percentile(merged, 0.5), (unsigned long long) percentile(merged, 0.9),
+               (unsigned long long) percentile(merged, 0.99), (unsigned long long) percentile(merged, 0.999),
+               (unsigned long long) merged.back());
+    }
+    return 0;
+}